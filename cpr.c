@@ -35,14 +35,19 @@
  * performed instead.
  */
 
+#include "cpr.h"
 #include "libcpr.h"
 
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -53,93 +58,17 @@
 /*============================================================================*/
 
 /**
- * Bitfield defining the various attributes to copy from the source to
- * destination file.
- *
- * @{
- */
-
-typedef uint8_t preserve_mode_t;
-
-#define PRESERVE_MODE_OWNER   0x01
-#define PRESERVE_MODE_TIMES   0x02
-#define PRESERVE_MODE_PERMS   0x04
-
-#define PRESERVE_MODE_NONE    0x00
-#define PRESERVE_MODE_ALL     (PRESERVE_MODE_OWNER | PRESERVE_MODE_TIMES | \
-                               PRESERVE_MODE_PERMS)
-#define PRESERVE_MODE_DEFAULT PRESERVE_MODE_NONE
-
-/** @} */
-
-/*============================================================================*/
-
-/**
- * Describe whether to clone the entire file with FICLONE or just a range of
- * it with FICLONERANGE.
+ * State of the Chrome trace-event file being written while -T is in effect.
+ * The trace hook may be called from any thread so writes are serialised.
  */
 
-typedef enum _clone_mode_t
-{
-  CLONE_MODE_FILE,
-  CLONE_MODE_RANGE,
-} clone_mode_t;
-
-/*============================================================================*/
-
-/** Structure to contain details of the entire clone operation. */
-
-typedef struct _operation_t
+typedef struct _trace_file_t
 {
-  /**
-   * Command-line supplied arguments:
-   * @{
-   */
-  bool            fallback_copy;
-  size_t          block_size;
-  const char     *src_filename;
-  const char     *dst_filename;
-  bool            force;
-  preserve_mode_t preserve_mode;
-  clone_mode_t    clone_mode;
-  uint64_t        src_offset;
-  uint64_t        src_length;
-  uint64_t        dst_offset;
-  /** @} */
-
-  /**
-   * Internally generated status.
-   * @{
-   */
-  int             src_fd;
-  int             dst_fd;
-  /** @} */
-} operation_t;
-
-/*============================================================================*/
-
-/**
- * Macro to abort on some programming errors. Re-implemented here to keep
- * this program completely self-contained.
- *
- * @param[in] cond_ Assert condition. Fail if false.
- * @param[in] fmt_  Printf-style constant literal format string.
- * @param[in] ...   Arguments to match @p fmt_.
- */
-
-#define AS(cond_, fmt_, ...)                                     \
-  do {                                                           \
-    if (!(cond_))                                                \
-    {                                                            \
-      fprintf(stderr,                                            \
-              "An assertion failed at %s:%d (%s). Details:\n\n"  \
-              fmt_                                               \
-              "\n",                                              \
-              __FILE__, __LINE__, __func__, ##__VA_ARGS__);      \
-      fflush(stderr);                                            \
-      abort();                                                   \
-    }                                                            \
-  } while (0)
+  pthread_mutex_t lock;
+  FILE           *p_file;
+  pid_t           pid;
+  bool            first_event;
+} trace_file_t;
 
 /*============================================================================*/
 
@@ -171,26 +100,113 @@ static void print_usage_and_exit (const char *argv0, const char *fmt, ...)
   }
 
   fprintf(stderr,
-          "USAGE: %s [-?] [-aotp] [-f] [-c] <SRC_FILE> <DST_FILE>             (1)\n"
-          "       %s [-s SRC_OFFSET] [-d DST_OFFSET] [-l LENGTH] [-aotp] [-c] (2)\n"
+          "USAGE: %s [-?] [-aotp] [-f] [-c] [-V] [-j JOURNAL] [-T TRACE_FILE] (1)\n"
+          "          [-r RATE] [-i IOPS] [-B BLOCK_SIZE] [-C THRESHOLD] [-H]\n"
+          "          [-k] [-P] [-U SOCKET] [-n] [-Q PROFILE]\n"
           "          <SRC_FILE> <DST_FILE>\n"
+          "       %s [-s SRC_OFFSET] [-d DST_OFFSET] [-l LENGTH] [-aotp] [-c] (2)\n"
+          "          [-V] [-j JOURNAL] [-T TRACE_FILE] [-r RATE] [-i IOPS]\n"
+          "          [-B BLOCK_SIZE] [-C THRESHOLD] [-H] [-k] [-P]\n"
+          "          [-U SOCKET] [-n] [-Q PROFILE] <SRC_FILE> <DST_FILE>\n"
+          "       %s -M [-aotp] [-f] [-c] [-V] [-T TRACE_FILE] [-r RATE]      (3)\n"
+          "          [-i IOPS] [-B BLOCK_SIZE] <SRC_FILE> <DST_FILE>\n"
+          "          [<DST_FILE> ...]\n"
+          "       %s [-R] [-S] [-aotp] [-f] [-c] [-T TRACE_FILE] [-r RATE]    (4)\n"
+          "          [-i IOPS] [-V] [-B BLOCK_SIZE] [-C THRESHOLD] [-H] [-k] [-P]\n"
+          "          [-w WORKERS] [-n] [-Q PROFILE] [-u CHECK]\n"
+          "          <SRC> [<SRC> ...] <DST_DIR>\n"
+          "       %s -D SOCKET [-w WORKERS] [-T TRACE_FILE] [-r RATE]         (5)\n"
+          "          [-i IOPS]\n"
+          "       %s -X [-B BLOCK_SIZE] [-m INDEX_MEMORY] [-T TRACE_FILE]     (6)\n"
+          "          <PATH> [<PATH> ...]\n"
+          "       %s -E [-s SRC_OFFSET] [-d DST_OFFSET] [-l LENGTH]          (7)\n"
+          "          [-w WORKERS] [-T TRACE_FILE] <SRC_FILE> <DST_FILE>\n"
           "\n"
           "WHERE:\n"
           "  SRC_FILE    Input filename.\n"
           "  DST_FILE    Output filename.\n"
           "  -a          Equivalent to -otp.\n"
+          "  -B          Bytes the fallback copy reads and writes at a time.\n"
+          "              Defaults to 8192. With -X, the size of the blocks\n"
+          "              hashed, a multiple of 4096 defaulting to 131072.\n"
           "  -c          Fall back to copy read/write copy if FICLONE fails.\n"
+          "  -C          With -c, copy sources of THRESHOLD bytes or less\n"
+          "              without trying FICLONE first.\n"
           "  -d          Offset into destination file to begin stitching.\n"
           "              Defaults to zero (beginning) if omitted.\n"
+          "  -D          Run as a daemon serving clone requests on the Unix\n"
+          "              socket SOCKET until interrupted.\n"
+          "  -E          Compare SRC_FILE with DST_FILE instead of cloning.\n"
+          "  -k          Keep ranges of the source that share storage\n"
+          "              shared in a fallback copy: write the data of each\n"
+          "              of the source's extents once and clone the\n"
+          "              destination from itself for the repeats. Implies\n"
+          "              -P.\n"
           "  -l          Length to copy. Defaults to zero (copy to end of\n"
           "              SRC_FILE) if omitted.\n"
+          "  -m          Bytes of memory for the index of -X. Defaults to\n"
+          "              268435456, enough for 16M blocks.\n"
+          "  -M          Clone SRC_FILE into every DST_FILE given, reading\n"
+          "              SRC_FILE only once for all of the fallback copies.\n"
+          "  -n          Plan the clone without writing any data: try a\n"
+          "              one-block FICLONERANGE of each file into an\n"
+          "              O_TMPFILE in the destination directory, map its\n"
+          "              data and holes, and print how many bytes would be\n"
+          "              cloned, copied or fail. With -Q, also estimate how\n"
+          "              long it would take.\n"
           "  -o          Preserve ownership.\n"
           "  -t          Preserve timestamps.\n"
           "  -p          Preserve permissions.\n"
+          "  -P          Make the fallback copy read the source's extents in\n"
+          "              order of their position on disk rather than in file\n"
+          "              order. Use for fragmented files on rotational disks.\n"
+          "  -Q          Add the measured throughput of this run's clones\n"
+          "              and copies to the totals in PROFILE. With -n, read\n"
+          "              the totals to estimate the time instead.\n"
+          "  -R          Clone directories named by SRC recursively.\n"
+          "  -S          Batch the open, stat, sync and close calls of\n"
+          "              USAGE (4) through io_uring. Use for trees of many\n"
+          "              small files.\n"
           "  -f          Force overwriting DST_FILE. Implied if -s,-d,-l\n"
           "              are supplied.\n"
+          "  -H          Back the fallback copy's buffer with huge pages when\n"
+          "              BLOCK_SIZE is at least 2 MiB, and report which kind\n"
+          "              of pages it got.\n"
+          "  -i          Limit the fallback copy to IOPS read/write calls\n"
+          "              per second.\n"
+          "  -j          Make the fallback copy resumable by checkpointing\n"
+          "              progress to JOURNAL. If JOURNAL exists, DST_FILE is\n"
+          "              reopened without truncation and the copy resumes\n"
+          "              from the last verified checkpoint, or starts over\n"
+          "              if JOURNAL does not match the request.\n"
+          "  -r          Limit the fallback copy to RATE bytes per second.\n"
           "  -s          Offset into source file to begin copying from.\n"
           "              Defaults to zero (beginning) if omitted.\n"
+          "  -T          Record every system call libcpr makes to TRACE_FILE\n"
+          "              in Chrome trace-event JSON format. Load it in\n"
+          "              chrome://tracing or ui.perfetto.dev.\n"
+          "  -u          Skip files whose destination is up to date, cloning\n"
+          "              only the rest. Requires -t. CHECK is mtime to\n"
+          "              compare size and modification time, ctime to also\n"
+          "              require the source's change time to be no later\n"
+          "              than the destination's, or digest to also compare\n"
+          "              a digest of the source's data with the one stored\n"
+          "              in the destination's user.cpr.digest attribute.\n"
+          "              The digest is a 64-bit non-cryptographic hash, so\n"
+          "              a change can go unnoticed, if rarely.\n"
+          "              The checks run on WORKERS threads.\n"
+          "  -U          Have the daemon serving SOCKET do the clone. Cannot\n"
+          "              be combined with -j.\n"
+          "  -V          Verify from the file systems' extent maps, without\n"
+          "              reading any data, that each destination shares its\n"
+          "              storage with the source, and fail if it does not.\n"
+          "              Byte totals are printed at the end.\n"
+          "  -w          Number of worker threads. The daemon defaults to\n"
+          "              the number of CPUs. USAGE (4) defaults to one, and\n"
+          "              with more clones the largest files first, splitting\n"
+          "              any much larger than the rest into ranges. -E\n"
+          "              defaults to the number of CPUs.\n"
+          "  -X          Deduplicate the files below each PATH.\n"
           "  -?          Display this help text.\n"
           "\n"
           "USAGE (1) will stitch the whole of SRC_FILE into DST_FILE, making\n"
@@ -207,8 +223,40 @@ static void print_usage_and_exit (const char *argv0, const char *fmt, ...)
           "\n"
           "It is possible to emulate USAGE(1) with USAGE(2) by supplying zero\n"
           "for SRC_OFFSET, DST_OFFSET and LENGTH.\n"
+          "\n"
+          "USAGE (3) behaves as USAGE (1) for each DST_FILE. FICLONE is tried\n"
+          "for each DST_FILE in turn and, with -c, those where it failed are\n"
+          "written in parallel from a single read of SRC_FILE.\n"
+          "\n"
+          "USAGE (4) behaves as USAGE (1) for each regular file named by SRC,\n"
+          "or found below it with -R, cloning it to the same relative path\n"
+          "under DST_DIR. Directories and symbolic links are recreated; other\n"
+          "file types are skipped. Paths that are hard links to the same file\n"
+          "are cloned once and linked to each other again under DST_DIR. If\n"
+          "DST_DIR does not exist and there is a single SRC, SRC itself is\n"
+          "cloned as DST_DIR. Errors on one file are reported and the rest\n"
+          "are still cloned.\n"
+          "\n"
+          "USAGE (5) runs cpr as a daemon so that other processes can clone\n"
+          "through it with -U, or with qtm_clone_remote() from libcpr, rather\n"
+          "than starting cpr for every file. Each request carries its open\n"
+          "source and destination files over SOCKET. SIGINT or SIGTERM stop\n"
+          "the daemon once the requests it has received are answered.\n"
+          "\n"
+          "USAGE (6) reads every regular file named by PATH, or found below\n"
+          "it, in blocks of BLOCK_SIZE and has the file system share the\n"
+          "storage of blocks found more than once. The kernel compares the\n"
+          "data before sharing it. Symbolic links are not followed. Once the\n"
+          "index is full some duplicates are missed; a warning says so.\n"
+          "\n"
+          "USAGE (7) checks that DST_FILE holds the same data as SRC_FILE, or\n"
+          "the ranges given do, without cloning anything. Ranges the extent\n"
+          "maps show to share storage, or to be holes in both files, are not\n"
+          "read. The rest is read on WORKERS threads, stopping at the first\n"
+          "difference, whose offset is printed. The exit status is zero only\n"
+          "if they are equal.\n"
           "\n",
-          argv0, argv0);
+          argv0, argv0, argv0, argv0, argv0, argv0, argv0);
 
   fflush(stderr);
 
@@ -267,9 +315,13 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
 {
   AS(p_operation != NULL, "NULL p_operation pointer.");
 
+  bool fanout       = false;
+  bool dedupe       = false;
+  bool index_memory = false;
+
   for (;;)
   {
-    int opt = getopt(argc, argv, "acd:fl:ops:t");
+    int opt = getopt(argc, argv, "aB:cC:d:D:EfHi:j:kl:m:MnoPpQ:r:Rs:StT:u:U:Vw:X");
 
     if (opt == -1)
     {
@@ -284,12 +336,32 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
         break;
       }
 
+      case 'B':
+      {
+        p_operation->block_size =
+          parse_uint64(optarg, argv[0], "Failed to parse BLOCK_SIZE: %s");
+
+        if (p_operation->block_size == 0)
+        {
+          print_usage_and_exit(argv[0], "BLOCK_SIZE must be at least one.");
+        }
+
+        break;
+      }
+
       case 'c':
       {
         p_operation->fallback_copy = true;
         break;
       }
 
+      case 'C':
+      {
+        p_operation->reflink_threshold =
+          parse_uint64(optarg, argv[0], "Failed to parse THRESHOLD: %s");
+        break;
+      }
+
       case 'd':
       {
         p_operation->clone_mode = CLONE_MODE_RANGE;
@@ -298,12 +370,49 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
         break;
       }
 
+      case 'D':
+      {
+        p_operation->daemon_socket = optarg;
+        break;
+      }
+
+      case 'E':
+      {
+        p_operation->compare = true;
+        break;
+      }
+
       case 'f':
       {
         p_operation->force = true;
         break;
       }
 
+      case 'H':
+      {
+        p_operation->clone_flags |= QTM_CLONE_FLAG_HUGE_PAGES;
+        break;
+      }
+
+      case 'i':
+      {
+        p_operation->throttle_ops =
+          parse_uint64(optarg, argv[0], "Failed to parse IOPS: %s");
+        break;
+      }
+
+      case 'j':
+      {
+        p_operation->journal_filename = optarg;
+        break;
+      }
+
+      case 'k':
+      {
+        p_operation->clone_flags |= QTM_CLONE_FLAG_PRESERVE_SHARING;
+        break;
+      }
+
       case 'l':
       {
         p_operation->clone_mode = CLONE_MODE_RANGE;
@@ -312,6 +421,32 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
         break;
       }
 
+      case 'm':
+      {
+        p_operation->index_memory =
+          parse_uint64(optarg, argv[0], "Failed to parse INDEX_MEMORY: %s");
+
+        if (p_operation->index_memory < 4096)
+        {
+          print_usage_and_exit(argv[0], "INDEX_MEMORY must be at least 4096.");
+        }
+
+        index_memory = true;
+        break;
+      }
+
+      case 'M':
+      {
+        fanout = true;
+        break;
+      }
+
+      case 'n':
+      {
+        p_operation->plan = true;
+        break;
+      }
+
       case 'o':
       {
         p_operation->preserve_mode |= PRESERVE_MODE_OWNER;
@@ -324,6 +459,31 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
         break;
       }
 
+      case 'P':
+      {
+        p_operation->clone_flags |= QTM_CLONE_FLAG_PHYSICAL_ORDER;
+        break;
+      }
+
+      case 'Q':
+      {
+        p_operation->profile_filename = optarg;
+        break;
+      }
+
+      case 'r':
+      {
+        p_operation->throttle_bytes =
+          parse_uint64(optarg, argv[0], "Failed to parse RATE: %s");
+        break;
+      }
+
+      case 'R':
+      {
+        p_operation->recursive = true;
+        break;
+      }
+
       case 's':
       {
         p_operation->clone_mode = CLONE_MODE_RANGE;
@@ -332,12 +492,78 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
         break;
       }
 
+      case 'S':
+      {
+        p_operation->small_files = true;
+        break;
+      }
+
       case 't':
       {
         p_operation->preserve_mode |= PRESERVE_MODE_TIMES;
         break;
       }
 
+      case 'T':
+      {
+        p_operation->trace_filename = optarg;
+        break;
+      }
+
+      case 'u':
+      {
+        if (strcmp(optarg, "mtime") == 0)
+        {
+          p_operation->update_check = UPDATE_CHECK_MTIME;
+        }
+        else if (strcmp(optarg, "ctime") == 0)
+        {
+          p_operation->update_check = UPDATE_CHECK_CTIME;
+        }
+        else if (strcmp(optarg, "digest") == 0)
+        {
+          p_operation->update_check = UPDATE_CHECK_DIGEST;
+        }
+        else
+        {
+          print_usage_and_exit(argv[0], "CHECK must be mtime, ctime or "
+                               "digest.");
+        }
+
+        break;
+      }
+
+      case 'U':
+      {
+        p_operation->remote_socket = optarg;
+        break;
+      }
+
+      case 'V':
+      {
+        p_operation->verify = true;
+        break;
+      }
+
+      case 'w':
+      {
+        p_operation->num_workers =
+          parse_uint64(optarg, argv[0], "Failed to parse WORKERS: %s");
+
+        if (p_operation->num_workers == 0)
+        {
+          print_usage_and_exit(argv[0], "WORKERS must be at least one.");
+        }
+
+        break;
+      }
+
+      case 'X':
+      {
+        dedupe = true;
+        break;
+      }
+
       case '?':
       {
         print_usage_and_exit(argv[0], NULL);
@@ -346,6 +572,81 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
     }
   }
 
+  if (p_operation->block_size == 0)
+  {
+    p_operation->block_size = dedupe ? 128 * 1024 : 8192;
+  }
+  else if (dedupe && (p_operation->block_size % 4096 != 0 ||
+                      p_operation->block_size > ((size_t)16 << 20)))
+  {
+    print_usage_and_exit(argv[0], "BLOCK_SIZE must be a multiple of 4096 no "
+                         "larger than 16 MiB with -X.");
+  }
+
+  if (p_operation->daemon_socket != NULL)
+  {
+    if (optind < argc)
+    {
+      print_usage_and_exit(argv[0], "-D does not take filenames.");
+    }
+
+    else if (p_operation->remote_socket != NULL ||
+             p_operation->journal_filename != NULL || fanout ||
+             p_operation->verify || dedupe || p_operation->plan ||
+             p_operation->profile_filename != NULL ||
+             p_operation->update_check != UPDATE_CHECK_NONE ||
+             p_operation->compare)
+    {
+      print_usage_and_exit(argv[0], "-D cannot be combined with -U, -j, -E, "
+                           "-M, -n, -Q, -u, -V or -X.");
+    }
+
+    p_operation->clone_mode = CLONE_MODE_DAEMON;
+    return;
+  }
+
+  if (index_memory && !dedupe)
+  {
+    print_usage_and_exit(argv[0], "-m only applies to -X.");
+  }
+
+  if (dedupe)
+  {
+    if (optind >= argc)
+    {
+      print_usage_and_exit(argv[0], "Required paths to scan missing.");
+    }
+    else if (fanout || p_operation->remote_socket != NULL ||
+             p_operation->journal_filename != NULL ||
+             p_operation->clone_mode == CLONE_MODE_RANGE ||
+             p_operation->recursive || p_operation->small_files ||
+             p_operation->fallback_copy || p_operation->force ||
+             p_operation->reflink_threshold != 0 ||
+             p_operation->clone_flags != 0 || p_operation->verify ||
+             p_operation->preserve_mode != PRESERVE_MODE_NONE ||
+             p_operation->throttle_bytes != 0 ||
+             p_operation->throttle_ops != 0 || p_operation->plan ||
+             p_operation->profile_filename != NULL ||
+             p_operation->update_check != UPDATE_CHECK_NONE ||
+             p_operation->compare)
+    {
+      print_usage_and_exit(argv[0], "-X only takes -B, -m and -T.");
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+      if (argv[i][0] == '\0')
+      {
+        print_usage_and_exit(argv[0], "Path to scan is an empty string.");
+      }
+    }
+
+    p_operation->clone_mode    = CLONE_MODE_DEDUPE;
+    p_operation->src_filenames = &argv[optind];
+    p_operation->num_srcs      = argc - optind;
+    return;
+  }
+
   if (optind >= argc)
   {
     print_usage_and_exit(argv[0], "Required SRC and DST filenames missing.");
@@ -355,40 +656,169 @@ static void parse_options (int argc, char **argv, operation_t *p_operation)
     print_usage_and_exit(argv[0], "Required DST filename missing.");
   }
 
-  p_operation->src_filename = argv[optind];
-  p_operation->dst_filename = argv[optind + 1];
+  if (p_operation->compare)
+  {
+    if ((argc - optind) != 2)
+    {
+      print_usage_and_exit(argv[0], "-E takes one SRC_FILE and one DST_FILE.");
+    }
+    else if (fanout || p_operation->remote_socket != NULL ||
+             p_operation->journal_filename != NULL ||
+             p_operation->recursive || p_operation->small_files ||
+             p_operation->fallback_copy || p_operation->force ||
+             p_operation->reflink_threshold != 0 ||
+             p_operation->clone_flags != 0 || p_operation->verify ||
+             p_operation->preserve_mode != PRESERVE_MODE_NONE ||
+             p_operation->throttle_bytes != 0 ||
+             p_operation->throttle_ops != 0 || p_operation->plan ||
+             p_operation->profile_filename != NULL ||
+             p_operation->update_check != UPDATE_CHECK_NONE)
+    {
+      print_usage_and_exit(argv[0], "-E only takes -s, -d, -l, -w and -T.");
+    }
+    else if (argv[optind][0] == '\0' || argv[optind + 1][0] == '\0')
+    {
+      print_usage_and_exit(argv[0], "Source or destination filename is an "
+                           "empty string.");
+    }
+
+    p_operation->src_filename  = argv[optind];
+    p_operation->dst_filenames = &argv[optind + 1];
+    p_operation->num_dsts      = 1;
+    return;
+  }
+
+  const bool tree = !fanout && (p_operation->recursive ||
+                                p_operation->small_files ||
+                                (argc - optind) > 2);
+
+  if (fanout && p_operation->clone_mode == CLONE_MODE_RANGE)
+  {
+    print_usage_and_exit(argv[0], "-M cannot be combined with -s, -d or -l.");
+  }
+  else if (fanout && p_operation->journal_filename != NULL)
+  {
+    print_usage_and_exit(argv[0], "-M cannot be combined with -j.");
+  }
+  else if (fanout && (p_operation->recursive || p_operation->small_files))
+  {
+    print_usage_and_exit(argv[0], "-M cannot be combined with -R or -S.");
+  }
+  else if (tree && p_operation->clone_mode == CLONE_MODE_RANGE)
+  {
+    print_usage_and_exit(argv[0], "-s, -d and -l only apply to a single file.");
+  }
+  else if (tree && p_operation->journal_filename != NULL)
+  {
+    print_usage_and_exit(argv[0], "-j only applies to a single file.");
+  }
+  else if (!tree && p_operation->num_workers != 0)
+  {
+    print_usage_and_exit(argv[0], "-w only applies to -D and USAGE (4).");
+  }
+  else if (p_operation->num_workers > 1 && p_operation->small_files)
+  {
+    print_usage_and_exit(argv[0], "-w cannot be combined with -S.");
+  }
+  else if ((tree || fanout) && p_operation->remote_socket != NULL)
+  {
+    print_usage_and_exit(argv[0], "-U only applies to a single file.");
+  }
+  else if (p_operation->remote_socket != NULL &&
+           p_operation->journal_filename != NULL)
+  {
+    print_usage_and_exit(argv[0], "-U cannot be combined with -j.");
+  }
+  else if ((fanout || p_operation->remote_socket != NULL) &&
+           (p_operation->reflink_threshold != 0 ||
+            p_operation->clone_flags != 0))
+  {
+    print_usage_and_exit(argv[0],
+                         "-C, -H, -k and -P cannot be combined with -M or -U.");
+  }
+  else if ((fanout || p_operation->remote_socket != NULL) &&
+           p_operation->profile_filename != NULL)
+  {
+    print_usage_and_exit(argv[0], "-Q cannot be combined with -M or -U.");
+  }
+  else if (p_operation->plan && (fanout || p_operation->verify ||
+                                 p_operation->remote_socket != NULL ||
+                                 p_operation->journal_filename != NULL))
+  {
+    print_usage_and_exit(argv[0], "-n cannot be combined with -M, -U, -j or "
+                         "-V.");
+  }
+  else if (!tree && p_operation->update_check != UPDATE_CHECK_NONE)
+  {
+    print_usage_and_exit(argv[0], "-u only applies to USAGE (4).");
+  }
+  else if (p_operation->update_check != UPDATE_CHECK_NONE &&
+           (p_operation->plan ||
+            !(p_operation->preserve_mode & PRESERVE_MODE_TIMES)))
+  {
+    print_usage_and_exit(argv[0], "-u requires -t and cannot be combined "
+                         "with -n.");
+  }
+
+  /* Files -u finds out of date are replaced, which takes -f. */
+  if (p_operation->update_check != UPDATE_CHECK_NONE)
+  {
+    p_operation->force = true;
+  }
+
+  if (fanout)
+  {
+    p_operation->clone_mode = CLONE_MODE_FANOUT;
+  }
+
+  if (tree)
+  {
+    p_operation->clone_mode    = CLONE_MODE_TREE;
+    p_operation->src_filenames = &argv[optind];
+    p_operation->num_srcs      = argc - optind - 1;
+    p_operation->src_filename  = argv[optind];
+    p_operation->dst_filenames = &argv[argc - 1];
+    p_operation->num_dsts      = 1;
+  }
+  else
+  {
+    p_operation->src_filename  = argv[optind];
+    p_operation->dst_filenames = &argv[optind + 1];
+    p_operation->num_dsts      = argc - optind - 1;
+  }
+
+  for (size_t i = 0; i < p_operation->num_srcs; i++)
+  {
+    if (p_operation->src_filenames[i][0] == '\0')
+    {
+      print_usage_and_exit(argv[0], "Source filename is an empty string.");
+    }
+  }
 
   if (p_operation->src_filename == NULL || p_operation->src_filename[0] == '\0')
   {
     print_usage_and_exit(argv[0], "Source filename is an empty string.");
   }
 
-  if (p_operation->dst_filename == NULL || p_operation->dst_filename[0] == '\0')
+  for (size_t i = 0; i < p_operation->num_dsts; i++)
   {
-    print_usage_and_exit(argv[0], "Destination filename is an empty string.");
+    if (p_operation->dst_filenames[i][0] == '\0')
+    {
+      print_usage_and_exit(argv[0], "Destination filename is an empty string.");
+    }
   }
 }
 
 /*============================================================================*/
 
 /**
- * Open the source and destination files.
+ * Open destination file @p p_filename, storing the descriptor in @p p_fd.
  */
 
-static int open_files (operation_t *p_operation)
+static int open_dst_file (const operation_t *p_operation,
+                          const char        *p_filename,
+                          int               *p_fd)
 {
-  int rc = 0;
-
-  p_operation->src_fd = open(p_operation->src_filename, O_RDONLY);
-
-  if (p_operation->src_fd < 0)
-  {
-    rc = errno;
-    fprintf(stderr, "Failed to open source file \"%s\": %s\n",
-            p_operation->src_filename, strerror(rc));
-    return rc;
-  }
-
   /* If cloning the whole file we try to create the destination and fail if it
    * exists (unless force was supplied). If cloning a range we don't care if
    * the file exists (we will create if needed) because we're stitching a
@@ -396,7 +826,19 @@ static int open_files (operation_t *p_operation)
    */
   int open_flags = O_WRONLY | O_CREAT;
 
-  if (p_operation->clone_mode == CLONE_MODE_FILE)
+  /* When journalling, the destination must be readable so that libcpr can
+   * verify the last checkpoint on resume. If the journal exists then this is
+   * a resume and the partial destination must be reopened as it is.
+   */
+  bool resume = false;
+
+  if (p_operation->journal_filename != NULL)
+  {
+    open_flags = O_RDWR | O_CREAT;
+    resume     = (access(p_operation->journal_filename, F_OK) == 0);
+  }
+
+  if (p_operation->clone_mode != CLONE_MODE_RANGE && !resume)
   {
     open_flags |= O_EXCL;
   }
@@ -404,33 +846,31 @@ static int open_files (operation_t *p_operation)
   /* Attempt to create the file with 0666 permissions. Let the user's defined
    * umask select the bits to mask out.
    */
-  p_operation->dst_fd =
-    open(p_operation->dst_filename, open_flags,
-         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  *p_fd = open(p_filename, open_flags,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
-  rc = (p_operation->dst_fd < 0) ? errno : 0;
+  int rc = (*p_fd < 0) ? errno : 0;
 
-  if (p_operation->dst_fd < 0 && errno == EEXIST && p_operation->force)
+  if (*p_fd < 0 && errno == EEXIST && p_operation->force)
   {
-    AS(p_operation->clone_mode == CLONE_MODE_FILE,
+    AS(p_operation->clone_mode != CLONE_MODE_RANGE,
        "Can only be here if cloning an entire file.");
 
-    p_operation->dst_fd =
-      open(p_operation->dst_filename, O_WRONLY | O_TRUNC);
+    *p_fd = open(p_filename, (open_flags & O_ACCMODE) | O_TRUNC);
 
     /* If force, the error from the truncating open is more interesting than
      * the create-exclusively one, which we suspected might fail. If the file
      * opened successfuly then there was no error code.
      */
-    rc = (p_operation->dst_fd < 0) ? errno : 0;
+    rc = (*p_fd < 0) ? errno : 0;
   }
 
-  if (p_operation->dst_fd < 0)
+  if (*p_fd < 0)
   {
     AS(rc != 0, "Error code must be non-zero at this point.");
 
     fprintf(stderr, "Failed to open destination file \"%s\": %s\n",
-            p_operation->dst_filename, strerror(rc));
+            p_filename, strerror(rc));
   }
 
   return rc;
@@ -439,23 +879,36 @@ static int open_files (operation_t *p_operation)
 /*============================================================================*/
 
 /**
- * Close the source and destination files (if open). Safe to call
- * unconditionally.
+ * Open the source and destination files.
  */
 
-static int close_files (operation_t *p_operation)
+static int open_files (operation_t *p_operation)
 {
   int rc = 0;
 
-  if (p_operation->src_fd >= 0)
+  p_operation->src_fd = open(p_operation->src_filename, O_RDONLY);
+
+  if (p_operation->src_fd < 0)
   {
-    rc = close(p_operation->src_fd);
+    rc = errno;
+    fprintf(stderr, "Failed to open source file \"%s\": %s\n",
+            p_operation->src_filename, strerror(rc));
+    return rc;
+  }
+
+  p_operation->dst_fds = malloc(p_operation->num_dsts * sizeof(int));
+
+  AS(p_operation->dst_fds != NULL, "Out of memory.");
+
+  for (size_t i = 0; i < p_operation->num_dsts; i++)
+  {
+    p_operation->dst_fds[i] = -1;
   }
 
-  if (p_operation->dst_fd >= 0)
+  for (size_t i = 0; rc == 0 && i < p_operation->num_dsts; i++)
   {
-    int rc2 = close(p_operation->dst_fd);
-    rc = (rc == 0) ? rc2 : rc;
+    rc = open_dst_file(p_operation, p_operation->dst_filenames[i],
+                       &p_operation->dst_fds[i]);
   }
 
   return rc;
@@ -464,64 +917,594 @@ static int close_files (operation_t *p_operation)
 /*============================================================================*/
 
 /**
- * Preserve some of the attributes of the source file, if requested.
+ * Close the source and destination files (if open). Safe to call
+ * unconditionally.
  */
 
-static int preserve_file_attrs (operation_t *p_operation)
+static int close_files (operation_t *p_operation)
 {
-  AS(p_operation != NULL, "NULL p_operation.");
-  AS(p_operation->src_fd >= 0 && p_operation->dst_fd >= 0,
-     "Source (%d) or destination (%d) file handle not open.",
-     p_operation->src_fd, p_operation->dst_fd);
+  int rc = 0;
 
-  struct stat src_stat;
-  int         rc       = fstat(p_operation->src_fd, &src_stat);
+  if (p_operation->src_fd >= 0)
+  {
+    rc = close(p_operation->src_fd);
+  }
 
-  if (rc == -1)
+  for (size_t i = 0; p_operation->dst_fds != NULL &&
+                     i < p_operation->num_dsts; i++)
   {
-    rc = errno;
-    fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
-            p_operation->src_filename, strerror(rc));
+    if (p_operation->dst_fds[i] >= 0)
+    {
+      int rc2 = close(p_operation->dst_fds[i]);
+      rc = (rc == 0) ? rc2 : rc;
+    }
   }
 
-  if (rc == 0 && p_operation->preserve_mode & PRESERVE_MODE_OWNER)
+  free(p_operation->dst_fds);
+  p_operation->dst_fds = NULL;
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int set_file_attrs (const operation_t *p_operation,
+                    const int          dst_fd,
+                    const char        *dst_filename,
+                    const struct stat *p_src_stat)
+{
+  AS(p_operation != NULL && p_src_stat != NULL, "NULL argument.");
+  AS(dst_fd >= 0, "Destination file handle not open.");
+
+  int rc = 0;
+
+  if (p_operation->preserve_mode & PRESERVE_MODE_OWNER)
   {
-    rc = fchown(p_operation->dst_fd, src_stat.st_uid, src_stat.st_gid);
+    rc = fchown(dst_fd, p_src_stat->st_uid, p_src_stat->st_gid);
 
     if (rc == -1)
     {
       rc = errno;
       fprintf(stderr, "Failed to set ownership of destination file \"%s\": %s\n",
-              p_operation->dst_filename, strerror(rc));
+              dst_filename, strerror(rc));
     }
   }
 
   if (rc == 0 && p_operation->preserve_mode & PRESERVE_MODE_TIMES)
   {
-    struct timespec ts[2] = { src_stat.st_atim, src_stat.st_mtim };
+    struct timespec ts[2] = { p_src_stat->st_atim, p_src_stat->st_mtim };
 
-    rc = futimens(p_operation->dst_fd, ts);
+    rc = futimens(dst_fd, ts);
 
     if (rc == -1)
     {
       rc = errno;
       fprintf(stderr, "Failed to set timestamps on destination file \"%s\": %s\n",
-              p_operation->dst_filename, strerror(rc));
+              dst_filename, strerror(rc));
     }
   }
 
   if (rc == 0 && p_operation->preserve_mode & PRESERVE_MODE_PERMS)
   {
-    rc = fchmod(p_operation->dst_fd, src_stat.st_mode);
+    rc = fchmod(dst_fd, p_src_stat->st_mode);
 
     if (rc == -1)
     {
       rc = errno;
       fprintf(stderr, "Failed to set mode on destination file \"%s\": %s\n",
-              p_operation->dst_filename, strerror(rc));
+              dst_filename, strerror(rc));
+    }
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Preserve some of the attributes of the source file on destination
+ * @p dst_index, if requested.
+ */
+
+static int preserve_file_attrs (operation_t *p_operation,
+                                const size_t dst_index)
+{
+  AS(p_operation != NULL, "NULL p_operation.");
+  AS(dst_index < p_operation->num_dsts, "Bad destination %zu.", dst_index);
+
+  const int   dst_fd       = p_operation->dst_fds[dst_index];
+  const char *dst_filename = p_operation->dst_filenames[dst_index];
+
+  AS(p_operation->src_fd >= 0 && dst_fd >= 0,
+     "Source (%d) or destination (%d) file handle not open.",
+     p_operation->src_fd, dst_fd);
+
+  if (p_operation->preserve_mode == PRESERVE_MODE_NONE)
+  {
+    return 0;
+  }
+
+  struct stat src_stat;
+  int         rc       = fstat(p_operation->src_fd, &src_stat);
+
+  if (rc == -1)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
+            p_operation->src_filename, strerror(rc));
+    return rc;
+  }
+
+  return set_file_attrs(p_operation, dst_fd, dst_filename, &src_stat);
+}
+
+/*============================================================================*/
+
+/**
+ * Clone the source into every destination with a single pass over the
+ * source for those that need a fallback copy. Reports each destination that
+ * failed.
+ */
+
+static int clone_fanout (operation_t *p_operation)
+{
+  int *p_rcs = calloc(p_operation->num_dsts, sizeof(int));
+
+  AS(p_rcs != NULL, "Out of memory.");
+
+  int rc = qtm_clone_file_multi(p_operation->src_fd, p_operation->dst_fds,
+                                p_operation->num_dsts,
+                                p_operation->fallback_copy,
+                                p_operation->block_size, true, p_rcs);
+
+  for (size_t i = 0; rc != 0 && rc != EINVAL && i < p_operation->num_dsts; i++)
+  {
+    if (p_rcs[i] != 0)
+    {
+      fprintf(stderr, "Failed to clone into destination file \"%s\": %s\n",
+              p_operation->dst_filenames[i], strerror(p_rcs[i]));
+    }
+  }
+
+  free(p_rcs);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int verify_clone (operation_t *p_operation,
+                  const int    src_fd,
+                  const int    dst_fd,
+                  const char  *dst_filename)
+{
+  qtm_clone_verify_t verified;
+
+  int rc = qtm_clone_verify(src_fd, dst_fd, p_operation->src_offset,
+                            p_operation->dst_offset, p_operation->src_length,
+                            &verified);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to verify destination file \"%s\": %s\n",
+            dst_filename, strerror(rc));
+    return rc;
+  }
+
+  pthread_mutex_lock(&p_operation->verified_lock);
+  p_operation->verified.shared_bytes   += verified.shared_bytes;
+  p_operation->verified.unshared_bytes += verified.unshared_bytes;
+  p_operation->verified.hole_bytes     += verified.hole_bytes;
+  pthread_mutex_unlock(&p_operation->verified_lock);
+
+  if (verified.unshared_bytes != 0)
+  {
+    fprintf(stderr, "Destination file \"%s\" does not share %" PRIu64
+            " bytes with the source\n", dst_filename, verified.unshared_bytes);
+    return EXDEV;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Print the totals of every -V check, if -V was given.
+ */
+
+static void report_verified (const operation_t *p_operation)
+{
+  if (p_operation->verify)
+  {
+    printf("Verified: %" PRIu64 " bytes shared, %" PRIu64 " not shared, %"
+           PRIu64 " in holes\n", p_operation->verified.shared_bytes,
+           p_operation->verified.unshared_bytes,
+           p_operation->verified.hole_bytes);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Return a printable name for @p buffer.
+ */
+
+static const char *copy_buffer_name (const qtm_copy_buffer_t buffer)
+{
+  switch (buffer)
+  {
+    case QTM_COPY_BUFFER_NONE:    return "none";
+    case QTM_COPY_BUFFER_PAGES:   return "ordinary pages";
+    case QTM_COPY_BUFFER_THP:     return "transparent huge pages";
+    case QTM_COPY_BUFFER_HUGETLB: return "hugetlbfs pages";
+  }
+
+  return "unknown";
+}
+
+/*============================================================================*/
+
+/**
+ * If the last clone call fell back to a copy, print which kind of buffer it
+ * got with -H, so that runs with and without huge pages can be compared, and
+ * with -k how much of it was shared rather than written.
+ */
+
+static void report_copy_stats (const operation_t *p_operation)
+{
+  qtm_clone_stats_t stats;
+
+  if (qtm_clone_last_stats(&stats) != 0 ||
+      stats.method != QTM_CLONE_METHOD_COPY)
+  {
+    return;
+  }
+
+  if (p_operation->clone_flags & QTM_CLONE_FLAG_HUGE_PAGES)
+  {
+    printf("Copy buffer: %s, %" PRIu64 " bytes in %" PRIu64 " ns\n",
+           copy_buffer_name(stats.buffer), stats.bytes_copied,
+           stats.elapsed_ns);
+  }
+
+  if (p_operation->clone_flags & QTM_CLONE_FLAG_PRESERVE_SHARING)
+  {
+    printf("Shared: %" PRIu64 " bytes cloned within the destination, %"
+           PRIu64 " written\n", stats.bytes_shared, stats.bytes_copied);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Have the daemon listening on @p p_operation->remote_socket clone the open
+ * source into the open destination.
+ */
+
+static int clone_remote (const operation_t *p_operation)
+{
+  int sock_fd = -1;
+  int rc      = qtm_clone_connect(p_operation->remote_socket, &sock_fd);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to connect to daemon \"%s\": %s\n",
+            p_operation->remote_socket, strerror(rc));
+    return rc;
+  }
+
+  const qtm_clone_job_t job =
+  {
+    .mode                     = (p_operation->clone_mode == CLONE_MODE_RANGE)
+                                ? QTM_CLONE_MODE_RANGE : QTM_CLONE_MODE_FILE,
+    .src_fd                   = p_operation->src_fd,
+    .dst_fd                   = p_operation->dst_fds[0],
+    .src_offset               = p_operation->src_offset,
+    .dst_offset               = p_operation->dst_offset,
+    .length                   = p_operation->src_length,
+    .fallback_copy            = p_operation->fallback_copy,
+    .fallback_copy_block_size = p_operation->block_size,
+    .p_user_data              = NULL
+  };
+
+  qtm_clone_result_t result;
+
+  rc = qtm_clone_remote(sock_fd, &job, &result);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to clone through daemon \"%s\": %s\n",
+            p_operation->remote_socket, strerror(rc));
+  }
+  else
+  {
+    rc = result.rc;
+  }
+
+  close(sock_fd);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Compare the source with the destination, or the ranges given with -s, -d
+ * and -l, for -E. Prints what was read and skipped, and where they first
+ * differ if they do.
+ *
+ * @return Zero if they are equal, @c EILSEQ if they differ, otherwise an
+ *         errno value.
+ */
+
+static int compare_files (const operation_t *p_operation)
+{
+  const char *dst_filename = p_operation->dst_filenames[0];
+  const int   src_fd       = open(p_operation->src_filename,
+                                  O_RDONLY | O_CLOEXEC);
+
+  if (src_fd < 0)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to open source file \"%s\": %s\n",
+            p_operation->src_filename, strerror(rc));
+    return rc;
+  }
+
+  const int dst_fd = open(dst_filename, O_RDONLY | O_CLOEXEC);
+
+  if (dst_fd < 0)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to open destination file \"%s\": %s\n",
+            dst_filename, strerror(rc));
+    close(src_fd);
+    return rc;
+  }
+
+  /* Whole files are compared to the end of the longer, so that a
+   * destination with more data than the source differs from where the
+   * source ends.
+   */
+  uint64_t    length = p_operation->src_length;
+  struct stat src_stat;
+  struct stat dst_stat;
+  int         rc     = 0;
+
+  if (p_operation->clone_mode != CLONE_MODE_RANGE)
+  {
+    if (fstat(src_fd, &src_stat) != 0 || fstat(dst_fd, &dst_stat) != 0)
+    {
+      rc = errno;
+      fprintf(stderr, "Failed to stat \"%s\" or \"%s\": %s\n",
+              p_operation->src_filename, dst_filename, strerror(rc));
+    }
+
+    else
+    {
+      length = (uint64_t)((src_stat.st_size > dst_stat.st_size)
+                          ? src_stat.st_size : dst_stat.st_size);
     }
   }
 
+  /* Parallel reads are what make the comparison fast, so as for the daemon
+   * every CPU is used unless -w says otherwise.
+   */
+  long                num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned            num_workers = p_operation->num_workers;
+  qtm_clone_compare_t compared;
+
+  if (num_workers == 0)
+  {
+    num_workers = (num_cpus > 0) ? (unsigned)num_cpus : 1;
+  }
+
+  if (rc == 0)
+  {
+    rc = qtm_clone_compare(src_fd, dst_fd, p_operation->src_offset,
+                           p_operation->dst_offset, length, num_workers,
+                           &compared);
+
+    if (rc != 0)
+    {
+      fprintf(stderr, "Failed to compare \"%s\" with \"%s\": %s\n",
+              p_operation->src_filename, dst_filename, strerror(rc));
+    }
+  }
+
+  if (rc == 0)
+  {
+    printf("Compared: %" PRIu64 " bytes read, %" PRIu64 " shared, %" PRIu64
+           " in holes\n", compared.read_bytes, compared.shared_bytes,
+           compared.hole_bytes);
+
+    if (!compared.equal)
+    {
+      printf("Differ: \"%s\" and \"%s\" first differ %" PRIu64 " bytes "
+             "in\n", p_operation->src_filename, dst_filename,
+             compared.mismatch_offset);
+      rc = EILSEQ;
+    }
+  }
+
+  close(dst_fd);
+  close(src_fd);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Serve clone requests on @p p_operation->daemon_socket until SIGINT or
+ * SIGTERM arrives.
+ */
+
+static int serve_daemon (const operation_t *p_operation)
+{
+  /* Block the stop signals before the workers start so that they inherit the
+   * mask and the signals are only ever seen through the signalfd.
+   */
+  sigset_t signals;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  const int stop_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+  if (stop_fd < 0)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to create signalfd: %s\n", strerror(rc));
+    return rc;
+  }
+
+  long     num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned num_workers = p_operation->num_workers;
+
+  if (num_workers == 0)
+  {
+    num_workers = (num_cpus > 0) ? (unsigned)num_cpus : 1;
+  }
+
+  int rc = qtm_clone_serve(p_operation->daemon_socket, num_workers,
+                           4 * (size_t)num_workers, stop_fd);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to serve on \"%s\": %s\n",
+            p_operation->daemon_socket, strerror(rc));
+  }
+
+  close(stop_fd);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Return the name to display in the trace viewer for @p op.
+ */
+
+static const char *trace_op_name (const qtm_trace_op_t op)
+{
+  switch (op)
+  {
+    case QTM_TRACE_OP_FICLONE:       return "FICLONE";
+    case QTM_TRACE_OP_FICLONERANGE:  return "FICLONERANGE";
+    case QTM_TRACE_OP_READ:          return "read";
+    case QTM_TRACE_OP_WRITE:         return "write";
+    case QTM_TRACE_OP_FIEMAP:        return "FIEMAP";
+    case QTM_TRACE_OP_FIDEDUPERANGE: return "FIDEDUPERANGE";
+  }
+
+  return "unknown";
+}
+
+/*============================================================================*/
+
+/**
+ * libcpr trace hook. Appends @p p_event to the trace file in @p p_user_data as
+ * a Chrome "complete" event. Timestamps are in microseconds with nanosecond
+ * precision kept in the fraction.
+ */
+
+static void trace_event_cb (const qtm_trace_event_t *p_event,
+                            void                    *p_user_data)
+{
+  trace_file_t *p_trace = p_user_data;
+  const long    tid     = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&p_trace->lock);
+
+  fprintf(p_trace->p_file,
+          "%s\n{\"name\":\"%s\",\"cat\":\"libcpr\",\"ph\":\"X\","
+          "\"pid\":%ld,\"tid\":%ld,\"ts\":%" PRIu64 ".%03" PRIu64 ","
+          "\"dur\":%" PRIu64 ".%03" PRIu64 ","
+          "\"args\":{\"fd\":%d,\"src_fd\":%d,\"offset\":%jd,"
+          "\"length\":%zu,\"result\":%zd,\"errno\":%d}}",
+          p_trace->first_event ? "" : ",",
+          trace_op_name(p_event->op),
+          (long)p_trace->pid, tid,
+          p_event->start_ns / 1000, p_event->start_ns % 1000,
+          (p_event->end_ns - p_event->start_ns) / 1000,
+          (p_event->end_ns - p_event->start_ns) % 1000,
+          p_event->fd, p_event->src_fd, (intmax_t)p_event->offset,
+          p_event->length, p_event->result, p_event->error);
+
+  p_trace->first_event = false;
+
+  pthread_mutex_unlock(&p_trace->lock);
+}
+
+/*============================================================================*/
+
+/**
+ * Create the trace file named in @p p_operation, if any, and register the
+ * libcpr trace hook to fill it.
+ */
+
+static int trace_start (const operation_t *p_operation, trace_file_t *p_trace)
+{
+  if (p_operation->trace_filename == NULL)
+  {
+    return 0;
+  }
+
+  p_trace->p_file = fopen(p_operation->trace_filename, "w");
+
+  if (p_trace->p_file == NULL)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to create trace file \"%s\": %s\n",
+            p_operation->trace_filename, strerror(rc));
+    return rc;
+  }
+
+  pthread_mutex_init(&p_trace->lock, NULL);
+  p_trace->pid         = getpid();
+  p_trace->first_event = true;
+
+  fprintf(p_trace->p_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  qtm_set_trace_hook(trace_event_cb, p_trace);
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Unregister the trace hook and finish the trace file. Safe to call
+ * unconditionally.
+ */
+
+static int trace_stop (const operation_t *p_operation, trace_file_t *p_trace)
+{
+  if (p_trace->p_file == NULL)
+  {
+    return 0;
+  }
+
+  qtm_set_trace_hook(NULL, NULL);
+
+  fprintf(p_trace->p_file, "\n]}\n");
+
+  int rc = (fclose(p_trace->p_file) == 0) ? 0 : errno;
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to write trace file \"%s\": %s\n",
+            p_operation->trace_filename, strerror(rc));
+  }
+
+  pthread_mutex_destroy(&p_trace->lock);
+  p_trace->p_file = NULL;
+
   return rc;
 }
 
@@ -531,63 +1514,181 @@ int main (int argc, char **argv)
 {
   operation_t operation =
   {
-    .fallback_copy = false,
-    .block_size    = 8192,
-    .src_filename  = NULL,
-    .dst_filename  = NULL,
-    .force         = false,
-    .preserve_mode = PRESERVE_MODE_DEFAULT,
-    .clone_mode    = CLONE_MODE_FILE,
-    .src_offset    = 0,
-    .src_length    = 0,
-    .dst_offset    = 0,
-    .src_fd        = -1,
-    .dst_fd        = -1
+    .fallback_copy     = false,
+    .block_size        = 0,
+    .src_filename      = NULL,
+    .dst_filenames     = NULL,
+    .num_dsts          = 0,
+    .force             = false,
+    .preserve_mode     = PRESERVE_MODE_DEFAULT,
+    .clone_mode        = CLONE_MODE_FILE,
+    .src_offset        = 0,
+    .src_length        = 0,
+    .dst_offset        = 0,
+    .trace_filename    = NULL,
+    .journal_filename  = NULL,
+    .throttle_bytes    = 0,
+    .throttle_ops      = 0,
+    .src_filenames     = NULL,
+    .num_srcs          = 0,
+    .recursive         = false,
+    .small_files       = false,
+    .daemon_socket     = NULL,
+    .remote_socket     = NULL,
+    .num_workers       = 0,
+    .verify            = false,
+    .reflink_threshold = 0,
+    .clone_flags       = 0,
+    .index_memory      = (uint64_t)256 << 20,
+    .plan              = false,
+    .profile_filename  = NULL,
+    .update_check      = UPDATE_CHECK_NONE,
+    .compare           = false,
+    .src_fd            = -1,
+    .dst_fds           = NULL,
+    .verified          = { 0 },
+    .verified_lock     = PTHREAD_MUTEX_INITIALIZER,
+    .profile           = { 0 },
+    .profile_lock      = PTHREAD_MUTEX_INITIALIZER
   };
 
+  trace_file_t trace = { .p_file = NULL };
+
   parse_options(argc, argv, &operation);
 
-  int rc = open_files(&operation);
+  qtm_set_throttle(operation.throttle_bytes, operation.throttle_ops, 0, 0);
+
+  int rc = trace_start(&operation, &trace);
+
+  /* Tree clones open, preserve and sync each file themselves, the daemon is
+   * handed its files already open, a dedupe scan opens what it finds and a
+   * plan or comparison must not create the destination.
+   */
+  if (rc == 0 && (operation.plan || operation.compare ||
+                  operation.clone_mode == CLONE_MODE_TREE ||
+                  operation.clone_mode == CLONE_MODE_DAEMON ||
+                  operation.clone_mode == CLONE_MODE_DEDUPE))
+  {
+    if (operation.plan)
+    {
+      rc = plan_clone(&operation);
+    }
+    else if (operation.compare)
+    {
+      rc = compare_files(&operation);
+    }
+    else if (operation.clone_mode == CLONE_MODE_TREE)
+    {
+      rc = clone_tree(&operation);
+    }
+    else if (operation.clone_mode == CLONE_MODE_DAEMON)
+    {
+      rc = serve_daemon(&operation);
+    }
+    else
+    {
+      rc = dedupe_tree(&operation);
+    }
+
+    report_verified(&operation);
+
+    int profile_rc = profile_save(&operation);
+    rc = (rc == 0) ? profile_rc : rc;
+
+    int trace_rc = trace_stop(&operation, &trace);
+    rc = (rc == 0) ? trace_rc : rc;
+
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   if (rc == 0)
+  {
+    rc = open_files(&operation);
+  }
+
+  const qtm_clone_options_t options =
+  {
+    .fallback_copy            = operation.fallback_copy,
+    .fallback_copy_block_size = operation.block_size,
+    .p_journal_path           = operation.journal_filename,
+    .checkpoint_interval      = 0,
+    .reflink_threshold        = operation.reflink_threshold,
+    .flags                    = operation.clone_flags
+  };
+
+  if (rc == 0 && operation.remote_socket != NULL)
+  {
+    rc = clone_remote(&operation);
+  }
+  else if (rc == 0)
   {
     switch (operation.clone_mode)
     {
       case CLONE_MODE_FILE:
       {
-        rc = qtm_clone_file(operation.src_fd, operation.dst_fd,
-                            operation.fallback_copy, operation.block_size);
+        rc = qtm_clone_file_ex(operation.src_fd, operation.dst_fds[0],
+                               &options);
+        profile_add(&operation, operation.src_fd, 0, 0);
         break;
       }
 
       case CLONE_MODE_RANGE:
       {
-        rc = qtm_clone_file_range(operation.src_fd, operation.dst_fd,
-                                  operation.src_offset, operation.dst_offset,
-                                  operation.src_length, operation.fallback_copy,
-                                  operation.block_size);
+        rc = qtm_clone_file_range_ex(operation.src_fd, operation.dst_fds[0],
+                                     operation.src_offset,
+                                     operation.dst_offset,
+                                     operation.src_length, &options);
+        profile_add(&operation, operation.src_fd, operation.src_offset,
+                    operation.src_length);
+        break;
+      }
+
+      case CLONE_MODE_FANOUT:
+      {
+        rc = clone_fanout(&operation);
+        break;
+      }
+
+      case CLONE_MODE_TREE:
+      case CLONE_MODE_DAEMON:
+      case CLONE_MODE_DEDUPE:
+      {
+        AS(false, "Tree clones, the daemon and dedupe are handled above.");
         break;
       }
     }
-  }
 
-  if (rc == 0)
-  {
-    rc = preserve_file_attrs(&operation);
+    report_copy_stats(&operation);
   }
 
-  if (rc == 0)
+  for (size_t i = 0; rc == 0 && i < operation.num_dsts; i++)
   {
-    rc = fsync(operation.dst_fd);
+    rc = preserve_file_attrs(&operation, i);
 
-    if (rc != 0)
+    if (rc == 0)
     {
-      rc = errno;
-      fprintf(stderr, "Failed to sync destination file \"%s\": %s\n",
-              operation.dst_filename, strerror(rc));
+      rc = fsync(operation.dst_fds[i]);
+
+      if (rc != 0)
+      {
+        rc = errno;
+        fprintf(stderr, "Failed to sync destination file \"%s\": %s\n",
+                operation.dst_filenames[i], strerror(rc));
+      }
+    }
+
+    if (rc == 0 && operation.verify)
+    {
+      rc = verify_clone(&operation, operation.src_fd, operation.dst_fds[i],
+                        operation.dst_filenames[i]);
     }
   }
 
+  report_verified(&operation);
+
+  int profile_rc = profile_save(&operation);
+  rc = (rc == 0) ? profile_rc : rc;
+
   /* Unconditionaly close the input files. */
   int close_rc = close_files(&operation);
 
@@ -597,6 +1698,9 @@ int main (int argc, char **argv)
     rc = (rc == 0) ? close_rc : rc;
   }
 
+  int trace_rc = trace_stop(&operation, &trace);
+  rc = (rc == 0) ? trace_rc : rc;
+
   return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
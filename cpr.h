@@ -0,0 +1,338 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, shared declarations.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * Declarations shared between the translation units of the cpr program.
+ */
+
+#ifndef CPR_H
+#define CPR_H
+
+#include "libcpr.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*============================================================================*/
+
+/**
+ * Bitfield defining the various attributes to copy from the source to
+ * destination file.
+ *
+ * @{
+ */
+
+typedef uint8_t preserve_mode_t;
+
+#define PRESERVE_MODE_OWNER   0x01
+#define PRESERVE_MODE_TIMES   0x02
+#define PRESERVE_MODE_PERMS   0x04
+
+#define PRESERVE_MODE_NONE    0x00
+#define PRESERVE_MODE_ALL     (PRESERVE_MODE_OWNER | PRESERVE_MODE_TIMES | \
+                               PRESERVE_MODE_PERMS)
+#define PRESERVE_MODE_DEFAULT PRESERVE_MODE_NONE
+
+/** @} */
+
+/*============================================================================*/
+
+/**
+ * Describe whether to clone the entire file with FICLONE or just a range of
+ * it with FICLONERANGE.
+ */
+
+typedef enum _clone_mode_t
+{
+  CLONE_MODE_FILE,
+  CLONE_MODE_RANGE,
+  CLONE_MODE_FANOUT, /**< Whole file into several destinations at once. */
+  CLONE_MODE_TREE,   /**< Several files and/or directories into a directory. */
+  CLONE_MODE_DAEMON, /**< Serve clone requests from other processes. */
+  CLONE_MODE_DEDUPE, /**< Deduplicate the blocks of existing files. */
+} clone_mode_t;
+
+/*============================================================================*/
+
+/** What -u compares to decide that a destination file is up to date. */
+
+typedef enum _update_check_t
+{
+  UPDATE_CHECK_NONE,   /**< Clone every file. */
+  UPDATE_CHECK_MTIME,  /**< Size and modification time. */
+  UPDATE_CHECK_CTIME,  /**< As MTIME, and the source's inode has not
+                            changed since the destination's did. */
+  UPDATE_CHECK_DIGEST, /**< As MTIME, and a digest of the source's data
+                            matches the one stored with the destination. */
+} update_check_t;
+
+/** Extended attribute holding a destination's digest for -u digest. */
+
+#define UPDATE_DIGEST_XATTR "user.cpr.digest"
+
+/*============================================================================*/
+
+/**
+ * Throughput measured by clones run with -Q, summed over every call. Each
+ * call's wall-clock time is counted, so concurrent calls add up to more
+ * than the time they took together.
+ */
+
+typedef struct _profile_t
+{
+  uint64_t clone_bytes; /**< Reflinked. */
+  uint64_t clone_ns;
+  uint64_t copy_bytes;  /**< Written by the fallback copy. */
+  uint64_t copy_ns;
+} profile_t;
+
+/*============================================================================*/
+
+/** Structure to contain details of the entire clone operation. */
+
+typedef struct _operation_t
+{
+  /**
+   * Command-line supplied arguments:
+   * @{
+   */
+  bool            fallback_copy;
+  size_t          block_size;    /**< Of the fallback copy, or of -X. */
+  const char     *src_filename;
+  char          **src_filenames; /**< Every source in CLONE_MODE_TREE and
+                                      CLONE_MODE_DEDUPE. */
+  size_t          num_srcs;
+  char          **dst_filenames;
+  size_t          num_dsts;
+  bool            force;
+  preserve_mode_t preserve_mode;
+  clone_mode_t    clone_mode;
+  uint64_t        src_offset;
+  uint64_t        src_length;
+  uint64_t        dst_offset;
+  const char     *trace_filename;
+  const char     *journal_filename;
+  uint64_t        throttle_bytes;
+  uint64_t        throttle_ops;
+  bool            recursive;
+  bool            small_files;
+  const char     *daemon_socket; /**< Socket to serve with -D. */
+  const char     *remote_socket; /**< Daemon to clone through with -U. */
+  unsigned        num_workers;   /**< Of the daemon, a tree clone or -E. */
+  bool            verify;
+  uint64_t        reflink_threshold;
+  uint32_t        clone_flags;   /**< #qtm_clone_flag_t values. */
+  uint64_t        index_memory;
+  bool            plan;             /**< -n: predict, do not clone. */
+  const char     *profile_filename; /**< Throughput profile of -Q. */
+  update_check_t  update_check;     /**< -u: skip up to date files. */
+  bool            compare;          /**< -E: compare, do not clone. */
+  /** @} */
+
+  /**
+   * Internally generated status.
+   * @{
+   */
+  int                src_fd;
+  int               *dst_fds;
+  qtm_clone_verify_t verified;      /**< Totals over every -V check. */
+  pthread_mutex_t    verified_lock; /**< Held to add to @c verified. */
+  profile_t          profile;       /**< Measured by this run, for -Q. */
+  pthread_mutex_t    profile_lock;  /**< Held to add to @c profile. */
+  /** @} */
+} operation_t;
+
+/*============================================================================*/
+
+/**
+ * Macro to abort on some programming errors. Re-implemented here to keep
+ * this program completely self-contained.
+ *
+ * @param[in] cond_ Assert condition. Fail if false.
+ * @param[in] fmt_  Printf-style constant literal format string.
+ * @param[in] ...   Arguments to match @p fmt_.
+ */
+
+#define AS(cond_, fmt_, ...)                                     \
+  do {                                                           \
+    if (!(cond_))                                                \
+    {                                                            \
+      fprintf(stderr,                                            \
+              "An assertion failed at %s:%d (%s). Details:\n\n"  \
+              fmt_                                               \
+              "\n",                                              \
+              __FILE__, __LINE__, __func__, ##__VA_ARGS__);      \
+      fflush(stderr);                                            \
+      abort();                                                   \
+    }                                                            \
+  } while (0)
+
+/*============================================================================*/
+
+/**
+ * Apply the attributes selected by @p p_operation->preserve_mode from
+ * @p p_src_stat to @p dst_fd. Reports failures against @p dst_filename.
+ * Implemented in cpr.c.
+ *
+ * @return Zero on success, some errno value on failure.
+ */
+
+int set_file_attrs (const operation_t *p_operation,
+                    const int          dst_fd,
+                    const char        *dst_filename,
+                    const struct stat *p_src_stat);
+
+/*============================================================================*/
+
+/**
+ * Clone every source in @p p_operation into the destination directory,
+ * recursing into directories if @c recursive is set. Implemented in
+ * cpr_tree.c.
+ *
+ * @return Zero if everything was cloned, otherwise the first error seen.
+ *         Errors on individual files are reported and do not stop the rest.
+ */
+
+int clone_tree (operation_t *p_operation);
+
+/*============================================================================*/
+
+/**
+ * Store @p rc in @p p_rc unless an earlier error is there already, so that
+ * a walk returns the first error it saw. Implemented in cpr_tree.c.
+ */
+
+void first_error (int *p_rc, const int rc);
+
+/**
+ * Return a newly allocated "@p p_dir/@p p_name". Implemented in cpr_tree.c.
+ */
+
+char *path_join (const char *p_dir, const char *p_name);
+
+/**
+ * One entry of a directory, as returned by read_dir().
+ */
+
+typedef struct
+{
+  char          *p_name; /**< Newly allocated, freed by the caller. */
+  unsigned char  d_type; /**< From readdir(3), may be DT_UNKNOWN. */
+} dir_entry_t;
+
+/**
+ * Read every entry of directory @p p_path but "." and ".." into a newly
+ * allocated array, so that a walk only keeps one directory stream open at a
+ * time however deep the tree. Implemented in cpr_tree.c.
+ *
+ * @return Zero on success, otherwise the errno value of opendir(3).
+ */
+
+int read_dir (const char   *p_path,
+              dir_entry_t **pp_entries,
+              size_t       *p_num_entries);
+
+/*============================================================================*/
+
+/**
+ * Check with qtm_clone_verify() that @p dst_fd shares its storage with
+ * @p src_fd over the range @p p_operation cloned, and add the result to
+ * @p p_operation->verified. Reports a destination that does not against
+ * @p dst_filename. Thread-safe. Implemented in cpr.c.
+ *
+ * @return Zero if no byte was left unshared, @c EXDEV if some were, or the
+ *         errno value verification failed with.
+ */
+
+int verify_clone (operation_t *p_operation,
+                  const int    src_fd,
+                  const int    dst_fd,
+                  const char  *dst_filename);
+
+/*============================================================================*/
+
+/**
+ * Hash every block of every regular file in or below @p p_operation's
+ * sources and deduplicate the blocks found more than once with
+ * qtm_dedupe_file_range(). Prints totals once done. Implemented in
+ * cpr_dedupe.c.
+ *
+ * @return Zero if every duplicate found was deduplicated or turned out to
+ *         differ, otherwise the first error seen.
+ */
+
+int dedupe_tree (operation_t *p_operation);
+
+/**
+ * Hash @p length bytes of @p p_data, which must be a multiple of 32, with
+ * the xxHash64 round. Never returns zero. Implemented in cpr_dedupe.c.
+ */
+
+uint64_t block_hash (const uint8_t *p_data, const size_t length);
+
+/*============================================================================*/
+
+/**
+ * Print what cloning @p p_operation's sources would do, from
+ * qtm_clone_plan() on each regular file, without writing any data. With -Q,
+ * also estimate how long it would take from the profile. Implemented in
+ * cpr_plan.c.
+ *
+ * @return Zero if every file could be planned, otherwise the first error
+ *         seen. Files expected to fail to clone are not errors.
+ */
+
+int plan_clone (operation_t *p_operation);
+
+/**
+ * With -Q, add the outcome of the last clone call made by this thread, of
+ * @p length bytes of @p src_fd at @p src_offset, to @p p_operation->profile.
+ * A @p length of zero means to the end of the source. Thread-safe.
+ * Implemented in cpr_plan.c.
+ */
+
+void profile_add (operation_t *p_operation,
+                  const int    src_fd,
+                  const off_t  src_offset,
+                  const size_t length);
+
+/**
+ * With -Q, add @p p_operation->profile to the totals in its profile file.
+ * Implemented in cpr_plan.c.
+ *
+ * @return Zero on success or without -Q, otherwise an errno value.
+ */
+
+int profile_save (const operation_t *p_operation);
+
+/*============================================================================*/
+
+#endif /* CPR_H */
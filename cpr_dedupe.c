@@ -0,0 +1,786 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, duplicate block scanner.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * Every regular file below the paths given is read in fixed-size blocks and
+ * each block is hashed. A block whose hash is already in the index is queued
+ * as a duplicate of the block it was first seen at, and the queue is handed
+ * to qtm_dedupe_file_range() whenever it fills and once the walk is done.
+ * The kernel compares the data before sharing anything, so a hash collision
+ * costs a wasted call rather than corrupting a file.
+ *
+ * @section notes Notes
+ *
+ * The index is a fixed array of buckets, each one a 64-byte cache line of
+ * four (hash, file, block) entries, sized from -m when the scan starts. When
+ * a bucket is full a new block replaces one of its entries, so memory stays
+ * the same however many blocks are scanned and, once the index is full, the
+ * scan can only miss duplicates of blocks it has forgotten. Consecutive
+ * duplicate blocks of the same pair of files are merged into one request of
+ * up to DEDUPE_MAX_RUN bytes, and blocks of zeros are skipped as they are
+ * better left as holes.
+ */
+
+#include "cpr.h"
+#include "libcpr.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** Entries per index bucket, which fill one cache line. */
+
+#define DEDUPE_BUCKET_SLOTS 4
+
+/** Duplicates queued before they are deduplicated. */
+
+#define DEDUPE_BATCH 4096
+
+/** Largest request that consecutive duplicate blocks are merged into. */
+
+#define DEDUPE_MAX_RUN ((uint64_t)16 << 20)
+
+/**
+ * Destinations passed to each qtm_dedupe_file_range() call, keeping the
+ * number of open files well below the usual descriptor limit.
+ */
+
+#define DEDUPE_MAX_OPEN 128
+
+/*============================================================================*/
+
+/** A block in the index. A @c hash of zero marks an unused entry. */
+
+typedef struct _dedupe_entry_t
+{
+  uint64_t hash;
+  uint32_t file;
+  uint32_t block;
+} dedupe_entry_t;
+
+typedef struct _dedupe_bucket_t
+{
+  dedupe_entry_t entries[DEDUPE_BUCKET_SLOTS];
+} dedupe_bucket_t;
+
+/** A scanned file. */
+
+typedef struct _dedupe_file_t
+{
+  char *p_path;
+  dev_t dev;
+  ino_t ino;
+} dedupe_file_t;
+
+/** A range of @c dst_file whose blocks were seen before in @c src_file. */
+
+typedef struct _dedupe_match_t
+{
+  uint32_t src_file;
+  uint32_t dst_file;
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+} dedupe_match_t;
+
+/** State of one dedupe_tree() call. */
+
+typedef struct _dedupe_t
+{
+  size_t             block_size;
+  uint8_t           *p_block;
+
+  dedupe_bucket_t   *p_buckets;
+  uint64_t           bucket_mask;
+  uint64_t           zero_hash;
+
+  dedupe_file_t     *p_files;
+  size_t             num_files;
+  size_t             max_files;
+
+  dedupe_match_t    *p_matches;
+  size_t             num_matches;
+
+  uint64_t           blocks;
+  uint64_t           duplicate_blocks;
+  uint64_t           forgotten_blocks;
+  uint64_t           deduped_bytes;
+  uint64_t           differed_bytes;
+  int                rc;
+  bool               stop; /**< The file system cannot deduplicate. */
+} dedupe_t;
+
+/*============================================================================*/
+
+static inline uint64_t rotl64 (const uint64_t x, const unsigned bits)
+{
+  return (x << bits) | (x >> (64 - bits));
+}
+
+/*============================================================================*/
+
+/**
+ * This is the xxHash64 round and merge over four independent lanes, which
+ * compilers vectorise and which keeps up with reads from any disk.
+ */
+
+uint64_t block_hash (const uint8_t *p_data, const size_t length)
+{
+  static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t P3 = 0x165667B19E3779F9ULL;
+  static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+  uint64_t lanes[4] = { P1 + P2, P2, 0, -P1 };
+
+  for (size_t pos = 0; pos < length; pos += sizeof(lanes))
+  {
+    for (unsigned i = 0; i < 4; i++)
+    {
+      uint64_t word;
+
+      memcpy(&word, p_data + pos + i * sizeof(word), sizeof(word));
+      lanes[i] = rotl64(lanes[i] + word * P2, 31) * P1;
+    }
+  }
+
+  uint64_t hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+                  rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+
+  for (unsigned i = 0; i < 4; i++)
+  {
+    hash ^= rotl64(lanes[i] * P2, 31) * P1;
+    hash  = hash * P1 + P4;
+  }
+
+  hash += length;
+  hash ^= hash >> 33;
+  hash *= P2;
+  hash ^= hash >> 29;
+  hash *= P3;
+  hash ^= hash >> 32;
+
+  /* Zero marks an unused index entry. */
+  return (hash != 0) ? hash : P5;
+}
+
+/*============================================================================*/
+
+/**
+ * Look @p hash up in the index. If it is there return its entry, otherwise
+ * record it as block @p block of @p file and return NULL.
+ */
+
+static const dedupe_entry_t *index_find_or_add (dedupe_t      *p_dedupe,
+                                                const uint64_t hash,
+                                                const uint32_t file,
+                                                const uint32_t block)
+{
+  dedupe_bucket_t *p_bucket = &p_dedupe->p_buckets[hash &
+                                                   p_dedupe->bucket_mask];
+  dedupe_entry_t  *p_free   = NULL;
+
+  for (unsigned i = 0; i < DEDUPE_BUCKET_SLOTS; i++)
+  {
+    dedupe_entry_t *p_entry = &p_bucket->entries[i];
+
+    if (p_entry->hash == hash)
+    {
+      return p_entry;
+    }
+    else if (p_entry->hash == 0 && p_free == NULL)
+    {
+      p_free = p_entry;
+    }
+  }
+
+  if (p_free == NULL)
+  {
+    /* The bucket index came from the low bits, so the top ones still vary. */
+    p_free = &p_bucket->entries[hash >> 62];
+    p_dedupe->forgotten_blocks++;
+  }
+
+  *p_free = (dedupe_entry_t) { .hash = hash, .file = file, .block = block };
+
+  return NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * qsort() comparison grouping matches by source range.
+ */
+
+static int compare_matches (const void *p_a, const void *p_b)
+{
+  const dedupe_match_t *p_match_a = p_a;
+  const dedupe_match_t *p_match_b = p_b;
+
+  if (p_match_a->src_file != p_match_b->src_file)
+  {
+    return (p_match_a->src_file > p_match_b->src_file) ? 1 : -1;
+  }
+  else if (p_match_a->src_offset != p_match_b->src_offset)
+  {
+    return (p_match_a->src_offset > p_match_b->src_offset) ? 1 : -1;
+  }
+  else if (p_match_a->length != p_match_b->length)
+  {
+    return (p_match_a->length > p_match_b->length) ? 1 : -1;
+  }
+
+  return (p_match_a->dst_file > p_match_b->dst_file) -
+         (p_match_a->dst_file < p_match_b->dst_file);
+}
+
+/*============================================================================*/
+
+/**
+ * Deduplicate the matches in [@p first, @p last), which all share one source
+ * range, from the already open @p src_fd.
+ */
+
+static void dedupe_group (dedupe_t     *p_dedupe,
+                          const int     src_fd,
+                          const size_t  first,
+                          const size_t  last)
+{
+  const dedupe_match_t *p_matches = p_dedupe->p_matches;
+  const dedupe_file_t  *p_files   = p_dedupe->p_files;
+  int                   dst_fds[DEDUPE_MAX_OPEN];
+  off_t                 dst_offsets[DEDUPE_MAX_OPEN];
+  int                   rcs[DEDUPE_MAX_OPEN];
+  size_t                indices[DEDUPE_MAX_OPEN];
+  size_t                num_dsts = 0;
+
+  for (size_t m = first; m < last; m++)
+  {
+    const char *p_path = p_files[p_matches[m].dst_file].p_path;
+
+    /* Read-only is enough when the caller owns the file. */
+    int fd = open(p_path, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0 && (errno == EACCES || errno == EROFS || errno == ETXTBSY))
+    {
+      fd = open(p_path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (fd < 0)
+    {
+      const int rc = errno;
+      fprintf(stderr, "W: Failed to open \"%s\" to deduplicate: %s\n",
+              p_path, strerror(rc));
+      first_error(&p_dedupe->rc, rc);
+      continue;
+    }
+
+    dst_fds[num_dsts]     = fd;
+    dst_offsets[num_dsts] = p_matches[m].dst_offset;
+    indices[num_dsts++]   = m;
+  }
+
+  if (num_dsts == 0)
+  {
+    return;
+  }
+
+  uint64_t  deduped = 0;
+  const int rc      = qtm_dedupe_file_range(src_fd,
+                                            p_matches[first].src_offset,
+                                            p_matches[first].length, dst_fds,
+                                            dst_offsets, num_dsts, &deduped,
+                                            rcs);
+
+  p_dedupe->deduped_bytes += deduped;
+
+  if (rc == EOPNOTSUPP || rc == ENOTTY)
+  {
+    /* Every other call would fail the same way. */
+    fprintf(stderr, "Failed to deduplicate \"%s\": %s\n",
+            p_files[p_matches[first].src_file].p_path, strerror(rc));
+    first_error(&p_dedupe->rc, rc);
+    p_dedupe->stop = true;
+  }
+
+  for (size_t d = 0; d < num_dsts && !p_dedupe->stop; d++)
+  {
+    const dedupe_match_t *p_match = &p_matches[indices[d]];
+
+    if (rcs[d] == EILSEQ)
+    {
+      /* A hash collision, or the data changed since it was read. */
+      p_dedupe->differed_bytes += p_match->length;
+    }
+    else if (rcs[d] != 0)
+    {
+      fprintf(stderr, "W: Failed to deduplicate \"%s\" at %" PRIu64
+              " against \"%s\" at %" PRIu64 ": %s\n",
+              p_files[p_match->dst_file].p_path, p_match->dst_offset,
+              p_files[p_match->src_file].p_path, p_match->src_offset,
+              strerror(rcs[d]));
+      first_error(&p_dedupe->rc, rcs[d]);
+    }
+  }
+
+  for (size_t d = 0; d < num_dsts; d++)
+  {
+    close(dst_fds[d]);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Deduplicate every queued match and empty the queue.
+ */
+
+static void dedupe_flush (dedupe_t *p_dedupe)
+{
+  dedupe_match_t *p_matches = p_dedupe->p_matches;
+  const size_t    num       = p_dedupe->num_matches;
+
+  qsort(p_matches, num, sizeof(*p_matches), compare_matches);
+
+  int      src_fd   = -1;
+  uint32_t src_file = UINT32_MAX;
+
+  for (size_t first = 0; first < num && !p_dedupe->stop;)
+  {
+    size_t last = first + 1;
+
+    while (last < num && last - first < DEDUPE_MAX_OPEN &&
+           p_matches[last].src_file == p_matches[first].src_file &&
+           p_matches[last].src_offset == p_matches[first].src_offset &&
+           p_matches[last].length == p_matches[first].length)
+    {
+      last++;
+    }
+
+    /* Matches are sorted by source, so each one is opened once. */
+    if (p_matches[first].src_file != src_file)
+    {
+      if (src_fd >= 0)
+      {
+        close(src_fd);
+      }
+
+      src_file = p_matches[first].src_file;
+      src_fd   = open(p_dedupe->p_files[src_file].p_path,
+                      O_RDONLY | O_CLOEXEC);
+
+      if (src_fd < 0)
+      {
+        const int rc = errno;
+        fprintf(stderr, "W: Failed to open \"%s\" to deduplicate: %s\n",
+                p_dedupe->p_files[src_file].p_path, strerror(rc));
+        first_error(&p_dedupe->rc, rc);
+      }
+    }
+
+    if (src_fd >= 0)
+    {
+      dedupe_group(p_dedupe, src_fd, first, last);
+    }
+
+    first = last;
+  }
+
+  if (src_fd >= 0)
+  {
+    close(src_fd);
+  }
+
+  p_dedupe->num_matches = 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Queue block @p dst_block of @p dst_file as a duplicate of the indexed
+ * @p p_entry, extending the previous match if they are consecutive.
+ */
+
+static void add_match (dedupe_t             *p_dedupe,
+                       const dedupe_entry_t *p_entry,
+                       const uint32_t        dst_file,
+                       const uint32_t        dst_block)
+{
+  const uint64_t  block_size = p_dedupe->block_size;
+  const uint64_t  src_offset = (uint64_t)p_entry->block * block_size;
+  const uint64_t  dst_offset = (uint64_t)dst_block * block_size;
+  const bool      same_inode =
+    p_dedupe->p_files[p_entry->file].dev == p_dedupe->p_files[dst_file].dev &&
+    p_dedupe->p_files[p_entry->file].ino == p_dedupe->p_files[dst_file].ino;
+
+  /* Another link to a file already scanned matches itself throughout. */
+  if (same_inode && src_offset == dst_offset)
+  {
+    return;
+  }
+
+  p_dedupe->duplicate_blocks++;
+
+  if (p_dedupe->num_matches > 0)
+  {
+    dedupe_match_t *p_last = &p_dedupe->p_matches[p_dedupe->num_matches - 1];
+    const uint64_t  length = p_last->length + block_size;
+
+    /* Within one file the two ranges must not grow into each other. */
+    if (p_last->src_file == p_entry->file && p_last->dst_file == dst_file &&
+        p_last->src_offset + p_last->length == src_offset &&
+        p_last->dst_offset + p_last->length == dst_offset &&
+        length <= DEDUPE_MAX_RUN &&
+        (!same_inode || p_last->src_offset + length <= p_last->dst_offset ||
+         p_last->dst_offset + length <= p_last->src_offset))
+    {
+      p_last->length = length;
+      return;
+    }
+  }
+
+  if (p_dedupe->num_matches == DEDUPE_BATCH)
+  {
+    dedupe_flush(p_dedupe);
+  }
+
+  p_dedupe->p_matches[p_dedupe->num_matches++] = (dedupe_match_t)
+  {
+    .src_file   = p_entry->file,
+    .dst_file   = dst_file,
+    .src_offset = src_offset,
+    .dst_offset = dst_offset,
+    .length     = block_size
+  };
+}
+
+/*============================================================================*/
+
+/**
+ * Read every whole block of regular file @p p_path into the index, queueing
+ * those already in it. Takes ownership of @p p_path.
+ */
+
+static void scan_file (dedupe_t *p_dedupe, char *p_path)
+{
+  const size_t block_size = p_dedupe->block_size;
+  int          fd         = open(p_path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+  if (fd < 0 && errno == EPERM)
+  {
+    /* O_NOATIME is only allowed on files the caller owns. */
+    fd = open(p_path, O_RDONLY | O_CLOEXEC);
+  }
+
+  struct stat file_stat;
+
+  if (fd < 0 || fstat(fd, &file_stat) != 0)
+  {
+    const int rc = errno;
+    fprintf(stderr, "W: Failed to open \"%s\": %s\n", p_path, strerror(rc));
+    first_error(&p_dedupe->rc, rc);
+
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+
+    free(p_path);
+    return;
+  }
+
+  /* Files smaller than a block have nothing to match. */
+  if (!S_ISREG(file_stat.st_mode) || (uint64_t)file_stat.st_size < block_size)
+  {
+    close(fd);
+    free(p_path);
+    return;
+  }
+
+  if (p_dedupe->num_files == p_dedupe->max_files)
+  {
+    p_dedupe->max_files = (p_dedupe->max_files == 0) ? 256
+                                                     : p_dedupe->max_files * 2;
+    p_dedupe->p_files   = realloc(p_dedupe->p_files,
+                                  p_dedupe->max_files *
+                                    sizeof(*p_dedupe->p_files));
+
+    AS(p_dedupe->p_files != NULL, "Out of memory.");
+  }
+
+  AS(p_dedupe->num_files < UINT32_MAX, "Too many files.");
+
+  const uint32_t file = p_dedupe->num_files++;
+
+  p_dedupe->p_files[file] = (dedupe_file_t)
+  {
+    .p_path = p_path,
+    .dev    = file_stat.st_dev,
+    .ino    = file_stat.st_ino
+  };
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  const uint64_t num_blocks = file_stat.st_size / block_size;
+
+  for (uint64_t block = 0;
+       block < num_blocks && block <= UINT32_MAX && !p_dedupe->stop; block++)
+  {
+    size_t got = 0;
+    int    rc  = 0;
+
+    while (got < block_size)
+    {
+      const ssize_t read_now = pread(fd, p_dedupe->p_block + got,
+                                     block_size - got,
+                                     block * block_size + got);
+
+      if (read_now < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        rc = errno;
+        break;
+      }
+      else if (read_now == 0)
+      {
+        break;
+      }
+
+      got += read_now;
+    }
+
+    if (rc != 0)
+    {
+      fprintf(stderr, "W: Failed to read \"%s\": %s\n", p_path, strerror(rc));
+      first_error(&p_dedupe->rc, rc);
+      break;
+    }
+    else if (got < block_size)
+    {
+      /* The file shrank while it was being scanned. */
+      break;
+    }
+
+    const uint64_t hash = block_hash(p_dedupe->p_block, block_size);
+
+    p_dedupe->blocks++;
+
+    if (hash == p_dedupe->zero_hash &&
+        p_dedupe->p_block[0] == 0 &&
+        memcmp(p_dedupe->p_block, p_dedupe->p_block + 1, block_size - 1) == 0)
+    {
+      continue;
+    }
+
+    const dedupe_entry_t *p_entry = index_find_or_add(p_dedupe, hash, file,
+                                                      block);
+
+    if (p_entry != NULL)
+    {
+      add_match(p_dedupe, p_entry, file, block);
+    }
+  }
+
+  close(fd);
+}
+
+/*============================================================================*/
+
+static void scan_path (dedupe_t *p_dedupe, char *p_path, unsigned char d_type);
+
+/**
+ * Scan everything in directory @p p_path. Takes ownership of @p p_path.
+ */
+
+static void scan_dir (dedupe_t *p_dedupe, char *p_path)
+{
+  dir_entry_t *p_entries   = NULL;
+  size_t       num_entries = 0;
+  const int    rc          = read_dir(p_path, &p_entries, &num_entries);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "W: Failed to open directory \"%s\": %s\n",
+            p_path, strerror(rc));
+    first_error(&p_dedupe->rc, rc);
+    free(p_path);
+    return;
+  }
+
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    if (!p_dedupe->stop)
+    {
+      scan_path(p_dedupe, path_join(p_path, p_entries[i].p_name),
+                p_entries[i].d_type);
+    }
+
+    free(p_entries[i].p_name);
+  }
+
+  free(p_entries);
+  free(p_path);
+}
+
+/*============================================================================*/
+
+/**
+ * Scan @p p_path according to its type. Symbolic links are not followed and
+ * special files are ignored. Takes ownership of @p p_path.
+ *
+ * @param[in] d_type Type from readdir(3), or DT_UNKNOWN to look it up.
+ */
+
+static void scan_path (dedupe_t *p_dedupe, char *p_path, unsigned char d_type)
+{
+  if (d_type == DT_UNKNOWN)
+  {
+    struct stat path_stat;
+
+    if (lstat(p_path, &path_stat) != 0)
+    {
+      const int rc = errno;
+      fprintf(stderr, "W: Failed to stat \"%s\": %s\n", p_path, strerror(rc));
+      first_error(&p_dedupe->rc, rc);
+      free(p_path);
+      return;
+    }
+
+    d_type = IFTODT(path_stat.st_mode);
+  }
+
+  switch (d_type)
+  {
+    case DT_REG:
+    {
+      scan_file(p_dedupe, p_path);
+      break;
+    }
+
+    case DT_DIR:
+    {
+      scan_dir(p_dedupe, p_path);
+      break;
+    }
+
+    default:
+    {
+      free(p_path);
+      break;
+    }
+  }
+}
+
+/*============================================================================*/
+
+int dedupe_tree (operation_t *p_operation)
+{
+  const size_t block_size = p_operation->block_size;
+  uint64_t     buckets    = 1;
+
+  while (buckets * 2 * sizeof(dedupe_bucket_t) <= p_operation->index_memory)
+  {
+    buckets *= 2;
+  }
+
+  dedupe_t dedupe =
+  {
+    .block_size  = block_size,
+    .p_block     = malloc(block_size),
+    .p_buckets   = calloc(buckets, sizeof(dedupe_bucket_t)),
+    .bucket_mask = buckets - 1,
+    .p_matches   = malloc(DEDUPE_BATCH * sizeof(dedupe_match_t))
+  };
+
+  if (dedupe.p_block == NULL || dedupe.p_buckets == NULL ||
+      dedupe.p_matches == NULL)
+  {
+    fprintf(stderr, "Failed to allocate a %" PRIu64 " byte index: %s\n",
+            buckets * sizeof(dedupe_bucket_t), strerror(ENOMEM));
+    free(dedupe.p_matches);
+    free(dedupe.p_buckets);
+    free(dedupe.p_block);
+    return ENOMEM;
+  }
+
+  memset(dedupe.p_block, 0, block_size);
+  dedupe.zero_hash = block_hash(dedupe.p_block, block_size);
+
+  for (size_t i = 0; i < p_operation->num_srcs && !dedupe.stop; i++)
+  {
+    char *p_path = strdup(p_operation->src_filenames[i]);
+
+    AS(p_path != NULL, "Out of memory.");
+
+    scan_path(&dedupe, p_path, DT_UNKNOWN);
+  }
+
+  if (!dedupe.stop)
+  {
+    dedupe_flush(&dedupe);
+  }
+
+  printf("Scanned: %zu files, %" PRIu64 " blocks, %" PRIu64 " duplicates, "
+         "%" PRIu64 " bytes deduplicated, %" PRIu64 " bytes differed\n",
+         dedupe.num_files, dedupe.blocks, dedupe.duplicate_blocks,
+         dedupe.deduped_bytes, dedupe.differed_bytes);
+
+  if (dedupe.forgotten_blocks > 0)
+  {
+    fprintf(stderr, "W: The index was full and %" PRIu64 " blocks were "
+            "forgotten. A larger -m may find more duplicates.\n",
+            dedupe.forgotten_blocks);
+  }
+
+  for (size_t i = 0; i < dedupe.num_files; i++)
+  {
+    free(dedupe.p_files[i].p_path);
+  }
+
+  free(dedupe.p_files);
+  free(dedupe.p_matches);
+  free(dedupe.p_buckets);
+  free(dedupe.p_block);
+
+  return dedupe.rc;
+}
+
+/*============================================================================*/
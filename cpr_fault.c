@@ -0,0 +1,473 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, system call fault injector.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * This is built as libcpr_fault.so and loaded with LD_PRELOAD in front of a
+ * program linked against libcpr. It interposes the system calls libcpr makes
+ * and perturbs them according to the environment so that the fallback and
+ * retry paths can be exercised and benchmarked on an ordinary local file
+ * system. Every fault is deterministic: the same settings reproduce the same
+ * sequence of results.
+ *
+ * Only descriptors numbered CPR_FAULT_MIN_FD (default 3) and above are
+ * affected so that the standard streams keep working.
+ *
+ * @section environment Environment
+ *
+ * - @c CPR_FAULT_CLONE
+ *   What FICLONE and FICLONERANGE do. @c pass (the default) issues the real
+ *   ioctl, @c ok reports success without touching either file, anything else
+ *   is an errno name (e.g. @c EXDEV) or number which the ioctl fails with.
+ * - @c CPR_FAULT_CLONE_RANGE
+ *   As @c CPR_FAULT_CLONE but for FICLONERANGE alone, which it otherwise
+ *   follows. Lets a whole-file FICLONE fail into the fallback copy while the
+ *   copy's own FICLONERANGE calls succeed.
+ * - @c CPR_FAULT_READ_MAX, @c CPR_FAULT_WRITE_MAX
+ *   Largest number of bytes a single pread or pwrite transfers, to produce
+ *   short reads and writes.
+ * - @c CPR_FAULT_EINTR_EVERY
+ *   Fail every Nth pread or pwrite with @c EINTR before it transfers anything.
+ * - @c CPR_FAULT_READ_ERRNO, @c CPR_FAULT_WRITE_ERRNO
+ *   Errno name or number to fail reads or writes with once
+ *   @c CPR_FAULT_READ_AFTER or @c CPR_FAULT_WRITE_AFTER bytes (default zero)
+ *   have been transferred, so that zero fails the very first one.
+ * - @c CPR_FAULT_LATENCY_US
+ *   Microseconds to sleep before every interposed call.
+ * - @c CPR_FAULT_FIEMAP
+ *   @c encoded makes FS_IOC_FIEMAP report every extent as
+ *   @c FIEMAP_EXTENT_ENCODED and at the same physical address, as BTRFS does
+ *   for ranges of a file that reference one compressed extent.
+ */
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** What to do with FICLONE/FICLONERANGE. */
+
+typedef enum _clone_fault_t
+{
+  CLONE_FAULT_PASS,
+  CLONE_FAULT_OK,
+  CLONE_FAULT_ERRNO,
+} clone_fault_t;
+
+/*============================================================================*/
+
+/** Fault configuration, parsed once from the environment. */
+
+typedef struct _fault_config_t
+{
+  int           min_fd;
+  clone_fault_t clone_fault;
+  int           clone_errno;
+  clone_fault_t clone_range_fault;
+  int           clone_range_errno;
+  size_t        read_max;
+  size_t        write_max;
+  uint64_t      eintr_every;
+  int           read_errno;
+  uint64_t      read_after;
+  int           write_errno;
+  uint64_t      write_after;
+  uint64_t      latency_us;
+  bool          fiemap_encoded;
+} fault_config_t;
+
+/** Physical address CPR_FAULT_FIEMAP=encoded reports for every extent. */
+
+#define ENCODED_PHYSICAL (UINT64_C(1) << 30)
+
+/*============================================================================*/
+
+/** The real system call wrappers, looked up with dlsym(RTLD_NEXT). @{ */
+
+static int     (*real_ioctl)  (int, unsigned long, ...);
+static ssize_t (*real_pread)  (int, void *, size_t, off_t);
+static ssize_t (*real_pwrite) (int, const void *, size_t, off_t);
+
+/** @} */
+
+static fault_config_t g_config;
+
+/** Count of reads and writes seen, for CPR_FAULT_EINTR_EVERY. */
+
+static atomic_uint_fast64_t g_io_calls;
+
+/** Bytes transferred so far, for CPR_FAULT_*_AFTER. @{ */
+
+static atomic_uint_fast64_t g_bytes_read;
+static atomic_uint_fast64_t g_bytes_written;
+
+/** @} */
+
+/*============================================================================*/
+
+/**
+ * Translate an errno name such as "EXDEV", or a decimal number, into its
+ * value. Returns zero if @p p_value is not recognised.
+ */
+
+static int parse_errno (const char *p_value)
+{
+  static const struct
+  {
+    const char *p_name;
+    int         value;
+  } names[] =
+  {
+    { "EAGAIN",     EAGAIN     },
+    { "EBADF",      EBADF      },
+    { "EDQUOT",     EDQUOT     },
+    { "EFBIG",      EFBIG      },
+    { "EINTR",      EINTR      },
+    { "EINVAL",     EINVAL     },
+    { "EIO",        EIO        },
+    { "EISDIR",     EISDIR     },
+    { "ENOMEM",     ENOMEM     },
+    { "ENOSPC",     ENOSPC     },
+    { "ENOSYS",     ENOSYS     },
+    { "ENOTTY",     ENOTTY     },
+    { "EOPNOTSUPP", EOPNOTSUPP },
+    { "EPERM",      EPERM      },
+    { "ETXTBSY",    ETXTBSY    },
+    { "EXDEV",      EXDEV      },
+  };
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    if (strcmp(p_value, names[i].p_name) == 0)
+    {
+      return names[i].value;
+    }
+  }
+
+  return atoi(p_value);
+}
+
+/*============================================================================*/
+
+/**
+ * Return the unsigned value of environment variable @p p_name, or
+ * @p default_value if it is not set.
+ */
+
+static uint64_t env_uint64 (const char *p_name, const uint64_t default_value)
+{
+  const char *p_value = getenv(p_name);
+
+  return (p_value != NULL) ? strtoull(p_value, NULL, 0) : default_value;
+}
+
+/*============================================================================*/
+
+/**
+ * Return the errno named by environment variable @p p_name, or zero if it is
+ * not set.
+ */
+
+static int env_errno (const char *p_name)
+{
+  const char *p_value = getenv(p_name);
+
+  return (p_value != NULL) ? parse_errno(p_value) : 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Set @p p_fault and @p p_errno from environment variable @p p_name, as
+ * described for @c CPR_FAULT_CLONE, or leave them alone if it is not set.
+ */
+
+static void env_clone_fault (const char    *p_name,
+                             clone_fault_t *p_fault,
+                             int           *p_errno)
+{
+  const char *p_value = getenv(p_name);
+
+  if (p_value == NULL)
+  {
+    return;
+  }
+  else if (strcmp(p_value, "pass") == 0)
+  {
+    *p_fault = CLONE_FAULT_PASS;
+  }
+  else if (strcmp(p_value, "ok") == 0)
+  {
+    *p_fault = CLONE_FAULT_OK;
+  }
+  else
+  {
+    *p_fault = CLONE_FAULT_ERRNO;
+    *p_errno = parse_errno(p_value);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Resolve the real functions and parse the environment. Runs before main().
+ */
+
+__attribute__((constructor))
+
+static void fault_init (void)
+{
+  real_ioctl  = dlsym(RTLD_NEXT, "ioctl");
+  real_pread  = dlsym(RTLD_NEXT, "pread");
+  real_pwrite = dlsym(RTLD_NEXT, "pwrite");
+
+  g_config.min_fd = (int)env_uint64("CPR_FAULT_MIN_FD", 3);
+
+  g_config.clone_fault = CLONE_FAULT_PASS;
+
+  env_clone_fault("CPR_FAULT_CLONE", &g_config.clone_fault,
+                  &g_config.clone_errno);
+
+  g_config.clone_range_fault = g_config.clone_fault;
+  g_config.clone_range_errno = g_config.clone_errno;
+
+  env_clone_fault("CPR_FAULT_CLONE_RANGE", &g_config.clone_range_fault,
+                  &g_config.clone_range_errno);
+
+  g_config.read_max    = env_uint64("CPR_FAULT_READ_MAX", 0);
+  g_config.write_max   = env_uint64("CPR_FAULT_WRITE_MAX", 0);
+  g_config.eintr_every = env_uint64("CPR_FAULT_EINTR_EVERY", 0);
+  g_config.read_errno  = env_errno("CPR_FAULT_READ_ERRNO");
+  g_config.read_after  = env_uint64("CPR_FAULT_READ_AFTER", 0);
+  g_config.write_errno = env_errno("CPR_FAULT_WRITE_ERRNO");
+  g_config.write_after = env_uint64("CPR_FAULT_WRITE_AFTER", 0);
+  g_config.latency_us  = env_uint64("CPR_FAULT_LATENCY_US", 0);
+
+  const char *p_fiemap = getenv("CPR_FAULT_FIEMAP");
+
+  g_config.fiemap_encoded = (p_fiemap != NULL &&
+                             strcmp(p_fiemap, "encoded") == 0);
+}
+
+/*============================================================================*/
+
+/**
+ * Sleep for the configured per-call latency, if any.
+ */
+
+static void inject_latency (void)
+{
+  if (g_config.latency_us > 0)
+  {
+    struct timespec ts =
+    {
+      .tv_sec  = g_config.latency_us / 1000000,
+      .tv_nsec = (g_config.latency_us % 1000000) * 1000
+    };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Decide whether a read or write of @p length bytes should fail before it
+ * starts, and by how much to shorten it if not.
+ *
+ * @param[in]     err_value Errno to fail with once @p p_bytes >= @p after.
+ * @param[in]     after     Byte threshold for @p err_value. Zero fails the
+ *                          first transfer.
+ * @param[in]     p_bytes   Running byte count for this direction.
+ * @param[in]     max       Largest transfer allowed, zero for no limit.
+ * @param[in,out] p_length  Requested length; clamped to @p max.
+ * @return Zero to go ahead, or the errno to fail with.
+ */
+
+static int io_fault (const int             err_value,
+                     const uint64_t        after,
+                     atomic_uint_fast64_t *p_bytes,
+                     const size_t          max,
+                     size_t               *p_length)
+{
+  inject_latency();
+
+  if (g_config.eintr_every > 0 &&
+      (atomic_fetch_add(&g_io_calls, 1) + 1) % g_config.eintr_every == 0)
+  {
+    return EINTR;
+  }
+
+  if (err_value != 0 && atomic_load(p_bytes) >= after)
+  {
+    return err_value;
+  }
+
+  if (max > 0 && *p_length > max)
+  {
+    *p_length = max;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+int ioctl (int fd, unsigned long request, ...)
+{
+  /* FICLONE takes the source descriptor itself, everything else libcpr
+   * issues takes a pointer. */
+  int   src_fd = -1;
+  void *p_arg  = NULL;
+  va_list ap;
+  va_start(ap, request);
+  if (request == FICLONE)
+  {
+    src_fd = va_arg(ap, int);
+  }
+  else
+  {
+    p_arg = va_arg(ap, void *);
+  }
+  va_end(ap);
+
+  if (fd >= g_config.min_fd &&
+      (request == FICLONE || request == FICLONERANGE))
+  {
+    const bool range = (request == FICLONERANGE);
+
+    inject_latency();
+
+    switch (range ? g_config.clone_range_fault : g_config.clone_fault)
+    {
+      case CLONE_FAULT_PASS:
+      {
+        break;
+      }
+
+      case CLONE_FAULT_OK:
+      {
+        return 0;
+      }
+
+      case CLONE_FAULT_ERRNO:
+      {
+        errno = range ? g_config.clone_range_errno : g_config.clone_errno;
+        return -1;
+      }
+    }
+  }
+
+  if (request == FICLONE)
+  {
+    return real_ioctl(fd, request, src_fd);
+  }
+
+  const int rc = real_ioctl(fd, request, p_arg);
+
+  if (rc == 0 && request == FS_IOC_FIEMAP && g_config.fiemap_encoded)
+  {
+    struct fiemap *p_map = p_arg;
+
+    /* A count-only query has no extents to rewrite. */
+    for (unsigned i = 0;
+         i < p_map->fm_mapped_extents && i < p_map->fm_extent_count; i++)
+    {
+      p_map->fm_extents[i].fe_flags    |= FIEMAP_EXTENT_ENCODED;
+      p_map->fm_extents[i].fe_physical  = ENCODED_PHYSICAL;
+    }
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+ssize_t pread (int fd, void *p_buf, size_t length, off_t offset)
+{
+  if (fd >= g_config.min_fd)
+  {
+    int rc = io_fault(g_config.read_errno, g_config.read_after,
+                      &g_bytes_read, g_config.read_max, &length);
+
+    if (rc != 0)
+    {
+      errno = rc;
+      return -1;
+    }
+  }
+
+  ssize_t got = real_pread(fd, p_buf, length, offset);
+
+  if (got > 0)
+  {
+    atomic_fetch_add(&g_bytes_read, (uint64_t)got);
+  }
+
+  return got;
+}
+
+/*============================================================================*/
+
+ssize_t pwrite (int fd, const void *p_buf, size_t length, off_t offset)
+{
+  if (fd >= g_config.min_fd)
+  {
+    int rc = io_fault(g_config.write_errno, g_config.write_after,
+                      &g_bytes_written, g_config.write_max, &length);
+
+    if (rc != 0)
+    {
+      errno = rc;
+      return -1;
+    }
+  }
+
+  ssize_t wrote = real_pwrite(fd, p_buf, length, offset);
+
+  if (wrote > 0)
+  {
+    atomic_fetch_add(&g_bytes_written, (uint64_t)wrote);
+  }
+
+  return wrote;
+}
+
+/*============================================================================*/
+
@@ -0,0 +1,253 @@
+#!/bin/sh
+#
+# Copyright (c) 2019. Quantum Corporation. All Rights Reserved.
+# DXi, StorNext and Quantum are either a trademarks or registered
+# trademarks of Quantum Corporation in the US and/or other countries.
+#
+# Fault-injection benchmark driver for cpr.
+#
+# Runs cpr under libcpr_fault.so with a fixed set of scenarios (clone failure
+# forcing fallback, short reads and writes, EINTR storms, per-call latency,
+# hard I/O errors, stale journals, encoded extents) on an ordinary local file
+# system. For each scenario it checks that cpr succeeded or failed as expected
+# and that a successful copy is byte-identical to the source, then reports the
+# wall time. The links cases re-clone a tree holding two hard links to the
+# source over an earlier clone of it, with the clone failing into the fallback
+# copy, and check both destinations still hold the data and are still links
+# to each other.
+#
+# USAGE: cpr_fault_bench.sh [SIZE_MIB] [WORK_DIR]
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+# IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+set -u
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+CPR="$HERE/cpr"
+SHIM="$HERE/libcpr_fault.so"
+SIZE_MIB=${1:-64}
+WORK_DIR=${2:-$(mktemp -d "${TMPDIR:-/tmp}/cpr_fault.XXXXXX")}
+
+SRC="$WORK_DIR/src"
+SPARSE="$WORK_DIR/sparse"
+SMALL="$WORK_DIR/small"
+DST="$WORK_DIR/dst"
+CASE_SRC="$SRC"
+FAILED=0
+
+if [ ! -x "$CPR" ] || [ ! -f "$SHIM" ]; then
+  echo "Build cpr and libcpr_fault.so first (make)." >&2
+  exit 1
+fi
+
+mkdir -p "$WORK_DIR"
+dd if=/dev/urandom of="$SRC" bs=1048576 count="$SIZE_MIB" 2>/dev/null
+
+# For the CPR_FAULT_FIEMAP cases: two extents with a hole between them, and
+# one extent.
+dd if=/dev/urandom of="$SPARSE" bs=1048576 count=1 2>/dev/null
+dd if=/dev/urandom of="$SPARSE" bs=1048576 count=1 seek=2 2>/dev/null
+dd if=/dev/urandom of="$SMALL" bs=1048576 count=1 2>/dev/null
+
+now_ns() {
+  date +%s%N
+}
+
+# run_case NAME EXPECT CPR_ARGS ENV...
+#
+# Copies CASE_SRC to DST.
+#
+# EXPECT is "pass" if cpr should succeed and produce an exact copy, "noop" if
+# cpr should succeed without the copy being checked (the clone was faked), or
+# "fail" if cpr should report an error.
+run_case() {
+  name=$1
+  expect=$2
+  args=$3
+  shift 3
+
+  rm -f "$DST"
+
+  start=$(now_ns)
+  env LD_PRELOAD="$SHIM" "$@" "$CPR" $args "$CASE_SRC" "$DST" \
+    >/dev/null 2>&1
+  rc=$?
+  end=$(now_ns)
+
+  if [ "$expect" = "pass" ]; then
+    if [ $rc -eq 0 ] && cmp -s "$CASE_SRC" "$DST"; then
+      result=ok
+    else
+      result=FAILED
+    fi
+  elif [ "$expect" = "noop" ]; then
+    [ $rc -eq 0 ] && result=ok || result=FAILED
+  elif [ $rc -ne 0 ]; then
+    result=ok
+  else
+    result=FAILED
+  fi
+
+  [ "$result" = "ok" ] || FAILED=1
+
+  ms=$(( (end - start) / 1000000 ))
+  printf "%-28s %-6s %8d ms  %s\n" "$name" "$expect" "$ms" "$result"
+}
+
+# run_compare_case NAME EXPECT FILE ENV...
+#
+# Compares SPARSE with FILE using cpr -E. EXPECT is "same" if they should be
+# found equal, or "differ" if not.
+run_compare_case() {
+  name=$1
+  expect=$2
+  file=$3
+  shift 3
+
+  start=$(now_ns)
+  env LD_PRELOAD="$SHIM" "$@" "$CPR" -E "$SPARSE" "$file" >/dev/null 2>&1
+  rc=$?
+  end=$(now_ns)
+
+  if { [ "$expect" = "same" ] && [ $rc -eq 0 ]; } ||
+     { [ "$expect" = "differ" ] && [ $rc -ne 0 ]; }; then
+    result=ok
+  else
+    result=FAILED
+    FAILED=1
+  fi
+
+  ms=$(( (end - start) / 1000000 ))
+  printf "%-28s %-6s %8d ms  %s\n" "$name" "$expect" "$ms" "$result"
+}
+
+# run_journal_case NAME ENV...
+#
+# Copies SRC with -j over a destination twice its size, as an earlier request
+# could have left it, next to a journal that does not describe this copy.
+run_journal_case() {
+  name=$1
+  shift
+  journal="$WORK_DIR/journal"
+
+  cat "$SRC" "$SRC" > "$DST"
+  dd if=/dev/urandom of="$journal" bs=200 count=1 2>/dev/null
+
+  start=$(now_ns)
+  env LD_PRELOAD="$SHIM" "$@" "$CPR" -c -j "$journal" "$SRC" "$DST" \
+    >/dev/null 2>&1
+  rc=$?
+  end=$(now_ns)
+
+  if [ $rc -eq 0 ] && cmp -s "$SRC" "$DST" && [ ! -e "$journal" ]; then
+    result=ok
+  else
+    result=FAILED
+    FAILED=1
+  fi
+
+  rm -f "$journal"
+
+  ms=$(( (end - start) / 1000000 ))
+  printf "%-28s %-6s %8d ms  %s\n" "$name" "pass" "$ms" "$result"
+}
+
+# run_links_case NAME CPR_ARGS ENV...
+#
+# Clones two hard links to SRC into a directory, changes their modification
+# time and clones them again into the same directory with CPR_ARGS.
+run_links_case() {
+  name=$1
+  args=$2
+  shift 2
+  tree="$WORK_DIR/tree"
+  copy="$WORK_DIR/copy"
+
+  rm -rf "$tree" "$copy"
+  mkdir "$tree" "$copy"
+  cp "$SRC" "$tree/a"
+  ln "$tree/a" "$tree/b"
+
+  start=$(now_ns)
+  env LD_PRELOAD="$SHIM" "$@" "$CPR" -c -t "$tree/a" "$tree/b" "$copy" \
+    >/dev/null 2>&1 &&
+    touch "$tree/a" &&
+    env LD_PRELOAD="$SHIM" "$@" "$CPR" -c -t $args "$tree/a" "$tree/b" \
+      "$copy" >/dev/null 2>&1
+  rc=$?
+  end=$(now_ns)
+
+  if [ $rc -eq 0 ] && cmp -s "$SRC" "$copy/a" && cmp -s "$SRC" "$copy/b" &&
+     [ "$copy/a" -ef "$copy/b" ]; then
+    result=ok
+  else
+    result=FAILED
+    FAILED=1
+  fi
+
+  rm -rf "$tree" "$copy"
+
+  ms=$(( (end - start) / 1000000 ))
+  printf "%-28s %-6s %8d ms  %s\n" "$name" "pass" "$ms" "$result"
+}
+
+printf "%-28s %-6s %11s  %s\n" "SCENARIO" "EXPECT" "TIME" "RESULT"
+
+run_case "baseline"            pass "-c -f"
+run_case "clone-ok"            noop "-f"    CPR_FAULT_CLONE=ok
+run_case "clone-exdev"         fail "-f"    CPR_FAULT_CLONE=EXDEV
+run_case "fallback-exdev"      pass "-c -f" CPR_FAULT_CLONE=EXDEV
+run_case "fallback-eopnotsupp" pass "-c -f" CPR_FAULT_CLONE=EOPNOTSUPP
+run_case "short-reads"         pass "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_READ_MAX=1000
+run_case "short-writes"        pass "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_WRITE_MAX=777
+run_case "eintr-storm"         pass "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_EINTR_EVERY=2
+run_case "latency-20us"        pass "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_LATENCY_US=20
+run_case "read-eio"            fail "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_READ_ERRNO=EIO \
+                                            CPR_FAULT_READ_AFTER=1048576
+run_case "write-enospc"        fail "-c -f" CPR_FAULT_CLONE=EXDEV \
+                                            CPR_FAULT_WRITE_ERRNO=ENOSPC \
+                                            CPR_FAULT_WRITE_AFTER=1048576
+run_journal_case "journal-stale" CPR_FAULT_CLONE=EXDEV
+
+CASE_SRC="$SPARSE"
+run_case "encoded-sharing"     pass "-c -f -k" CPR_FAULT_CLONE=EXDEV \
+                                               CPR_FAULT_CLONE_RANGE=ok \
+                                               CPR_FAULT_FIEMAP=encoded
+CASE_SRC="$SMALL"
+run_case "encoded-verify"      fail "-c -f -V" CPR_FAULT_CLONE=EXDEV \
+                                               CPR_FAULT_FIEMAP=encoded
+CASE_SRC="$SRC"
+
+cp "$SPARSE" "$DST"
+run_compare_case "encoded-compare-same"   same   "$DST" \
+                                                 CPR_FAULT_FIEMAP=encoded
+printf 'X' | dd of="$DST" bs=1 seek=2097152 conv=notrunc 2>/dev/null
+run_compare_case "encoded-compare-differ" differ "$DST" \
+                                                 CPR_FAULT_FIEMAP=encoded
+
+run_links_case "links-force"         "-f"          CPR_FAULT_CLONE=EXDEV
+run_links_case "links-update"        "-u mtime"    CPR_FAULT_CLONE=EXDEV
+run_links_case "links-update-ring"   "-u mtime -S" CPR_FAULT_CLONE=EXDEV
+run_links_case "links-update-digest" "-u digest"   CPR_FAULT_CLONE=EXDEV \
+                                                   CPR_FAULT_READ_MAX=1000
+
+rm -f "$SRC" "$SPARSE" "$SMALL" "$DST"
+rmdir "$WORK_DIR" 2>/dev/null
+
+exit $FAILED
@@ -0,0 +1,754 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, dry-run planning.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * With -n the sources are walked as a tree clone would walk them, but only
+ * regular files are looked at and nothing is created. Each is planned with
+ * qtm_clone_plan() against the directory its clone would be created in,
+ * and the byte counts are summed, along with which file systems were seen
+ * and whether reflinks between them worked.
+ *
+ * The time estimate comes from a profile file that ordinary runs with -Q
+ * add their measured reflink and copy throughput to. It is a few lines of
+ * "name value" totals, so that it keeps improving as more runs are added
+ * and can be reset by deleting it.
+ */
+
+#include "cpr.h"
+#include "libcpr.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** A regular file found by the walk. */
+
+typedef struct _plan_file_t
+{
+  char   *p_path;
+  dev_t   dev;
+  ino_t   ino;
+  nlink_t nlink;
+} plan_file_t;
+
+/** Planned files sharing a pair of file systems and a probe outcome. */
+
+typedef struct _plan_fs_t
+{
+  uint64_t src_fs_type;
+  uint64_t dst_fs_type;
+  bool     same_fs;
+  int      probe_rc;
+  size_t   num_files;
+} plan_fs_t;
+
+/** State of one plan_clone() call. */
+
+typedef struct _plan_t
+{
+  const operation_t  *p_operation;
+  qtm_clone_options_t options;
+  int                 dst_dir_fd;
+
+  plan_file_t        *p_files;
+  size_t              num_files;
+  size_t              max_files;
+
+  plan_fs_t          *p_fss;
+  size_t              num_fss;
+
+  size_t              num_planned;
+  qtm_clone_plan_t    total;
+  int                 rc;
+} plan_t;
+
+/*============================================================================*/
+
+/**
+ * Return a newly allocated copy of the directory part of @p p_path.
+ */
+
+static char *path_dirname (const char *p_path)
+{
+  char *p_copy = strdup(p_path);
+
+  AS(p_copy != NULL, "Out of memory.");
+
+  char *p_dir = strdup(dirname(p_copy));
+
+  AS(p_dir != NULL, "Out of memory.");
+
+  free(p_copy);
+
+  return p_dir;
+}
+
+/*============================================================================*/
+
+/**
+ * Return a printable name for the statfs(2) @c f_type @p fs_type, or NULL if
+ * it is not one that cpr is commonly run on.
+ */
+
+static const char *fs_type_name (const uint64_t fs_type)
+{
+  switch (fs_type)
+  {
+    case 0x9123683e: return "btrfs";
+    case 0xca451a4e: return "bcachefs";
+    case 0x0000ef53: return "ext4";
+    case 0xf2f52010: return "f2fs";
+    case 0x00006969: return "nfs";
+    case 0x7461636f: return "ocfs2";
+    case 0xfe534d42: return "smb2";
+    case 0x01021994: return "tmpfs";
+    case 0x58465342: return "xfs";
+    case 0x2fc12fc1: return "zfs";
+  }
+
+  return NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Print @p fs_type by name if it has one, otherwise as its magic number.
+ */
+
+static void print_fs_type (const uint64_t fs_type)
+{
+  const char *p_name = fs_type_name(fs_type);
+
+  if (p_name != NULL)
+  {
+    printf("%s", p_name);
+  }
+  else
+  {
+    printf("0x%" PRIx64, fs_type);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Plan @p p_path and add the result to the totals.
+ */
+
+static void plan_file (plan_t *p_plan, const char *p_path)
+{
+  const operation_t *p_operation = p_plan->p_operation;
+  const int          src_fd      = open(p_path, O_RDONLY);
+
+  if (src_fd < 0)
+  {
+    const int rc = errno;
+    fprintf(stderr, "Failed to open source file \"%s\": %s\n",
+            p_path, strerror(rc));
+    first_error(&p_plan->rc, rc);
+    return;
+  }
+
+  const bool       range = (p_operation->clone_mode == CLONE_MODE_RANGE);
+  qtm_clone_plan_t plan;
+  const int        rc    = qtm_clone_plan(src_fd, p_plan->dst_dir_fd,
+                                          range ? p_operation->src_offset : 0,
+                                          range ? p_operation->src_length : 0,
+                                          &p_plan->options, &plan);
+
+  close(src_fd);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to plan \"%s\": %s\n", p_path, strerror(rc));
+    first_error(&p_plan->rc, rc);
+    return;
+  }
+
+  qtm_clone_plan_t *p_total = &p_plan->total;
+
+  p_plan->num_planned++;
+  p_total->data_bytes  += plan.data_bytes;
+  p_total->hole_bytes  += plan.hole_bytes;
+  p_total->clone_bytes += plan.clone_bytes;
+  p_total->copy_bytes  += plan.copy_bytes;
+  p_total->fail_bytes  += plan.fail_bytes;
+
+  for (size_t i = 0; i < p_plan->num_fss; i++)
+  {
+    plan_fs_t *p_fs = &p_plan->p_fss[i];
+
+    if (p_fs->src_fs_type == plan.src_fs_type &&
+        p_fs->dst_fs_type == plan.dst_fs_type &&
+        p_fs->same_fs == plan.same_fs && p_fs->probe_rc == plan.probe_rc)
+    {
+      p_fs->num_files++;
+      return;
+    }
+  }
+
+  p_plan->p_fss = realloc(p_plan->p_fss,
+                          (p_plan->num_fss + 1) * sizeof(*p_plan->p_fss));
+
+  AS(p_plan->p_fss != NULL, "Out of memory.");
+
+  p_plan->p_fss[p_plan->num_fss++] = (plan_fs_t)
+  {
+    .src_fs_type = plan.src_fs_type,
+    .dst_fs_type = plan.dst_fs_type,
+    .same_fs     = plan.same_fs,
+    .probe_rc    = plan.probe_rc,
+    .num_files   = 1
+  };
+}
+
+/*============================================================================*/
+
+/**
+ * Queue regular file @p p_path, described by @p p_stat, to be planned. Takes
+ * ownership of @p p_path.
+ */
+
+static void add_file (plan_t *p_plan, char *p_path, const struct stat *p_stat)
+{
+  if (p_plan->num_files == p_plan->max_files)
+  {
+    p_plan->max_files = (p_plan->max_files == 0) ? 256
+                                                 : 2 * p_plan->max_files;
+    p_plan->p_files   = realloc(p_plan->p_files,
+                                p_plan->max_files * sizeof(*p_plan->p_files));
+
+    AS(p_plan->p_files != NULL, "Out of memory.");
+  }
+
+  p_plan->p_files[p_plan->num_files++] = (plan_file_t)
+  {
+    .p_path = p_path,
+    .dev    = p_stat->st_dev,
+    .ino    = p_stat->st_ino,
+    .nlink  = p_stat->st_nlink
+  };
+}
+
+/*============================================================================*/
+
+/**
+ * qsort() comparison bringing the paths of each inode together.
+ */
+
+static int compare_inodes (const void *p_a, const void *p_b)
+{
+  const plan_file_t *p_file_a = p_a;
+  const plan_file_t *p_file_b = p_b;
+
+  if (p_file_a->dev != p_file_b->dev)
+  {
+    return (p_file_a->dev > p_file_b->dev) - (p_file_a->dev < p_file_b->dev);
+  }
+
+  return (p_file_a->ino > p_file_b->ino) - (p_file_a->ino < p_file_b->ino);
+}
+
+/*============================================================================*/
+
+static void walk_path (plan_t    *p_plan,
+                       char      *p_path,
+                       const bool top_level);
+
+/**
+ * Walk everything in directory @p p_path. Takes ownership of @p p_path.
+ */
+
+static void walk_dir (plan_t *p_plan, char *p_path)
+{
+  dir_entry_t *p_entries   = NULL;
+  size_t       num_entries = 0;
+  const int    rc          = read_dir(p_path, &p_entries, &num_entries);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to open directory \"%s\": %s\n",
+            p_path, strerror(rc));
+    first_error(&p_plan->rc, rc);
+    free(p_path);
+    return;
+  }
+
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    walk_path(p_plan, path_join(p_path, p_entries[i].p_name), false);
+    free(p_entries[i].p_name);
+  }
+
+  free(p_entries);
+  free(p_path);
+}
+
+/*============================================================================*/
+
+/**
+ * Queue @p p_path if it is a regular file, or walk it if it is a directory
+ * and -R was given, as clone_tree() would. Takes ownership of @p p_path.
+ *
+ * @param[in] top_level True for a source named on the command line, which is
+ *                      followed if it is a symbolic link unless -R was given.
+ */
+
+static void walk_path (plan_t *p_plan, char *p_path, const bool top_level)
+{
+  const bool  recursive = p_plan->p_operation->recursive;
+  struct stat path_stat;
+  int         rc        = (top_level && !recursive) ? stat(p_path, &path_stat)
+                                                    : lstat(p_path, &path_stat);
+
+  if (rc != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
+            p_path, strerror(rc));
+    first_error(&p_plan->rc, rc);
+    free(p_path);
+  }
+  else if (S_ISREG(path_stat.st_mode))
+  {
+    add_file(p_plan, p_path, &path_stat);
+  }
+  else if (S_ISDIR(path_stat.st_mode) && recursive)
+  {
+    walk_dir(p_plan, p_path);
+  }
+  else if (S_ISDIR(path_stat.st_mode))
+  {
+    fprintf(stderr, "Omitting directory \"%s\" without -R\n", p_path);
+    first_error(&p_plan->rc, EISDIR);
+    free(p_path);
+  }
+  else
+  {
+    /* Links and special files are recreated, not cloned. */
+    free(p_path);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Open the directory that the clone of @p p_operation would create files
+ * in, reporting anything that would stop the clone from starting.
+ */
+
+static int open_dst_dir (const operation_t *p_operation, int *p_dir_fd)
+{
+  const char *p_dst = p_operation->dst_filenames[0];
+  struct stat dst_stat;
+  const bool  exists = (stat(p_dst, &dst_stat) == 0);
+  char       *p_dir  = NULL;
+
+  if (p_operation->clone_mode == CLONE_MODE_TREE)
+  {
+    if (exists && S_ISDIR(dst_stat.st_mode))
+    {
+      p_dir = strdup(p_dst);
+    }
+    else if (!exists && errno == ENOENT && p_operation->num_srcs == 1)
+    {
+      p_dir = path_dirname(p_dst);
+    }
+    else
+    {
+      fprintf(stderr, "Destination \"%s\" is not a directory\n", p_dst);
+      return ENOTDIR;
+    }
+  }
+  else
+  {
+    if (exists && p_operation->clone_mode == CLONE_MODE_FILE &&
+        !p_operation->force)
+    {
+      fprintf(stderr, "Destination file \"%s\" exists and -f was not "
+              "given\n", p_dst);
+      return EEXIST;
+    }
+
+    p_dir = path_dirname(p_dst);
+  }
+
+  AS(p_dir != NULL, "Out of memory.");
+
+  int rc = 0;
+
+  *p_dir_fd = open(p_dir, O_RDONLY | O_DIRECTORY);
+
+  if (*p_dir_fd < 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to open destination directory \"%s\": %s\n",
+            p_dir, strerror(rc));
+  }
+
+  free(p_dir);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Read the totals in profile file @p p_filename into @p p_profile, leaving
+ * any it does not have at zero.
+ */
+
+static int profile_load (const char *p_filename, profile_t *p_profile)
+{
+  *p_profile = (profile_t) { .clone_bytes = 0 };
+
+  FILE *p_file = fopen(p_filename, "r");
+
+  if (p_file == NULL)
+  {
+    return errno;
+  }
+
+  char     name[64];
+  uint64_t value = 0;
+
+  while (fscanf(p_file, " %63s %" SCNu64, name, &value) == 2)
+  {
+    if (strcmp(name, "clone_bytes") == 0)
+    {
+      p_profile->clone_bytes = value;
+    }
+    else if (strcmp(name, "clone_ns") == 0)
+    {
+      p_profile->clone_ns = value;
+    }
+    else if (strcmp(name, "copy_bytes") == 0)
+    {
+      p_profile->copy_bytes = value;
+    }
+    else if (strcmp(name, "copy_ns") == 0)
+    {
+      p_profile->copy_ns = value;
+    }
+  }
+
+  const int rc = ferror(p_file) ? EIO : 0;
+
+  fclose(p_file);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Set @p p_ns to the time @p bytes would take at the rate in the profile of
+ * @p profile_bytes in @p profile_ns.
+ *
+ * @return False if the profile has nothing to go on.
+ */
+
+static bool estimate_ns (const uint64_t bytes,
+                         const uint64_t profile_bytes,
+                         const uint64_t profile_ns,
+                         double        *p_ns)
+{
+  *p_ns = 0.0;
+
+  if (bytes == 0)
+  {
+    return true;
+  }
+  else if (profile_bytes == 0 || profile_ns == 0)
+  {
+    return false;
+  }
+
+  *p_ns = (double)bytes * (double)profile_ns / (double)profile_bytes;
+
+  return true;
+}
+
+/*============================================================================*/
+
+/**
+ * Print how long the planned bytes would take according to -Q's profile.
+ */
+
+static void report_estimate (const operation_t      *p_operation,
+                             const qtm_clone_plan_t *p_total)
+{
+  const char *p_filename = p_operation->profile_filename;
+
+  if (p_filename == NULL)
+  {
+    printf("Estimate: none without a profile, record one with -Q\n");
+    return;
+  }
+
+  profile_t profile;
+  const int rc = profile_load(p_filename, &profile);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "W: Failed to read profile \"%s\": %s\n", p_filename,
+            strerror(rc));
+    return;
+  }
+
+  double clone_ns = 0.0;
+  double copy_ns  = 0.0;
+
+  if (!estimate_ns(p_total->clone_bytes, profile.clone_bytes,
+                   profile.clone_ns, &clone_ns))
+  {
+    printf("Estimate: none, profile \"%s\" has no reflinks measured\n",
+           p_filename);
+  }
+  else if (!estimate_ns(p_total->copy_bytes, profile.copy_bytes,
+                        profile.copy_ns, &copy_ns))
+  {
+    printf("Estimate: none, profile \"%s\" has no copies measured\n",
+           p_filename);
+  }
+  else
+  {
+    printf("Estimate: %.3f s, %.3f s to clone and %.3f s to copy\n",
+           (clone_ns + copy_ns) / 1e9, clone_ns / 1e9, copy_ns / 1e9);
+  }
+}
+
+/*============================================================================*/
+
+int plan_clone (operation_t *p_operation)
+{
+  plan_t plan =
+  {
+    .p_operation = p_operation,
+    .options     =
+    {
+      .fallback_copy            = p_operation->fallback_copy,
+      .fallback_copy_block_size = p_operation->block_size,
+      .p_journal_path           = NULL,
+      .checkpoint_interval      = 0,
+      .reflink_threshold        = p_operation->reflink_threshold,
+      .flags                    = p_operation->clone_flags
+    },
+    .dst_dir_fd  = -1
+  };
+
+  int rc = open_dst_dir(p_operation, &plan.dst_dir_fd);
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  if (p_operation->clone_mode == CLONE_MODE_TREE)
+  {
+    for (size_t i = 0; i < p_operation->num_srcs; i++)
+    {
+      char *p_path = strdup(p_operation->src_filenames[i]);
+
+      AS(p_path != NULL, "Out of memory.");
+
+      walk_path(&plan, p_path, true);
+    }
+
+    /* A tree clone reflinks each inode once and hard links the rest. */
+    qsort(plan.p_files, plan.num_files, sizeof(*plan.p_files),
+          compare_inodes);
+
+    for (size_t i = 0; i < plan.num_files; i++)
+    {
+      const plan_file_t *p_file = &plan.p_files[i];
+
+      if (i == 0 || p_file->nlink == 1 ||
+          compare_inodes(p_file, p_file - 1) != 0)
+      {
+        plan_file(&plan, p_file->p_path);
+      }
+
+      free(p_file->p_path);
+    }
+  }
+  else
+  {
+    plan_file(&plan, p_operation->src_filename);
+  }
+
+  close(plan.dst_dir_fd);
+
+  const qtm_clone_plan_t *p_total = &plan.total;
+
+  printf("Plan: %zu files, %" PRIu64 " bytes of data, %" PRIu64 " in "
+         "holes: %" PRIu64 " to clone, %" PRIu64 " to copy, %" PRIu64
+         " to fail\n", plan.num_planned, p_total->data_bytes,
+         p_total->hole_bytes, p_total->clone_bytes, p_total->copy_bytes,
+         p_total->fail_bytes);
+
+  for (size_t i = 0; i < plan.num_fss; i++)
+  {
+    const plan_fs_t *p_fs = &plan.p_fss[i];
+
+    printf("File systems: ");
+    print_fs_type(p_fs->src_fs_type);
+    printf(" to ");
+    print_fs_type(p_fs->dst_fs_type);
+    printf("%s, %zu files, reflink %s\n",
+           p_fs->same_fs ? "" : " (different)", p_fs->num_files,
+           (p_fs->probe_rc == 0) ? "works" : strerror(p_fs->probe_rc));
+  }
+
+  report_estimate(p_operation, p_total);
+
+  free(plan.p_fss);
+  free(plan.p_files);
+
+  return plan.rc;
+}
+
+/*============================================================================*/
+
+void profile_add (operation_t *p_operation,
+                  const int    src_fd,
+                  const off_t  src_offset,
+                  const size_t length)
+{
+  qtm_clone_stats_t stats;
+
+  if (p_operation->profile_filename == NULL ||
+      qtm_clone_last_stats(&stats) != 0)
+  {
+    return;
+  }
+
+  uint64_t bytes = length;
+
+  if (stats.method == QTM_CLONE_METHOD_REFLINK && bytes == 0)
+  {
+    struct stat src_stat;
+
+    if (fstat(src_fd, &src_stat) == 0 && src_stat.st_size > src_offset)
+    {
+      bytes = src_stat.st_size - src_offset;
+    }
+  }
+
+  pthread_mutex_lock(&p_operation->profile_lock);
+
+  if (stats.method == QTM_CLONE_METHOD_REFLINK)
+  {
+    p_operation->profile.clone_bytes += bytes;
+    p_operation->profile.clone_ns    += stats.elapsed_ns;
+  }
+  else if (stats.method == QTM_CLONE_METHOD_COPY)
+  {
+    p_operation->profile.copy_bytes += stats.bytes_copied;
+    p_operation->profile.copy_ns    += stats.elapsed_ns;
+  }
+
+  pthread_mutex_unlock(&p_operation->profile_lock);
+}
+
+/*============================================================================*/
+
+int profile_save (const operation_t *p_operation)
+{
+  const char *p_filename = p_operation->profile_filename;
+
+  if (p_filename == NULL || p_operation->plan)
+  {
+    return 0;
+  }
+
+  profile_t profile;
+  int       rc = profile_load(p_filename, &profile);
+
+  if (rc != 0 && rc != ENOENT)
+  {
+    fprintf(stderr, "Failed to read profile \"%s\": %s\n", p_filename,
+            strerror(rc));
+    return rc;
+  }
+
+  profile.clone_bytes += p_operation->profile.clone_bytes;
+  profile.clone_ns    += p_operation->profile.clone_ns;
+  profile.copy_bytes  += p_operation->profile.copy_bytes;
+  profile.copy_ns     += p_operation->profile.copy_ns;
+
+  /* Written aside and renamed over, so a reader never sees half a file. */
+  char *p_tmp_filename = NULL;
+
+  AS(asprintf(&p_tmp_filename, "%s.tmp", p_filename) >= 0, "Out of memory.");
+
+  FILE *p_file = fopen(p_tmp_filename, "w");
+
+  rc = (p_file == NULL) ? errno : 0;
+
+  if (rc == 0)
+  {
+    fprintf(p_file, "clone_bytes %" PRIu64 "\nclone_ns %" PRIu64 "\n"
+            "copy_bytes %" PRIu64 "\ncopy_ns %" PRIu64 "\n",
+            profile.clone_bytes, profile.clone_ns, profile.copy_bytes,
+            profile.copy_ns);
+
+    rc = ferror(p_file) ? EIO : 0;
+
+    if (fclose(p_file) != 0 && rc == 0)
+    {
+      rc = errno;
+    }
+  }
+
+  if (rc == 0 && rename(p_tmp_filename, p_filename) != 0)
+  {
+    rc = errno;
+  }
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to write profile \"%s\": %s\n", p_filename,
+            strerror(rc));
+    unlink(p_tmp_filename);
+  }
+
+  free(p_tmp_filename);
+
+  return rc;
+}
+
+/*============================================================================*/
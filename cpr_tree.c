@@ -0,0 +1,2267 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, multi-file and tree clones.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * The sources are walked first, creating destination directories and
+ * symbolic links as they are found and building a list of regular files to
+ * clone. The files are then cloned either one at a time with ordinary system
+ * calls or, with -S, in batches whose metadata system calls go through
+ * io_uring.
+ *
+ * @section notes Notes
+ *
+ * For trees of small files the time goes on opening, stat-ing, syncing and
+ * closing rather than on data, so the -S mode pipelines those in three
+ * stages over batches of files:
+ *
+ *   A. io_uring: openat(src), statx(src), openat(dst).
+ *   B. inline:   clone (or fallback copy) and set attributes.
+ *   C. io_uring: close(src), fsync(dst) linked to close(dst).
+ *
+ * There are three sets of slots so that, while stage B of one batch runs,
+ * stage A of the next batch and stage C of the previous one are both in
+ * flight. statx is only asked for the inode number and link count plus what
+ * -o/-t/-p need.
+ *
+ * Sources with more than one link are remembered by (st_dev, st_ino) once
+ * cloned. Later paths to the same inode are recreated as hard links to the
+ * first destination rather than cloned again, which matters most when the
+ * clone falls back to a copy. A destination is only truncated once it is
+ * known to be cloned: with -f it may be a hard link left by an earlier run
+ * to a destination already cloned in this one. Stage A therefore opens it
+ * without O_TRUNC and stage B truncates it just before the clone.
+ *
+ * With -w the files are instead cloned by a pool of workers. Every file is
+ * sized with stat(2) first, on the same threads, and the jobs are handed out
+ * largest first, the
+ * longest-processing-time rule, so that no large file is left running alone
+ * at the end. A file bigger than an equal share of the total for a few jobs
+ * per worker is split into range jobs of that size, each cloned with
+ * FICLONERANGE or copied by whichever worker takes it, and the last of them
+ * to finish syncs the file and sets its attributes. The first of them to start
+ * opens the file without holding the lock, and the file's other jobs wait for
+ * it, while other files' jobs go on. Files with more than one
+ * link are left to an ordinary pass once the workers are done, so that they
+ * can be linked to each other as above.
+ *
+ * With -u the list of files is checked against the existing destination
+ * before any is cloned, and those found up to date are dropped from it. The
+ * check is only stat(2) calls unless a digest was asked for, so it runs on
+ * the -w threads, which claim TREE_PASS_BATCH files at a time to keep the
+ * lock out of the way however many files there are. The -w sizing pass runs
+ * the same way.
+ */
+
+#include "cpr.h"
+#include "cpr_uring.h"
+#include "libcpr.h"
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** Files per io_uring batch. */
+
+#define TREE_BATCH 64
+
+/** Batches in the pipeline at once: one per stage. */
+
+#define TREE_SETS 3
+
+/**
+ * Ring size. At most one stage's worth of entries, three per file, is
+ * waiting for submission at a time; the completion queue is twice this size
+ * and holds the up to three stages in flight.
+ */
+
+#define TREE_RING_ENTRIES 512
+
+/** Range jobs per -w worker that a file is split into if it is large. */
+
+#define TREE_SPLIT_PER_WORKER 4
+
+/** Smallest range job, and the alignment of every range job's offset. */
+
+#define TREE_SPLIT_MIN   ((uint64_t)64 << 20)
+#define TREE_SPLIT_ALIGN ((uint64_t)1 << 20)
+
+/** Files a thread of run_pass() claims at a time. */
+
+#define TREE_PASS_BATCH 256
+
+/** Bytes read at a time for a -u digest. A multiple of 32 for block_hash(). */
+
+#define TREE_DIGEST_BLOCK ((size_t)1 << 20)
+
+/*============================================================================*/
+
+/** io_uring requests issued per file, stored in the low bits of user_data. */
+
+typedef enum _tree_op_t
+{
+  TREE_OP_OPEN_SRC,
+  TREE_OP_STATX_SRC,
+  TREE_OP_OPEN_DST,
+  TREE_OP_CLOSE_SRC,
+  TREE_OP_FSYNC_DST,
+  TREE_OP_CLOSE_DST,
+} tree_op_t;
+
+#define TREE_OP_BITS 3
+
+/** A regular file to clone. */
+
+typedef struct _tree_file_t
+{
+  char    *p_src;
+  char    *p_dst;
+  uint64_t digest;     /**< The source's, if @c has_digest. */
+  bool     has_digest; /**< Set if the -u digest check read the source. */
+} tree_file_t;
+
+/** A destination directory whose attributes are set once it is filled. */
+
+typedef struct _tree_dir_t
+{
+  char       *p_dst;
+  struct stat src_stat;
+} tree_dir_t;
+
+/** A multiply-linked source inode that has been cloned. */
+
+typedef struct _tree_inode_t
+{
+  dev_t  dev;
+  ino_t  ino;
+  size_t file_index; /**< First file cloned from it. SIZE_MAX if unused. */
+} tree_inode_t;
+
+/** Per-file state while a file is in the io_uring pipeline. */
+
+typedef struct _tree_slot_t
+{
+  size_t       file_index;
+  int          src_fd;
+  int          dst_fd;
+  int          rc;
+  struct statx src_statx;
+} tree_slot_t;
+
+/**
+ * A file cloned as several range jobs by -w workers. Its descriptors are
+ * opened by whichever job starts first and closed by the last to finish.
+ */
+
+typedef struct _tree_split_t
+{
+  bool        opened;    /**< A job has started opening the file. */
+  bool        ready;     /**< It has finished, setting the fields below. */
+  int         src_fd;
+  int         dst_fd;
+  int         rc;        /**< First error of any of the file's jobs. */
+  size_t      remaining; /**< Jobs not yet finished. */
+  struct stat src_stat;
+} tree_split_t;
+
+/** A unit of work for the -w workers: a whole file or a range of one. */
+
+typedef struct _tree_job_t
+{
+  size_t        file_index;
+  uint64_t      offset;
+  uint64_t      length;  /**< Bytes to clone, or the file's size if whole. */
+  tree_split_t *p_split; /**< NULL if the job is the whole file. */
+} tree_job_t;
+
+struct _tree_t;
+
+/** Function that run_pass() applies to the file at @p file_index. */
+
+typedef void (*tree_file_fn_t) (struct _tree_t *p_tree,
+                                const size_t    file_index);
+
+/** State of one clone_tree() call. */
+
+typedef struct _tree_t
+{
+  operation_t        *p_operation;
+  qtm_clone_options_t options;
+  int                 rc; /**< First error seen. */
+
+  tree_file_t        *p_files;
+  size_t              num_files;
+  size_t              max_files;
+
+  tree_dir_t         *p_dirs;
+  size_t              num_dirs;
+  size_t              max_dirs;
+
+  /** Open-addressed hash table of cloned inodes. Size is a power of two. */
+  tree_inode_t       *p_inodes;
+  size_t              num_inodes;
+  size_t              max_inodes;
+
+  /**
+   * io_uring pipeline, -S only.
+   * @{
+   */
+  uring_t             ring;
+  tree_slot_t         slots[TREE_SETS][TREE_BATCH];
+  size_t              num_slots[TREE_SETS];
+  unsigned            pending[TREE_SETS]; /**< Requests in flight per set. */
+  /** @} */
+
+  /**
+   * Worker pool, -w only. @c lock guards @c next_job, the tree_split_t of
+   * the jobs, @c next_pass and, while the workers run, @c rc.
+   * @{
+   */
+  pthread_mutex_t     lock;
+  pthread_cond_t      split_ready; /**< A split file has been opened. */
+  tree_job_t         *p_jobs;
+  size_t              num_jobs;
+  size_t              next_job;
+  bool                parallel; /**< Set while the workers run. */
+  /** @} */
+
+  /**
+   * Passes over every queued file by run_pass(), -u and -w only.
+   * @{
+   */
+  tree_file_fn_t      pass_fn;
+  size_t              next_pass;   /**< First file not yet claimed. */
+  bool               *p_unchanged; /**< -u: per file, set if up to date. */
+  struct stat        *p_src_stats; /**< -w: per file, the source's stat. */
+  int                *p_stat_rcs;  /**< -w: per file, the stat's errno. */
+  /** @} */
+} tree_t;
+
+/*============================================================================*/
+
+void first_error (int *p_rc, const int rc)
+{
+  if (*p_rc == 0)
+  {
+    *p_rc = rc;
+  }
+}
+
+/*============================================================================*/
+
+char *path_join (const char *p_dir, const char *p_name)
+{
+  const size_t dir_len  = strlen(p_dir);
+  const bool   slash    = (dir_len > 0 && p_dir[dir_len - 1] == '/');
+  char        *p_path   = NULL;
+
+  AS(asprintf(&p_path, "%s%s%s", p_dir, slash ? "" : "/", p_name) >= 0,
+     "Out of memory.");
+
+  return p_path;
+}
+
+/*============================================================================*/
+
+int read_dir (const char   *p_path,
+              dir_entry_t **pp_entries,
+              size_t       *p_num_entries)
+{
+  DIR *p_dir = opendir(p_path);
+
+  *pp_entries    = NULL;
+  *p_num_entries = 0;
+
+  if (p_dir == NULL)
+  {
+    return errno;
+  }
+
+  dir_entry_t   *p_entries   = NULL;
+  size_t         num_entries = 0;
+  size_t         max_entries = 0;
+  struct dirent *p_entry     = NULL;
+
+  while ((p_entry = readdir(p_dir)) != NULL)
+  {
+    if (strcmp(p_entry->d_name, ".") == 0 || strcmp(p_entry->d_name, "..") == 0)
+    {
+      continue;
+    }
+
+    if (num_entries == max_entries)
+    {
+      max_entries = (max_entries == 0) ? 64 : max_entries * 2;
+      p_entries   = realloc(p_entries, max_entries * sizeof(*p_entries));
+
+      AS(p_entries != NULL, "Out of memory.");
+    }
+
+    p_entries[num_entries] = (dir_entry_t)
+    {
+      .p_name = strdup(p_entry->d_name),
+      .d_type = p_entry->d_type
+    };
+
+    AS(p_entries[num_entries++].p_name != NULL, "Out of memory.");
+  }
+
+  closedir(p_dir);
+
+  *pp_entries    = p_entries;
+  *p_num_entries = num_entries;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Return a newly allocated copy of the last component of @p p_path, ignoring
+ * trailing slashes.
+ */
+
+static char *path_basename (const char *p_path)
+{
+  size_t len = strlen(p_path);
+
+  while (len > 1 && p_path[len - 1] == '/')
+  {
+    len--;
+  }
+
+  size_t start = len;
+
+  while (start > 0 && p_path[start - 1] != '/')
+  {
+    start--;
+  }
+
+  char *p_name = strndup(p_path + start, len - start);
+
+  AS(p_name != NULL, "Out of memory.");
+
+  return p_name;
+}
+
+/*============================================================================*/
+
+/**
+ * Return the open(2) flags for a destination file that is to be cloned.
+ * Unlike USAGE (1), -f truncates straight away instead of retrying after
+ * EEXIST so that each file is opened with a single request.
+ */
+
+static int dst_open_flags (const operation_t *p_operation)
+{
+  return O_WRONLY | O_CREAT | O_CLOEXEC |
+         (p_operation->force ? O_TRUNC : O_EXCL);
+}
+
+/*============================================================================*/
+
+/**
+ * Return the statx(2) mask covering hard link detection and the attributes
+ * -o/-t/-p will set.
+ */
+
+static unsigned int src_statx_mask (const operation_t *p_operation)
+{
+  unsigned int mask = STATX_INO | STATX_NLINK;
+
+  if (p_operation->preserve_mode & PRESERVE_MODE_OWNER)
+  {
+    mask |= STATX_UID | STATX_GID;
+  }
+
+  if (p_operation->preserve_mode & PRESERVE_MODE_TIMES)
+  {
+    mask |= STATX_ATIME | STATX_MTIME;
+  }
+
+  if (p_operation->preserve_mode & PRESERVE_MODE_PERMS)
+  {
+    mask |= STATX_MODE;
+  }
+
+  return mask;
+}
+
+/*============================================================================*/
+
+/**
+ * Fill in the fields of @p p_stat that set_file_attrs() uses from
+ * @p p_statx.
+ */
+
+static void stat_from_statx (struct stat *p_stat, const struct statx *p_statx)
+{
+  memset(p_stat, 0, sizeof(*p_stat));
+
+  p_stat->st_dev          = makedev(p_statx->stx_dev_major,
+                                    p_statx->stx_dev_minor);
+  p_stat->st_ino          = p_statx->stx_ino;
+  p_stat->st_nlink        = p_statx->stx_nlink;
+  p_stat->st_mode         = p_statx->stx_mode;
+  p_stat->st_uid          = p_statx->stx_uid;
+  p_stat->st_gid          = p_statx->stx_gid;
+  p_stat->st_atim.tv_sec  = p_statx->stx_atime.tv_sec;
+  p_stat->st_atim.tv_nsec = p_statx->stx_atime.tv_nsec;
+  p_stat->st_mtim.tv_sec  = p_statx->stx_mtime.tv_sec;
+  p_stat->st_mtim.tv_nsec = p_statx->stx_mtime.tv_nsec;
+}
+
+/*============================================================================*/
+
+/**
+ * Queue @p p_src for cloning into @p p_dst. Takes ownership of both strings.
+ */
+
+static void add_file (tree_t *p_tree, char *p_src, char *p_dst)
+{
+  if (p_tree->num_files == p_tree->max_files)
+  {
+    p_tree->max_files = (p_tree->max_files == 0) ? 256
+                                                 : p_tree->max_files * 2;
+    p_tree->p_files   = realloc(p_tree->p_files,
+                                p_tree->max_files * sizeof(tree_file_t));
+
+    AS(p_tree->p_files != NULL, "Out of memory.");
+  }
+
+  p_tree->p_files[p_tree->num_files++] = (tree_file_t)
+  {
+    .p_src = p_src,
+    .p_dst = p_dst
+  };
+}
+
+/*============================================================================*/
+
+/**
+ * Remember to apply the attributes in @p p_src_stat to directory @p p_dst.
+ * Takes ownership of @p p_dst.
+ */
+
+static void add_dir (tree_t *p_tree, char *p_dst, const struct stat *p_src_stat)
+{
+  if (p_tree->num_dirs == p_tree->max_dirs)
+  {
+    p_tree->max_dirs = (p_tree->max_dirs == 0) ? 64 : p_tree->max_dirs * 2;
+    p_tree->p_dirs   = realloc(p_tree->p_dirs,
+                               p_tree->max_dirs * sizeof(tree_dir_t));
+
+    AS(p_tree->p_dirs != NULL, "Out of memory.");
+  }
+
+  p_tree->p_dirs[p_tree->num_dirs++] = (tree_dir_t)
+  {
+    .p_dst    = p_dst,
+    .src_stat = *p_src_stat
+  };
+}
+
+/*============================================================================*/
+
+/**
+ * Recreate symbolic link @p p_src as @p p_dst, preserving its ownership and
+ * timestamps if requested.
+ */
+
+static void copy_symlink (tree_t            *p_tree,
+                          const char        *p_src,
+                          const char        *p_dst,
+                          const struct stat *p_src_stat)
+{
+  const operation_t *p_operation = p_tree->p_operation;
+  char               target[PATH_MAX];
+  ssize_t            length      = readlink(p_src, target, sizeof(target) - 1);
+
+  if (length < 0)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to read symbolic link \"%s\": %s\n",
+            p_src, strerror(rc));
+    first_error(&p_tree->rc, rc);
+    return;
+  }
+
+  target[length] = '\0';
+
+  int rc = symlink(target, p_dst);
+
+  if (rc != 0 && errno == EEXIST && p_operation->force)
+  {
+    rc = unlink(p_dst);
+    rc = (rc == 0) ? symlink(target, p_dst) : rc;
+  }
+
+  if (rc == 0 && p_operation->preserve_mode & PRESERVE_MODE_OWNER)
+  {
+    rc = fchownat(AT_FDCWD, p_dst, p_src_stat->st_uid, p_src_stat->st_gid,
+                  AT_SYMLINK_NOFOLLOW);
+  }
+
+  if (rc == 0 && p_operation->preserve_mode & PRESERVE_MODE_TIMES)
+  {
+    struct timespec ts[2] = { p_src_stat->st_atim, p_src_stat->st_mtim };
+
+    rc = utimensat(AT_FDCWD, p_dst, ts, AT_SYMLINK_NOFOLLOW);
+  }
+
+  if (rc != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to create symbolic link \"%s\": %s\n",
+            p_dst, strerror(rc));
+    first_error(&p_tree->rc, rc);
+  }
+}
+
+/*============================================================================*/
+
+static void walk_path (tree_t *p_tree, char *p_src, char *p_dst,
+                       unsigned char d_type, const bool top_level);
+
+/**
+ * Create directory @p p_dst and walk the contents of @p p_src into it.
+ */
+
+static void walk_dir (tree_t            *p_tree,
+                      const char        *p_src,
+                      char              *p_dst,
+                      const struct stat *p_src_stat)
+{
+  const operation_t *p_operation = p_tree->p_operation;
+
+  if (mkdir(p_dst, S_IRWXU | S_IRWXG | S_IRWXO) != 0)
+  {
+    struct stat dst_stat;
+    int         rc       = errno;
+
+    if (rc != EEXIST || stat(p_dst, &dst_stat) != 0 ||
+        !S_ISDIR(dst_stat.st_mode))
+    {
+      fprintf(stderr, "Failed to create directory \"%s\": %s\n",
+              p_dst, strerror(rc));
+      first_error(&p_tree->rc, rc);
+      free(p_dst);
+      return;
+    }
+  }
+
+  dir_entry_t *p_entries   = NULL;
+  size_t       num_entries = 0;
+  const int    rc          = read_dir(p_src, &p_entries, &num_entries);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to open directory \"%s\": %s\n",
+            p_src, strerror(rc));
+    first_error(&p_tree->rc, rc);
+    free(p_dst);
+    return;
+  }
+
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    walk_path(p_tree, path_join(p_src, p_entries[i].p_name),
+              path_join(p_dst, p_entries[i].p_name), p_entries[i].d_type,
+              false);
+    free(p_entries[i].p_name);
+  }
+
+  free(p_entries);
+
+  if (p_operation->preserve_mode != PRESERVE_MODE_NONE)
+  {
+    add_dir(p_tree, p_dst, p_src_stat);
+  }
+  else
+  {
+    free(p_dst);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Clone @p p_src to @p p_dst according to its type. Regular files are only
+ * queued. Takes ownership of both strings.
+ *
+ * @param[in] d_type    Type from readdir(3), or DT_UNKNOWN to look it up.
+ * @param[in] top_level True for a source named on the command line, which is
+ *                      followed if it is a symbolic link unless -R was given.
+ */
+
+static void walk_path (tree_t       *p_tree,
+                       char         *p_src,
+                       char         *p_dst,
+                       unsigned char d_type,
+                       const bool    top_level)
+{
+  const operation_t *p_operation = p_tree->p_operation;
+  struct stat        src_stat;
+  const bool         need_stat   = (d_type == DT_UNKNOWN || d_type == DT_DIR ||
+                                    (d_type == DT_LNK &&
+                                     p_operation->preserve_mode !=
+                                       PRESERVE_MODE_NONE));
+
+  if (need_stat)
+  {
+    int rc = (top_level && !p_operation->recursive) ? stat(p_src, &src_stat)
+                                                    : lstat(p_src, &src_stat);
+
+    if (rc != 0)
+    {
+      rc = errno;
+      fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
+              p_src, strerror(rc));
+      first_error(&p_tree->rc, rc);
+      free(p_src);
+      free(p_dst);
+      return;
+    }
+
+    d_type = IFTODT(src_stat.st_mode);
+  }
+
+  switch (d_type)
+  {
+    case DT_REG:
+    {
+      add_file(p_tree, p_src, p_dst);
+      return;
+    }
+
+    case DT_DIR:
+    {
+      if (!p_operation->recursive)
+      {
+        fprintf(stderr, "Omitting directory \"%s\" without -R\n", p_src);
+        first_error(&p_tree->rc, EISDIR);
+        free(p_dst);
+      }
+      else
+      {
+        walk_dir(p_tree, p_src, p_dst, &src_stat);
+      }
+
+      break;
+    }
+
+    case DT_LNK:
+    {
+      copy_symlink(p_tree, p_src, p_dst, &src_stat);
+      free(p_dst);
+      break;
+    }
+
+    default:
+    {
+      fprintf(stderr, "W: Skipping special file \"%s\".\n", p_src);
+      free(p_dst);
+      break;
+    }
+  }
+
+  free(p_src);
+}
+
+/*============================================================================*/
+
+/**
+ * Return the slot for inode (@p dev, @p ino) in the hash table: either its
+ * entry or the free entry where it belongs.
+ */
+
+static tree_inode_t *inode_slot (const tree_t *p_tree,
+                                 const dev_t   dev,
+                                 const ino_t   ino)
+{
+  const size_t mask = p_tree->max_inodes - 1;
+  size_t       i    = (size_t)(((uint64_t)ino ^ ((uint64_t)dev << 32)) *
+                               UINT64_C(0x9E3779B97F4A7C15) >> 17) & mask;
+
+  while (p_tree->p_inodes[i].file_index != SIZE_MAX &&
+         (p_tree->p_inodes[i].dev != dev || p_tree->p_inodes[i].ino != ino))
+  {
+    i = (i + 1) & mask;
+  }
+
+  return &p_tree->p_inodes[i];
+}
+
+/*============================================================================*/
+
+/**
+ * Return the first file cloned from the inode in @p p_src_stat, or NULL if
+ * there is none yet.
+ */
+
+static const tree_file_t *inode_find (const tree_t      *p_tree,
+                                      const struct stat *p_src_stat)
+{
+  if (p_tree->num_inodes == 0)
+  {
+    return NULL;
+  }
+
+  const tree_inode_t *p_inode = inode_slot(p_tree, p_src_stat->st_dev,
+                                           p_src_stat->st_ino);
+
+  return (p_inode->file_index != SIZE_MAX)
+         ? &p_tree->p_files[p_inode->file_index] : NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Remember that file @p file_index was cloned from the inode in
+ * @p p_src_stat. The table is kept at most half full.
+ */
+
+static void inode_add (tree_t            *p_tree,
+                       const struct stat *p_src_stat,
+                       const size_t       file_index)
+{
+  if ((p_tree->num_inodes + 1) * 2 > p_tree->max_inodes)
+  {
+    tree_inode_t *p_old   = p_tree->p_inodes;
+    const size_t  old_max = p_tree->max_inodes;
+
+    p_tree->max_inodes = (old_max == 0) ? 64 : old_max * 2;
+    p_tree->p_inodes   = malloc(p_tree->max_inodes * sizeof(tree_inode_t));
+
+    AS(p_tree->p_inodes != NULL, "Out of memory.");
+
+    for (size_t i = 0; i < p_tree->max_inodes; i++)
+    {
+      p_tree->p_inodes[i].file_index = SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < old_max; i++)
+    {
+      if (p_old[i].file_index != SIZE_MAX)
+      {
+        *inode_slot(p_tree, p_old[i].dev, p_old[i].ino) = p_old[i];
+      }
+    }
+
+    free(p_old);
+  }
+
+  tree_inode_t *p_inode = inode_slot(p_tree, p_src_stat->st_dev,
+                                     p_src_stat->st_ino);
+
+  if (p_inode->file_index == SIZE_MAX)
+  {
+    *p_inode = (tree_inode_t)
+    {
+      .dev        = p_src_stat->st_dev,
+      .ino        = p_src_stat->st_ino,
+      .file_index = file_index
+    };
+
+    p_tree->num_inodes++;
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Open the destination of @p p_file to clone into. Reports any failure.
+ */
+
+static int open_dst_file (const tree_t      *p_tree,
+                          const tree_file_t *p_file,
+                          int               *p_dst_fd)
+{
+  *p_dst_fd = open(p_file->p_dst, dst_open_flags(p_tree->p_operation),
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+  if (*p_dst_fd < 0)
+  {
+    int rc = errno;
+    fprintf(stderr, "Failed to open destination file \"%s\": %s\n",
+            p_file->p_dst, strerror(rc));
+    return rc;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Replace the destination of @p p_file with a hard link to @p p_first's
+ * destination. The destination is never truncated, as with -f it may
+ * already be a link to @p p_first's destination from an earlier run. If
+ * stage A of -S opened it, it is closed and @p p_dst_fd set to -1.
+ *
+ * @return Zero if the file was linked, @c EAGAIN if it must be cloned
+ *         instead (e.g. the destination spans file-systems), or @c EEXIST
+ *         if the destination exists and -f was not given.
+ */
+
+static int link_duplicate (const tree_t      *p_tree,
+                           const tree_file_t *p_file,
+                           const tree_file_t *p_first,
+                           int               *p_dst_fd)
+{
+  /* Without -f only a destination that stage A just created is replaced. */
+  const bool replace = (*p_dst_fd >= 0 || p_tree->p_operation->force);
+
+  if (*p_dst_fd >= 0)
+  {
+    close(*p_dst_fd);
+    *p_dst_fd = -1;
+  }
+
+  if ((!replace || unlink(p_file->p_dst) == 0 || errno == ENOENT) &&
+      link(p_first->p_dst, p_file->p_dst) == 0)
+  {
+    return 0;
+  }
+  else if (errno == EEXIST && !replace)
+  {
+    fprintf(stderr, "Failed to open destination file \"%s\": %s\n",
+            p_file->p_dst, strerror(EEXIST));
+    return EEXIST;
+  }
+
+  fprintf(stderr, "W: Failed to link \"%s\" to \"%s\", cloning instead: %s.\n",
+          p_file->p_dst, p_first->p_dst, strerror(errno));
+
+  return EAGAIN;
+}
+
+/*============================================================================*/
+
+/**
+ * Set @p p_digest to a digest of all of @p fd's data, for -u digest. Blocks
+ * are hashed with block_hash() and chained, each link hashing the previous
+ * digest with the block's hash, offset and length.
+ */
+
+static int file_digest (const int fd, uint64_t *p_digest)
+{
+  uint8_t *p_block = malloc(TREE_DIGEST_BLOCK);
+  uint64_t digest  = 0;
+  uint64_t pos     = 0;
+
+  AS(p_block != NULL, "Out of memory.");
+
+  for (;;)
+  {
+    /* Fill the whole block, so the digest does not depend on read sizes. */
+    size_t got = 0;
+
+    while (got < TREE_DIGEST_BLOCK)
+    {
+      const ssize_t got_now = pread(fd, p_block + got, TREE_DIGEST_BLOCK - got,
+                                    pos + got);
+
+      if (got_now < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if (got_now < 0)
+      {
+        const int rc = errno;
+        free(p_block);
+        return rc;
+      }
+      else if (got_now == 0)
+      {
+        break;
+      }
+
+      got += got_now;
+    }
+
+    if (got == 0)
+    {
+      break;
+    }
+
+    const size_t padded = (got + 31) & ~(size_t)31;
+
+    memset(p_block + got, 0, padded - got);
+
+    const uint64_t link[4] = { digest, block_hash(p_block, padded), pos, got };
+
+    digest = block_hash((const uint8_t *)link, sizeof(link));
+    pos   += got;
+  }
+
+  free(p_block);
+
+  *p_digest = digest;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Store the digest of @p src_fd's data with @p p_file's destination, for
+ * later runs of -u digest to compare against. The source is only read if
+ * the check did not already digest it. Should it have changed since, the
+ * stored digest will not match it and the next run clones it again.
+ */
+
+static int store_digest (const tree_file_t *p_file,
+                         const int          src_fd,
+                         const int          dst_fd)
+{
+  uint64_t digest = p_file->digest;
+  int      rc     = p_file->has_digest ? 0 : file_digest(src_fd, &digest);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to read source file \"%s\": %s\n",
+            p_file->p_src, strerror(rc));
+    return rc;
+  }
+
+  char value[17];
+
+  snprintf(value, sizeof(value), "%016" PRIx64, digest);
+
+  if (fsetxattr(dst_fd, UPDATE_DIGEST_XATTR, value, 16, 0) != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to store digest of destination file \"%s\": "
+            "%s\n", p_file->p_dst, strerror(rc));
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Set the attributes of a freshly cloned destination and verify it, as
+ * requested on the command line.
+ */
+
+static int complete_file (const tree_t      *p_tree,
+                          const tree_file_t *p_file,
+                          const int          src_fd,
+                          const int          dst_fd,
+                          const struct stat *p_src_stat)
+{
+  operation_t *p_operation = p_tree->p_operation;
+  int          rc          = 0;
+
+  if (p_operation->update_check == UPDATE_CHECK_DIGEST)
+  {
+    rc = store_digest(p_file, src_fd, dst_fd);
+  }
+
+  if (rc == 0 && p_operation->preserve_mode != PRESERVE_MODE_NONE)
+  {
+    rc = set_file_attrs(p_operation, dst_fd, p_file->p_dst, p_src_stat);
+  }
+
+  if (rc == 0 && p_operation->verify)
+  {
+    rc = verify_clone(p_operation, src_fd, dst_fd, p_file->p_dst);
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Clone an opened source into an opened destination and set its attributes,
+ * or hard link the destination to an earlier one if the source is a link to
+ * an inode already cloned. This is the part of each file's work that is the
+ * same with and without io_uring.
+ *
+ * @param[in]     p_src_stat Source inode number, link count and attributes.
+ * @param[in,out] p_dst_fd   Destination, or -1 to have it opened here if it
+ *                           is to be cloned. One opened by stage A of -S is
+ *                           truncated here with -f. Closed and set to -1 if
+ *                           linked.
+ */
+
+static int clone_opened_file (tree_t            *p_tree,
+                              const size_t       file_index,
+                              const int          src_fd,
+                              int               *p_dst_fd,
+                              const struct stat *p_src_stat)
+{
+  const tree_file_t *p_file   = &p_tree->p_files[file_index];
+  /* The inode table is not shared with -w workers, which leave linked
+   * files to the pass after them.
+   */
+  const bool         linkable = (p_src_stat->st_nlink > 1 && !p_tree->parallel);
+  const tree_file_t *p_first  = linkable ? inode_find(p_tree, p_src_stat)
+                                         : NULL;
+  int                rc       = 0;
+
+  if (p_first != NULL)
+  {
+    rc = link_duplicate(p_tree, p_file, p_first, p_dst_fd);
+
+    if (rc != EAGAIN)
+    {
+      return rc;
+    }
+
+    rc = 0;
+  }
+
+  if (*p_dst_fd < 0)
+  {
+    rc = open_dst_file(p_tree, p_file, p_dst_fd);
+  }
+  else if (p_tree->p_operation->force && ftruncate(*p_dst_fd, 0) != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to truncate destination file \"%s\": %s\n",
+            p_file->p_dst, strerror(rc));
+  }
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  rc = qtm_clone_file_ex(src_fd, *p_dst_fd, &p_tree->options);
+  profile_add(p_tree->p_operation, src_fd, 0, 0);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to clone \"%s\" into \"%s\": %s\n",
+            p_file->p_src, p_file->p_dst, strerror(rc));
+  }
+  else
+  {
+    rc = complete_file(p_tree, p_file, src_fd, *p_dst_fd, p_src_stat);
+  }
+
+  /* Only a complete clone may be the target of later links. */
+  if (rc == 0 && p_first == NULL && linkable)
+  {
+    inode_add(p_tree, p_src_stat, file_index);
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Open the source of @p p_file and stat it. Reports any failure, in which
+ * case the source is not left open.
+ */
+
+static int open_src_file (const tree_file_t *p_file,
+                          int               *p_src_fd,
+                          struct stat       *p_src_stat)
+{
+  int rc = 0;
+
+  *p_src_fd = open(p_file->p_src, O_RDONLY | O_CLOEXEC);
+
+  if (*p_src_fd < 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to open source file \"%s\": %s\n",
+            p_file->p_src, strerror(rc));
+    return rc;
+  }
+
+  if (fstat(*p_src_fd, p_src_stat) != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
+            p_file->p_src, strerror(rc));
+    close(*p_src_fd);
+    *p_src_fd = -1;
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Open the source and destination of @p p_file and stat the source. Reports
+ * any failure, in which case neither file is left open.
+ */
+
+static int open_file_pair (const tree_t      *p_tree,
+                           const tree_file_t *p_file,
+                           int               *p_src_fd,
+                           int               *p_dst_fd,
+                           struct stat       *p_src_stat)
+{
+  *p_dst_fd = -1;
+
+  int rc = open_src_file(p_file, p_src_fd, p_src_stat);
+
+  if (rc == 0)
+  {
+    rc = open_dst_file(p_tree, p_file, p_dst_fd);
+  }
+
+  if (rc != 0 && *p_src_fd >= 0)
+  {
+    close(*p_src_fd);
+    *p_src_fd = -1;
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Close the files opened by open_file_pair(), first syncing the destination
+ * if @p rc shows the clone succeeded. @p dst_fd may be -1 if it was linked
+ * or never opened.
+ *
+ * @return @p rc, or the error syncing or closing the destination.
+ */
+
+static int close_file_pair (const tree_file_t *p_file,
+                            const int          src_fd,
+                            const int          dst_fd,
+                            int                rc)
+{
+  if (rc == 0 && dst_fd >= 0 && fsync(dst_fd) != 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to sync destination file \"%s\": %s\n",
+            p_file->p_dst, strerror(rc));
+  }
+
+  close(src_fd);
+
+  if (dst_fd >= 0 && close(dst_fd) != 0 && rc == 0)
+  {
+    rc = errno;
+    fprintf(stderr, "Failed to close destination file \"%s\": %s\n",
+            p_file->p_dst, strerror(rc));
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Clone @p p_file with ordinary blocking system calls.
+ */
+
+static int clone_file_sync (tree_t *p_tree, const size_t file_index)
+{
+  const tree_file_t *p_file = &p_tree->p_files[file_index];
+  struct stat        src_stat;
+  int                src_fd;
+  int                dst_fd = -1;
+  int                rc     = open_src_file(p_file, &src_fd, &src_stat);
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  /* The destination is opened, and truncated, only if it is not linked. */
+
+  rc = clone_opened_file(p_tree, file_index, src_fd, &dst_fd, &src_stat);
+
+  return close_file_pair(p_file, src_fd, dst_fd, rc);
+}
+
+/*============================================================================*/
+
+/**
+ * Return a submission entry for request @p op on slot @p index of set
+ * @p set, counting it as in flight.
+ */
+
+static struct io_uring_sqe *ring_sqe (tree_t          *p_tree,
+                                      const unsigned   set,
+                                      const size_t     index,
+                                      const tree_op_t  op)
+{
+  struct io_uring_sqe *p_sqe = uring_get_sqe(&p_tree->ring);
+
+  AS(p_sqe != NULL, "io_uring submission queue unexpectedly full.");
+
+  p_sqe->user_data = ((uint64_t)(set * TREE_BATCH + index) << TREE_OP_BITS) |
+                     op;
+  p_tree->pending[set]++;
+
+  return p_sqe;
+}
+
+/*============================================================================*/
+
+/**
+ * Queue stage A (open source, stat source, open destination) for the files
+ * starting at @p first_file in slot set @p set.
+ */
+
+static void ring_prep_open (tree_t        *p_tree,
+                            const unsigned set,
+                            const size_t   first_file)
+{
+  const operation_t *p_operation = p_tree->p_operation;
+  const unsigned int mask        = src_statx_mask(p_operation);
+
+  p_tree->num_slots[set] = p_tree->num_files - first_file;
+
+  if (p_tree->num_slots[set] > TREE_BATCH)
+  {
+    p_tree->num_slots[set] = TREE_BATCH;
+  }
+
+  for (size_t i = 0; i < p_tree->num_slots[set]; i++)
+  {
+    tree_slot_t       *p_slot = &p_tree->slots[set][i];
+    const tree_file_t *p_file = &p_tree->p_files[first_file + i];
+
+    p_slot->file_index = first_file + i;
+    p_slot->src_fd     = -1;
+    p_slot->dst_fd     = -1;
+    p_slot->rc         = 0;
+
+    struct io_uring_sqe *p_sqe = ring_sqe(p_tree, set, i, TREE_OP_OPEN_SRC);
+
+    p_sqe->opcode     = IORING_OP_OPENAT;
+    p_sqe->fd         = AT_FDCWD;
+    p_sqe->addr       = (uintptr_t)p_file->p_src;
+    p_sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+    p_sqe = ring_sqe(p_tree, set, i, TREE_OP_STATX_SRC);
+
+    p_sqe->opcode = IORING_OP_STATX;
+    p_sqe->fd     = AT_FDCWD;
+    p_sqe->addr   = (uintptr_t)p_file->p_src;
+    p_sqe->len    = mask;
+    p_sqe->off    = (uintptr_t)&p_slot->src_statx;
+
+    p_sqe = ring_sqe(p_tree, set, i, TREE_OP_OPEN_DST);
+
+    p_sqe->opcode     = IORING_OP_OPENAT;
+    p_sqe->fd         = AT_FDCWD;
+    p_sqe->addr       = (uintptr_t)p_file->p_dst;
+    p_sqe->open_flags = dst_open_flags(p_operation) & ~O_TRUNC;
+    p_sqe->len        = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
+                        S_IROTH | S_IWOTH;
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Queue stage C (close source, sync then close destination) for every slot
+ * in set @p set.
+ */
+
+static void ring_prep_close (tree_t *p_tree, const unsigned set)
+{
+  for (size_t i = 0; i < p_tree->num_slots[set]; i++)
+  {
+    tree_slot_t *p_slot = &p_tree->slots[set][i];
+
+    if (p_slot->src_fd >= 0)
+    {
+      struct io_uring_sqe *p_sqe = ring_sqe(p_tree, set, i,
+                                            TREE_OP_CLOSE_SRC);
+
+      p_sqe->opcode = IORING_OP_CLOSE;
+      p_sqe->fd     = p_slot->src_fd;
+    }
+
+    if (p_slot->dst_fd >= 0)
+    {
+      /* A failed clone is not synced, just closed. */
+      if (p_slot->rc == 0)
+      {
+        struct io_uring_sqe *p_sqe = ring_sqe(p_tree, set, i,
+                                              TREE_OP_FSYNC_DST);
+
+        p_sqe->opcode = IORING_OP_FSYNC;
+        p_sqe->fd     = p_slot->dst_fd;
+        p_sqe->flags  = IOSQE_IO_LINK;
+      }
+
+      struct io_uring_sqe *p_sqe = ring_sqe(p_tree, set, i,
+                                            TREE_OP_CLOSE_DST);
+
+      p_sqe->opcode = IORING_OP_CLOSE;
+      p_sqe->fd     = p_slot->dst_fd;
+    }
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Record the result @p res of request @p user_data against its slot.
+ */
+
+static void ring_complete (tree_t        *p_tree,
+                           const uint64_t user_data,
+                           const int32_t  res)
+{
+  const tree_op_t    op     = user_data & ((1u << TREE_OP_BITS) - 1);
+  const size_t       slot   = user_data >> TREE_OP_BITS;
+  const unsigned     set    = slot / TREE_BATCH;
+  tree_slot_t       *p_slot = &p_tree->slots[set][slot % TREE_BATCH];
+  const tree_file_t *p_file = &p_tree->p_files[p_slot->file_index];
+  const char        *p_what = NULL;
+  const char        *p_name = p_file->p_dst;
+
+  p_tree->pending[set]--;
+
+  switch (op)
+  {
+    case TREE_OP_OPEN_SRC:
+    {
+      p_slot->src_fd = (res >= 0) ? res : -1;
+      p_what         = "open source file";
+      p_name         = p_file->p_src;
+      break;
+    }
+
+    case TREE_OP_STATX_SRC:
+    {
+      p_what = "stat source file";
+      p_name = p_file->p_src;
+      break;
+    }
+
+    case TREE_OP_OPEN_DST:
+    {
+      p_slot->dst_fd = (res >= 0) ? res : -1;
+      p_what         = "open destination file";
+      break;
+    }
+
+    case TREE_OP_CLOSE_SRC:
+    {
+      /* Nothing useful to report about closing a read-only file. */
+      return;
+    }
+
+    case TREE_OP_FSYNC_DST:
+    {
+      p_what = "sync destination file";
+      break;
+    }
+
+    case TREE_OP_CLOSE_DST:
+    {
+      /* A failed fsync cancels the linked close, which we then do here. */
+      if (res == -ECANCELED)
+      {
+        close(p_slot->dst_fd);
+        return;
+      }
+
+      p_what = "close destination file";
+      break;
+    }
+  }
+
+  if (res < 0)
+  {
+    fprintf(stderr, "Failed to %s \"%s\": %s\n", p_what, p_name,
+            strerror(-res));
+
+    p_slot->rc = (p_slot->rc == 0) ? -res : p_slot->rc;
+    first_error(&p_tree->rc, -res);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Process completions until every request of set @p set has finished.
+ *
+ * @return Zero on success, or an errno value if io_uring itself failed.
+ */
+
+static int ring_wait (tree_t *p_tree, const unsigned set)
+{
+  uint64_t user_data = 0;
+  int32_t  res       = 0;
+
+  while (p_tree->pending[set] > 0)
+  {
+    while (uring_pop_cqe(&p_tree->ring, &user_data, &res))
+    {
+      ring_complete(p_tree, user_data, res);
+    }
+
+    if (p_tree->pending[set] > 0)
+    {
+      int rc = uring_submit(&p_tree->ring, 1);
+
+      if (rc != 0)
+      {
+        fprintf(stderr, "Failed to wait for io_uring completions: %s\n",
+                strerror(rc));
+        return rc;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Stage B for every slot of set @p set: clone and set attributes. Files
+ * whose stage A failed are skipped; their descriptors are still closed by
+ * stage C.
+ */
+
+static void ring_clone_batch (tree_t *p_tree, const unsigned set)
+{
+  const operation_t *p_operation = p_tree->p_operation;
+
+  for (size_t i = 0; i < p_tree->num_slots[set]; i++)
+  {
+    tree_slot_t       *p_slot = &p_tree->slots[set][i];
+    const tree_file_t *p_file = &p_tree->p_files[p_slot->file_index];
+
+    if (p_slot->rc != 0)
+    {
+      /* Don't leave behind an empty file we created for an unreadable
+       * source. With -f it may be an existing file, which is left as it was.
+       */
+      if (p_slot->dst_fd >= 0 && p_slot->src_fd < 0 && !p_operation->force)
+      {
+        unlink(p_file->p_dst);
+      }
+
+      continue;
+    }
+
+    struct stat src_stat;
+
+    stat_from_statx(&src_stat, &p_slot->src_statx);
+
+    p_slot->rc = clone_opened_file(p_tree, p_slot->file_index, p_slot->src_fd,
+                                   &p_slot->dst_fd, &src_stat);
+    first_error(&p_tree->rc, p_slot->rc);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Clone every queued file through the io_uring pipeline described at the top
+ * of this file.
+ */
+
+static int clone_files_ring (tree_t *p_tree)
+{
+  const size_t num_batches = (p_tree->num_files + TREE_BATCH - 1) / TREE_BATCH;
+  int          rc          = 0;
+
+  if (num_batches == 0)
+  {
+    return 0;
+  }
+
+  ring_prep_open(p_tree, 0, 0);
+  rc = uring_submit(&p_tree->ring, 0);
+
+  for (size_t b = 0; rc == 0 && b < num_batches; b++)
+  {
+    const unsigned cur  = b % TREE_SETS;
+    const unsigned next = (b + 1) % TREE_SETS;
+
+    rc = ring_wait(p_tree, cur);
+
+    if (rc == 0 && b + 1 < num_batches)
+    {
+      /* The next set's slots are free once stage C of batch b - 2, which
+       * last used them, has finished.
+       */
+      rc = ring_wait(p_tree, next);
+
+      if (rc == 0)
+      {
+        ring_prep_open(p_tree, next, (b + 1) * TREE_BATCH);
+        rc = uring_submit(&p_tree->ring, 0);
+      }
+    }
+
+    if (rc == 0)
+    {
+      ring_clone_batch(p_tree, cur);
+      ring_prep_close(p_tree, cur);
+      rc = uring_submit(&p_tree->ring, 0);
+    }
+  }
+
+  for (unsigned set = 0; rc == 0 && set < TREE_SETS; set++)
+  {
+    rc = ring_wait(p_tree, set);
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Record @p rc as first_error() does, from a -w worker.
+ */
+
+static void tree_error_locked (tree_t *p_tree, const int rc)
+{
+  if (rc != 0)
+  {
+    pthread_mutex_lock(&p_tree->lock);
+    first_error(&p_tree->rc, rc);
+    pthread_mutex_unlock(&p_tree->lock);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * run_pass() thread. Claims batches of files until there are none left.
+ */
+
+static void *pass_worker (void *p_arg)
+{
+  tree_t *p_tree = p_arg;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&p_tree->lock);
+
+    const size_t first = p_tree->next_pass;
+
+    p_tree->next_pass = (p_tree->num_files - first > TREE_PASS_BATCH)
+                        ? first + TREE_PASS_BATCH : p_tree->num_files;
+
+    const size_t last = p_tree->next_pass;
+
+    pthread_mutex_unlock(&p_tree->lock);
+
+    if (first == last)
+    {
+      return NULL;
+    }
+
+    for (size_t i = first; i < last; i++)
+    {
+      p_tree->pass_fn(p_tree, i);
+    }
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Apply @p pass_fn to every queued file with up to @p num_workers threads,
+ * the calling thread being one of them. @p pass_fn must only touch its own
+ * file's state.
+ */
+
+static void run_pass (tree_t              *p_tree,
+                      const unsigned       num_workers,
+                      const tree_file_fn_t pass_fn)
+{
+  p_tree->pass_fn   = pass_fn;
+  p_tree->next_pass = 0;
+
+  pthread_mutex_init(&p_tree->lock, NULL);
+
+  pthread_t *p_threads   = malloc(num_workers * sizeof(*p_threads));
+  unsigned   num_threads = 0;
+
+  AS(p_threads != NULL, "Out of memory.");
+
+  while (num_threads + 1 < num_workers &&
+         (size_t)(num_threads + 1) * TREE_PASS_BATCH < p_tree->num_files &&
+         pthread_create(&p_threads[num_threads], NULL, pass_worker,
+                        p_tree) == 0)
+  {
+    num_threads++;
+  }
+
+  pass_worker(p_tree);
+
+  for (unsigned i = 0; i < num_threads; i++)
+  {
+    pthread_join(p_threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&p_tree->lock);
+
+  free(p_threads);
+}
+
+/*============================================================================*/
+
+/**
+ * qsort() comparison putting the longest jobs first. Ranges of one file stay
+ * together in file order.
+ */
+
+static int compare_jobs (const void *p_a, const void *p_b)
+{
+  const tree_job_t *p_job_a = p_a;
+  const tree_job_t *p_job_b = p_b;
+
+  if (p_job_a->length != p_job_b->length)
+  {
+    return (p_job_a->length < p_job_b->length) ? 1 : -1;
+  }
+  else if (p_job_a->file_index != p_job_b->file_index)
+  {
+    return (p_job_a->file_index > p_job_b->file_index) ? 1 : -1;
+  }
+
+  return (p_job_a->offset > p_job_b->offset) -
+         (p_job_a->offset < p_job_b->offset);
+}
+
+/*============================================================================*/
+
+/**
+ * Clone one range of a split file. The first of the file's jobs to start
+ * opens it and the last to finish completes it.
+ */
+
+static void clone_file_range_job (tree_t *p_tree, const tree_job_t *p_job)
+{
+  const tree_file_t *p_file  = &p_tree->p_files[p_job->file_index];
+  tree_split_t      *p_split = p_job->p_split;
+
+  pthread_mutex_lock(&p_tree->lock);
+
+  const bool opener = !p_split->opened;
+
+  p_split->opened = true;
+
+  while (!opener && !p_split->ready)
+  {
+    pthread_cond_wait(&p_tree->split_ready, &p_tree->lock);
+  }
+
+  int rc = p_split->rc;
+
+  pthread_mutex_unlock(&p_tree->lock);
+
+  /* Open without the lock so that other files' jobs are not held up. This
+   * file's other jobs wait above and only read the descriptors once ready
+   * has been set under the lock.
+   */
+  if (opener)
+  {
+    rc = open_file_pair(p_tree, p_file, &p_split->src_fd, &p_split->dst_fd,
+                        &p_split->src_stat);
+
+    pthread_mutex_lock(&p_tree->lock);
+
+    p_split->rc    = rc;
+    p_split->ready = true;
+
+    pthread_cond_broadcast(&p_tree->split_ready);
+    pthread_mutex_unlock(&p_tree->lock);
+  }
+
+  if (rc == 0)
+  {
+    rc = qtm_clone_file_range_ex(p_split->src_fd, p_split->dst_fd,
+                                 p_job->offset, p_job->offset, p_job->length,
+                                 &p_tree->options);
+    profile_add(p_tree->p_operation, p_split->src_fd, p_job->offset,
+                p_job->length);
+
+    if (rc != 0)
+    {
+      fprintf(stderr, "Failed to clone \"%s\" into \"%s\" at offset %"
+              PRIu64 ": %s\n", p_file->p_src, p_file->p_dst, p_job->offset,
+              strerror(rc));
+    }
+  }
+
+  pthread_mutex_lock(&p_tree->lock);
+
+  if (p_split->rc == 0)
+  {
+    p_split->rc = rc;
+  }
+
+  const bool last = (--p_split->remaining == 0);
+
+  rc = p_split->rc;
+
+  pthread_mutex_unlock(&p_tree->lock);
+
+  if (!last)
+  {
+    return;
+  }
+  else if (p_split->src_fd < 0)
+  {
+    /* Opening failed, and was reported. */
+    tree_error_locked(p_tree, rc);
+    return;
+  }
+
+  if (rc == 0)
+  {
+    rc = complete_file(p_tree, p_file, p_split->src_fd, p_split->dst_fd,
+                       &p_split->src_stat);
+  }
+
+  tree_error_locked(p_tree, close_file_pair(p_file, p_split->src_fd,
+                                            p_split->dst_fd, rc));
+}
+
+/*============================================================================*/
+
+/**
+ * -w worker thread. Takes jobs in order until there are none left.
+ */
+
+static void *tree_worker (void *p_arg)
+{
+  tree_t *p_tree = p_arg;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&p_tree->lock);
+
+    const tree_job_t *p_job = (p_tree->next_job < p_tree->num_jobs)
+                              ? &p_tree->p_jobs[p_tree->next_job++] : NULL;
+
+    pthread_mutex_unlock(&p_tree->lock);
+
+    if (p_job == NULL)
+    {
+      return NULL;
+    }
+
+    if (p_job->p_split != NULL)
+    {
+      clone_file_range_job(p_tree, p_job);
+    }
+    else
+    {
+      tree_error_locked(p_tree, clone_file_sync(p_tree, p_job->file_index));
+    }
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * run_pass() function of the -w sizing pass.
+ */
+
+static void size_file (tree_t *p_tree, const size_t file_index)
+{
+  const char *p_src = p_tree->p_files[file_index].p_src;
+
+  p_tree->p_stat_rcs[file_index] =
+    (stat(p_src, &p_tree->p_src_stats[file_index]) == 0) ? 0 : errno;
+
+  if (p_tree->p_stat_rcs[file_index] != 0)
+  {
+    fprintf(stderr, "Failed to stat source file \"%s\": %s\n",
+            p_src, strerror(p_tree->p_stat_rcs[file_index]));
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Clone every queued file with @p num_workers threads, the calling thread
+ * being one of them, as described at the top of this file.
+ */
+
+static void clone_files_parallel (tree_t *p_tree, const unsigned num_workers)
+{
+  tree_job_t *p_jobs      = NULL;
+  size_t      num_jobs    = 0;
+  size_t      max_jobs    = 0;
+  size_t     *p_linked    = malloc(p_tree->num_files * sizeof(*p_linked));
+  size_t      num_linked  = 0;
+  uint64_t    total_bytes = 0;
+
+  p_tree->p_src_stats = malloc((p_tree->num_files + 1) *
+                               sizeof(*p_tree->p_src_stats));
+  p_tree->p_stat_rcs  = malloc((p_tree->num_files + 1) *
+                               sizeof(*p_tree->p_stat_rcs));
+
+  AS((p_tree->num_files == 0 || p_linked != NULL) &&
+     p_tree->p_src_stats != NULL && p_tree->p_stat_rcs != NULL,
+     "Out of memory.");
+
+  /* Size everything first. Files with other links wait for the serial pass,
+   * where they can be linked rather than cloned.
+   */
+  run_pass(p_tree, num_workers, size_file);
+
+  for (size_t i = 0; i < p_tree->num_files; i++)
+  {
+    const struct stat *p_src_stat = &p_tree->p_src_stats[i];
+
+    if (p_tree->p_stat_rcs[i] != 0)
+    {
+      first_error(&p_tree->rc, p_tree->p_stat_rcs[i]);
+      continue;
+    }
+
+    if (p_src_stat->st_nlink > 1)
+    {
+      p_linked[num_linked++] = i;
+      continue;
+    }
+
+    if (num_jobs == max_jobs)
+    {
+      max_jobs = (max_jobs == 0) ? 256 : max_jobs * 2;
+      p_jobs   = realloc(p_jobs, max_jobs * sizeof(*p_jobs));
+
+      AS(p_jobs != NULL, "Out of memory.");
+    }
+
+    p_jobs[num_jobs++] = (tree_job_t)
+    {
+      .file_index = i,
+      .offset     = 0,
+      .length     = p_src_stat->st_size,
+      .p_split    = NULL
+    };
+
+    total_bytes += p_src_stat->st_size;
+  }
+
+  free(p_tree->p_src_stats);
+  free(p_tree->p_stat_rcs);
+
+  p_tree->p_src_stats = NULL;
+  p_tree->p_stat_rcs  = NULL;
+
+  /* Split files larger than a fair share into jobs of that size. */
+  uint64_t piece = total_bytes / ((uint64_t)num_workers *
+                                  TREE_SPLIT_PER_WORKER);
+
+  piece = (piece > TREE_SPLIT_MIN) ? piece : TREE_SPLIT_MIN;
+  piece = (piece + TREE_SPLIT_ALIGN - 1) & ~(TREE_SPLIT_ALIGN - 1);
+
+  const size_t num_whole = num_jobs;
+
+  for (size_t j = 0; j < num_whole; j++)
+  {
+    const uint64_t size = p_jobs[j].length;
+
+    if (size <= piece)
+    {
+      continue;
+    }
+
+    tree_split_t *p_split = malloc(sizeof(*p_split));
+
+    AS(p_split != NULL, "Out of memory.");
+
+    *p_split = (tree_split_t)
+    {
+      .opened    = false,
+      .ready     = false,
+      .src_fd    = -1,
+      .dst_fd    = -1,
+      .rc        = 0,
+      .remaining = (size + piece - 1) / piece
+    };
+
+    p_jobs[j].length  = piece;
+    p_jobs[j].p_split = p_split;
+
+    for (uint64_t offset = piece; offset < size; offset += piece)
+    {
+      if (num_jobs == max_jobs)
+      {
+        max_jobs *= 2;
+        p_jobs    = realloc(p_jobs, max_jobs * sizeof(*p_jobs));
+
+        AS(p_jobs != NULL, "Out of memory.");
+      }
+
+      p_jobs[num_jobs++] = (tree_job_t)
+      {
+        .file_index = p_jobs[j].file_index,
+        .offset     = offset,
+        .length     = (size - offset < piece) ? size - offset : piece,
+        .p_split    = p_split
+      };
+    }
+  }
+
+  qsort(p_jobs, num_jobs, sizeof(*p_jobs), compare_jobs);
+
+  p_tree->p_jobs   = p_jobs;
+  p_tree->num_jobs = num_jobs;
+  p_tree->next_job = 0;
+  p_tree->parallel = true;
+
+  pthread_mutex_init(&p_tree->lock, NULL);
+  pthread_cond_init(&p_tree->split_ready, NULL);
+
+  pthread_t *p_threads   = malloc(num_workers * sizeof(*p_threads));
+  unsigned   num_threads = 0;
+
+  AS(p_threads != NULL, "Out of memory.");
+
+  while (num_threads + 1 < num_workers &&
+         pthread_create(&p_threads[num_threads], NULL, tree_worker,
+                        p_tree) == 0)
+  {
+    num_threads++;
+  }
+
+  tree_worker(p_tree);
+
+  for (unsigned i = 0; i < num_threads; i++)
+  {
+    pthread_join(p_threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&p_tree->split_ready);
+  pthread_mutex_destroy(&p_tree->lock);
+
+  p_tree->parallel = false;
+
+  for (size_t i = 0; i < num_linked; i++)
+  {
+    first_error(&p_tree->rc, clone_file_sync(p_tree, p_linked[i]));
+  }
+
+  /* Each split is freed with the job at the start of its file. */
+  for (size_t j = 0; j < num_jobs; j++)
+  {
+    if (p_jobs[j].p_split != NULL && p_jobs[j].offset == 0)
+    {
+      free(p_jobs[j].p_split);
+    }
+  }
+
+  free(p_threads);
+  free(p_jobs);
+  free(p_linked);
+
+  p_tree->p_jobs   = NULL;
+  p_tree->num_jobs = 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Apply the preserved attributes to every directory created, deepest first,
+ * now that nothing more will be created in them.
+ */
+
+static void set_dir_attrs (tree_t *p_tree)
+{
+  for (size_t i = p_tree->num_dirs; i > 0; i--)
+  {
+    const tree_dir_t *p_dir = &p_tree->p_dirs[i - 1];
+    const int         fd    = open(p_dir->p_dst,
+                                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+      int rc = errno;
+      fprintf(stderr, "Failed to open directory \"%s\": %s\n",
+              p_dir->p_dst, strerror(rc));
+      first_error(&p_tree->rc, rc);
+      continue;
+    }
+
+    first_error(&p_tree->rc,
+                set_file_attrs(p_tree->p_operation, fd, p_dir->p_dst,
+                               &p_dir->src_stat));
+    close(fd);
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Return true if @p p_file's destination exists and passes the checks of -u
+ * against its source, so that it need not be cloned again. Any failure to
+ * tell just means the file is cloned, which reports it. A digest computed
+ * here is kept in @p p_file for store_digest().
+ */
+
+static bool file_unchanged (const tree_t *p_tree, tree_file_t *p_file)
+{
+  const update_check_t check = p_tree->p_operation->update_check;
+  struct stat          src_stat;
+  struct stat          dst_stat;
+
+  if (stat(p_file->p_src, &src_stat) != 0 ||
+      lstat(p_file->p_dst, &dst_stat) != 0 || !S_ISREG(dst_stat.st_mode) ||
+      src_stat.st_size != dst_stat.st_size ||
+      src_stat.st_mtim.tv_sec != dst_stat.st_mtim.tv_sec ||
+      src_stat.st_mtim.tv_nsec != dst_stat.st_mtim.tv_nsec)
+  {
+    return false;
+  }
+
+  if (check == UPDATE_CHECK_CTIME)
+  {
+    /* Setting the destination's attributes moved its ctime on, so a source
+     * changed since then, even to an old mtime, has a later one.
+     */
+    return src_stat.st_ctim.tv_sec < dst_stat.st_ctim.tv_sec ||
+           (src_stat.st_ctim.tv_sec == dst_stat.st_ctim.tv_sec &&
+            src_stat.st_ctim.tv_nsec <= dst_stat.st_ctim.tv_nsec);
+  }
+  else if (check == UPDATE_CHECK_DIGEST)
+  {
+    char    value[17] = { 0 };
+    ssize_t length    = lgetxattr(p_file->p_dst, UPDATE_DIGEST_XATTR, value,
+                                  sizeof(value) - 1);
+    int     src_fd    = (length == 16) ? open(p_file->p_src,
+                                              O_RDONLY | O_CLOEXEC)
+                                       : -1;
+    uint64_t digest   = 0;
+    bool     same     = (src_fd >= 0 && file_digest(src_fd, &digest) == 0);
+
+    if (src_fd >= 0)
+    {
+      close(src_fd);
+    }
+
+    p_file->digest     = digest;
+    p_file->has_digest = same;
+
+    char expected[17];
+
+    snprintf(expected, sizeof(expected), "%016" PRIx64, digest);
+
+    return same && strcmp(value, expected) == 0;
+  }
+
+  return true;
+}
+
+/*============================================================================*/
+
+/**
+ * run_pass() function of the -u check.
+ */
+
+static void check_file (tree_t *p_tree, const size_t file_index)
+{
+  p_tree->p_unchanged[file_index] =
+    file_unchanged(p_tree, &p_tree->p_files[file_index]);
+}
+
+/*============================================================================*/
+
+/**
+ * Check every queued file with @p num_workers threads, the calling thread
+ * being one of them, and drop those that are up to date from the queue.
+ */
+
+static void skip_unchanged_files (tree_t *p_tree, const unsigned num_workers)
+{
+  p_tree->p_unchanged = calloc(p_tree->num_files + 1,
+                               sizeof(*p_tree->p_unchanged));
+
+  AS(p_tree->p_unchanged != NULL, "Out of memory.");
+
+  run_pass(p_tree, num_workers, check_file);
+
+  size_t num_kept = 0;
+
+  for (size_t i = 0; i < p_tree->num_files; i++)
+  {
+    if (p_tree->p_unchanged[i])
+    {
+      free(p_tree->p_files[i].p_src);
+      free(p_tree->p_files[i].p_dst);
+    }
+    else
+    {
+      p_tree->p_files[num_kept++] = p_tree->p_files[i];
+    }
+  }
+
+  printf("Up to date: %zu files skipped, %zu to clone\n",
+         p_tree->num_files - num_kept, num_kept);
+
+  p_tree->num_files = num_kept;
+
+  free(p_tree->p_unchanged);
+  p_tree->p_unchanged = NULL;
+}
+
+/*============================================================================*/
+
+int clone_tree (operation_t *p_operation)
+{
+  AS(p_operation != NULL, "NULL p_operation.");
+  AS(p_operation->num_dsts == 1, "Tree clones have one destination.");
+
+  tree_t *p_tree = calloc(1, sizeof(*p_tree));
+
+  AS(p_tree != NULL, "Out of memory.");
+
+  p_tree->p_operation = p_operation;
+  p_tree->options     = (qtm_clone_options_t)
+  {
+    .fallback_copy            = p_operation->fallback_copy,
+    .fallback_copy_block_size = p_operation->block_size,
+    .p_journal_path           = NULL,
+    .checkpoint_interval      = 0,
+    .reflink_threshold        = p_operation->reflink_threshold,
+    .flags                    = p_operation->clone_flags
+  };
+
+  /* Like cp(1): sources go inside an existing directory, but a single source
+   * is cloned as the destination if that does not exist yet.
+   */
+  const char *p_dst_dir = p_operation->dst_filenames[0];
+  struct stat dst_stat;
+
+  if (stat(p_dst_dir, &dst_stat) == 0 && S_ISDIR(dst_stat.st_mode))
+  {
+    for (size_t i = 0; i < p_operation->num_srcs; i++)
+    {
+      char *p_name = path_basename(p_operation->src_filenames[i]);
+
+      walk_path(p_tree, strdup(p_operation->src_filenames[i]),
+                path_join(p_dst_dir, p_name), DT_UNKNOWN, true);
+      free(p_name);
+    }
+  }
+  else if (errno == ENOENT && p_operation->num_srcs == 1)
+  {
+    walk_path(p_tree, strdup(p_operation->src_filenames[0]),
+              strdup(p_dst_dir), DT_UNKNOWN, true);
+  }
+  else
+  {
+    fprintf(stderr, "Destination \"%s\" is not a directory\n", p_dst_dir);
+    first_error(&p_tree->rc, ENOTDIR);
+  }
+
+  if (p_operation->update_check != UPDATE_CHECK_NONE)
+  {
+    skip_unchanged_files(p_tree, (p_operation->num_workers > 1)
+                                 ? p_operation->num_workers : 1);
+  }
+
+  bool use_ring = false;
+
+  if (p_operation->small_files && p_tree->num_files > 0)
+  {
+    static const uint8_t ops[] =
+    {
+      IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_FSYNC, IORING_OP_CLOSE
+    };
+
+    int rc = uring_init(&p_tree->ring, TREE_RING_ENTRIES, ops,
+                        sizeof(ops) / sizeof(ops[0]));
+
+    if (rc != 0)
+    {
+      fprintf(stderr, "W: io_uring unavailable (%s), using ordinary system "
+              "calls.\n", strerror(rc));
+    }
+
+    use_ring = (rc == 0);
+  }
+
+  if (use_ring)
+  {
+    first_error(&p_tree->rc, clone_files_ring(p_tree));
+    uring_exit(&p_tree->ring);
+  }
+  else if (p_operation->num_workers > 1)
+  {
+    clone_files_parallel(p_tree, p_operation->num_workers);
+  }
+  else
+  {
+    for (size_t i = 0; i < p_tree->num_files; i++)
+    {
+      first_error(&p_tree->rc, clone_file_sync(p_tree, i));
+    }
+  }
+
+  set_dir_attrs(p_tree);
+
+  for (size_t i = 0; i < p_tree->num_files; i++)
+  {
+    free(p_tree->p_files[i].p_src);
+    free(p_tree->p_files[i].p_dst);
+  }
+
+  for (size_t i = 0; i < p_tree->num_dirs; i++)
+  {
+    free(p_tree->p_dirs[i].p_dst);
+  }
+
+  int rc = p_tree->rc;
+
+  free(p_tree->p_files);
+  free(p_tree->p_dirs);
+  free(p_tree->p_inodes);
+  free(p_tree);
+
+  return rc;
+}
+
+/*============================================================================*/
@@ -0,0 +1,246 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, minimal io_uring wrapper.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The kernel and this process share the ring indices, so they are accessed
+ * with acquire/release atomics: we publish the SQ tail with a release store
+ * after filling in the entries, and read the CQ tail with an acquire load
+ * before reading completions.
+ */
+
+#include "cpr_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/**
+ * Return true if the kernel behind @p ring_fd supports every opcode in
+ * @p p_ops.
+ */
+
+static bool probe_ops (const int      ring_fd,
+                       const uint8_t *p_ops,
+                       const size_t   num_ops)
+{
+  const size_t            probe_size = sizeof(struct io_uring_probe) +
+                                       256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p_probe    = calloc(1, probe_size);
+
+  if (p_probe == NULL)
+  {
+    return false;
+  }
+
+  bool supported = (syscall(__NR_io_uring_register, ring_fd,
+                            IORING_REGISTER_PROBE, p_probe, 256) == 0);
+
+  for (size_t i = 0; supported && i < num_ops; i++)
+  {
+    supported = p_ops[i] <= p_probe->last_op &&
+                (p_probe->ops[p_ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  free(p_probe);
+
+  return supported;
+}
+
+/*============================================================================*/
+
+int uring_init (uring_t       *p_ring,
+                const unsigned entries,
+                const uint8_t *p_ops,
+                const size_t   num_ops)
+{
+  memset(p_ring, 0, sizeof(*p_ring));
+  p_ring->ring_fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+
+  if (ring_fd < 0)
+  {
+    return errno;
+  }
+
+  p_ring->ring_fd = ring_fd;
+
+  if (!probe_ops(ring_fd, p_ops, num_ops))
+  {
+    uring_exit(p_ring);
+    return EOPNOTSUPP;
+  }
+
+  p_ring->sq_ring_size = params.sq_off.array +
+                         params.sq_entries * sizeof(unsigned);
+  p_ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+  p_ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  p_ring->p_sq_ring = mmap(NULL, p_ring->sq_ring_size,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQ_RING);
+  p_ring->p_cq_ring = mmap(NULL, p_ring->cq_ring_size,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_CQ_RING);
+  p_ring->p_sqes    = mmap(NULL, p_ring->sqes_size,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQES);
+
+  if (p_ring->p_sq_ring == MAP_FAILED || p_ring->p_cq_ring == MAP_FAILED ||
+      p_ring->p_sqes == MAP_FAILED)
+  {
+    int rc = errno;
+    uring_exit(p_ring);
+    return rc;
+  }
+
+  uint8_t *p_sq = p_ring->p_sq_ring;
+  uint8_t *p_cq = p_ring->p_cq_ring;
+
+  p_ring->p_sq_head  = (unsigned *)(p_sq + params.sq_off.head);
+  p_ring->p_sq_tail  = (unsigned *)(p_sq + params.sq_off.tail);
+  p_ring->p_sq_mask  = (unsigned *)(p_sq + params.sq_off.ring_mask);
+  p_ring->p_sq_array = (unsigned *)(p_sq + params.sq_off.array);
+  p_ring->sq_entries = params.sq_entries;
+
+  p_ring->p_cq_head  = (unsigned *)(p_cq + params.cq_off.head);
+  p_ring->p_cq_tail  = (unsigned *)(p_cq + params.cq_off.tail);
+  p_ring->p_cq_mask  = (unsigned *)(p_cq + params.cq_off.ring_mask);
+  p_ring->p_cqes     = (struct io_uring_cqe *)(p_cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+/*============================================================================*/
+
+void uring_exit (uring_t *p_ring)
+{
+  if (p_ring->p_sqes != NULL && p_ring->p_sqes != MAP_FAILED)
+  {
+    munmap(p_ring->p_sqes, p_ring->sqes_size);
+  }
+
+  if (p_ring->p_cq_ring != NULL && p_ring->p_cq_ring != MAP_FAILED)
+  {
+    munmap(p_ring->p_cq_ring, p_ring->cq_ring_size);
+  }
+
+  if (p_ring->p_sq_ring != NULL && p_ring->p_sq_ring != MAP_FAILED)
+  {
+    munmap(p_ring->p_sq_ring, p_ring->sq_ring_size);
+  }
+
+  if (p_ring->ring_fd >= 0)
+  {
+    close(p_ring->ring_fd);
+  }
+
+  memset(p_ring, 0, sizeof(*p_ring));
+  p_ring->ring_fd = -1;
+}
+
+/*============================================================================*/
+
+struct io_uring_sqe *uring_get_sqe (uring_t *p_ring)
+{
+  const unsigned head = __atomic_load_n(p_ring->p_sq_head, __ATOMIC_ACQUIRE);
+  const unsigned tail = *p_ring->p_sq_tail + p_ring->sq_pending;
+
+  if (tail - head >= p_ring->sq_entries)
+  {
+    return NULL;
+  }
+
+  const unsigned       index  = tail & *p_ring->p_sq_mask;
+  struct io_uring_sqe *p_sqe  = &p_ring->p_sqes[index];
+
+  memset(p_sqe, 0, sizeof(*p_sqe));
+  p_ring->p_sq_array[index] = index;
+  p_ring->sq_pending++;
+
+  return p_sqe;
+}
+
+/*============================================================================*/
+
+int uring_submit (uring_t *p_ring, const unsigned wait_nr)
+{
+  const unsigned to_submit = p_ring->sq_pending;
+
+  __atomic_store_n(p_ring->p_sq_tail, *p_ring->p_sq_tail + to_submit,
+                   __ATOMIC_RELEASE);
+  p_ring->sq_pending = 0;
+
+  for (;;)
+  {
+    int rc = syscall(__NR_io_uring_enter, p_ring->ring_fd, to_submit, wait_nr,
+                     (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (rc >= 0)
+    {
+      return 0;
+    }
+    else if (errno != EINTR)
+    {
+      return errno;
+    }
+  }
+}
+
+/*============================================================================*/
+
+bool uring_pop_cqe (uring_t  *p_ring,
+                    uint64_t *p_user_data,
+                    int32_t  *p_res)
+{
+  const unsigned head = *p_ring->p_cq_head;
+  const unsigned tail = __atomic_load_n(p_ring->p_cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+  {
+    return false;
+  }
+
+  const struct io_uring_cqe *p_cqe = &p_ring->p_cqes[head & *p_ring->p_cq_mask];
+
+  *p_user_data = p_cqe->user_data;
+  *p_res       = p_cqe->res;
+
+  __atomic_store_n(p_ring->p_cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+/*============================================================================*/
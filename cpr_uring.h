@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test program, minimal io_uring wrapper.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * Just enough of io_uring, driven through the raw system calls, to batch the
+ * metadata system calls of small-file tree clones. Implemented directly on
+ * the kernel interface so that cpr does not need liburing to build.
+ */
+
+#ifndef CPR_URING_H
+#define CPR_URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*============================================================================*/
+
+/** An io_uring instance and its mapped rings. */
+
+typedef struct _uring_t
+{
+  int                  ring_fd;
+
+  /**
+   * Submission queue.
+   * @{
+   */
+  unsigned            *p_sq_head;
+  unsigned            *p_sq_tail;
+  unsigned            *p_sq_mask;
+  unsigned            *p_sq_array;
+  struct io_uring_sqe *p_sqes;
+  unsigned             sq_entries;
+  unsigned             sq_pending; /**< Prepared but not yet submitted. */
+  /** @} */
+
+  /**
+   * Completion queue.
+   * @{
+   */
+  unsigned            *p_cq_head;
+  unsigned            *p_cq_tail;
+  unsigned            *p_cq_mask;
+  struct io_uring_cqe *p_cqes;
+  /** @} */
+
+  /**
+   * Mappings to release on exit.
+   * @{
+   */
+  void                *p_sq_ring;
+  size_t               sq_ring_size;
+  void                *p_cq_ring;
+  size_t               cq_ring_size;
+  size_t               sqes_size;
+  /** @} */
+} uring_t;
+
+/*============================================================================*/
+
+/**
+ * Create a ring with room for @p entries submissions and check the kernel
+ * supports every opcode in @p p_ops.
+ *
+ * @return Zero on success. @c EOPNOTSUPP if an opcode is unsupported,
+ *         otherwise an errno value from io_uring_setup(2) or mmap(2) (e.g.
+ *         @c ENOSYS on older kernels, @c EPERM where io_uring is disabled).
+ */
+
+int uring_init (uring_t       *p_ring,
+                const unsigned entries,
+                const uint8_t *p_ops,
+                const size_t   num_ops);
+
+/**
+ * Release @p p_ring. Safe to call on a ring that failed to initialise.
+ */
+
+void uring_exit (uring_t *p_ring);
+
+/**
+ * Return a zeroed submission entry, or NULL if the submission queue is full
+ * (call uring_submit() to make room).
+ */
+
+struct io_uring_sqe *uring_get_sqe (uring_t *p_ring);
+
+/**
+ * Submit every prepared entry and wait until at least @p wait_nr
+ * completions are available.
+ *
+ * @return Zero on success, some errno value on failure.
+ */
+
+int uring_submit (uring_t *p_ring, const unsigned wait_nr);
+
+/**
+ * Take the next completion off @p p_ring, if there is one.
+ *
+ * @return True if a completion was returned.
+ */
+
+bool uring_pop_cqe (uring_t  *p_ring,
+                    uint64_t *p_user_data,
+                    int32_t  *p_res);
+
+/*============================================================================*/
+
+#endif /* CPR_URING_H */
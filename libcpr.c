@@ -41,16 +41,25 @@
  *
  * For real failures (e.g. dst unwritable, dst immutable) a read/write
  * deep copy will return a real error that we can tell the caller.
+ *
+ * Every copy uses pread(2)/pwrite(2) at explicit offsets and never touches
+ * the file positions of the caller's descriptors, so concurrent calls may
+ * share descriptors. Nothing else about a call is shared between threads
+ * except the throttle and the trace hook, both of which are thread-safe.
  */
 
 #include "libcpr.h"
+#include "libcpr_internal.h"
 
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -58,12 +67,236 @@
 /*============================================================================*/
 
 /**
- * Find the smaller of two objects that are the same type.
+ * Largest range copied by small_copy(), through a buffer on the stack, rather
+ * than by the block-by-block copy.
+ */
+
+#define SMALL_COPY_MAX 16384
+
+/**
+ * Huge page size asked for by cpr_block_get(). Two MiB is the smallest huge
+ * page on x86-64 and the default on arm64 with 4 KiB base pages.
+ */
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+/*============================================================================*/
+
+/** A thread's cached copy buffer. See cpr_block_get(). */
+
+typedef struct _block_pool_t
+{
+  uint8_t          *p_block;
+  size_t            size;
+  bool              mapped; /**< From huge_block_alloc(), not malloc(). */
+  qtm_copy_buffer_t kind;
+} block_pool_t;
+
+/*============================================================================*/
+
+_Thread_local qtm_clone_stats_t g_cpr_last_stats;
+
+/** Time the calling thread's current clone call started. */
+
+static _Thread_local uint64_t g_stats_start_ns;
+
+/** Key whose destructor frees each thread's block_pool_t. */
+
+static pthread_key_t  g_block_pool_key;
+static pthread_once_t g_block_pool_once = PTHREAD_ONCE_INIT;
+
+/*============================================================================*/
+
+void cpr_stats_begin (void)
+{
+  g_cpr_last_stats = (qtm_clone_stats_t)
+  {
+    .method       = QTM_CLONE_METHOD_NONE,
+    .bytes_copied = 0,
+    .elapsed_ns   = 0,
+    .buffer       = QTM_COPY_BUFFER_NONE,
+    .bytes_shared = 0
+  };
+
+  g_stats_start_ns = cpr_trace_clock_ns();
+}
+
+/*============================================================================*/
+
+void cpr_stats_end (const int rc)
+{
+  if (rc == 0 && g_cpr_last_stats.method == QTM_CLONE_METHOD_NONE)
+  {
+    g_cpr_last_stats.method = QTM_CLONE_METHOD_REFLINK;
+  }
+
+  g_cpr_last_stats.elapsed_ns = cpr_trace_clock_ns() - g_stats_start_ns;
+}
+
+/*============================================================================*/
+
+/**
+ * Map @p size bytes, rounded up to whole huge pages, and fault them in. Tries
+ * the hugetlbfs pool first, then memory aligned to a huge page and advised
+ * for transparent huge pages. If the kernel will not take the advice the
+ * buffer is still usable, in ordinary pages.
  *
- * @note This has the potential to double-evaluate its input parameters, so do
- *       not invoke it with parameters that have side-effects.
+ * @return The buffer, or NULL if out of memory.
  */
-#define MIN(x_, y_) (((x_) <= (y_)) ? (x_) : (y_))
+
+static uint8_t *huge_block_alloc (const size_t       size,
+                                  size_t            *p_mapped,
+                                  qtm_copy_buffer_t *p_kind)
+{
+  const size_t length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+  /* MAP_POPULATE faults every page in now rather than inside the copy. */
+  void *p_map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB |
+                     MAP_POPULATE, -1, 0);
+
+  if (p_map != MAP_FAILED)
+  {
+    *p_mapped = length;
+    *p_kind   = QTM_COPY_BUFFER_HUGETLB;
+    return p_map;
+  }
+
+  /* Over-allocate by a huge page and trim, so the buffer starts on a huge
+   * page boundary and every page of it can be a huge one.
+   */
+  uint8_t *p_raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (p_raw == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  uint8_t     *p_block = (uint8_t *)(((uintptr_t)p_raw + HUGE_PAGE_SIZE - 1) &
+                                     ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  const size_t head    = p_block - p_raw;
+
+  if (head > 0)
+  {
+    munmap(p_raw, head);
+  }
+
+  if (head < HUGE_PAGE_SIZE)
+  {
+    munmap(p_block + length, HUGE_PAGE_SIZE - head);
+  }
+
+  *p_kind = (madvise(p_block, length, MADV_HUGEPAGE) == 0)
+            ? QTM_COPY_BUFFER_THP : QTM_COPY_BUFFER_PAGES;
+
+  for (size_t pos = 0; pos < length; pos += 4096)
+  {
+    p_block[pos] = 0;
+  }
+
+  *p_mapped = length;
+
+  return p_block;
+}
+
+/*============================================================================*/
+
+/**
+ * Free @p p_pool's buffer, leaving the pool empty.
+ */
+
+static void block_release (block_pool_t *p_pool)
+{
+  if (p_pool->mapped)
+  {
+    munmap(p_pool->p_block, p_pool->size);
+  }
+  else
+  {
+    free(p_pool->p_block);
+  }
+
+  p_pool->p_block = NULL;
+  p_pool->size    = 0;
+  p_pool->mapped  = false;
+  p_pool->kind    = QTM_COPY_BUFFER_NONE;
+}
+
+/*============================================================================*/
+
+/**
+ * Thread exit destructor for a thread's block_pool_t.
+ */
+
+static void block_pool_free (void *p_arg)
+{
+  block_pool_t *p_pool = p_arg;
+
+  block_release(p_pool);
+  free(p_pool);
+}
+
+/*============================================================================*/
+
+/**
+ * Create the block pool key. Run once per process.
+ */
+
+static void block_pool_init (void)
+{
+  (void)pthread_key_create(&g_block_pool_key, block_pool_free);
+}
+
+/*============================================================================*/
+
+uint8_t *cpr_block_get (const size_t size, const bool huge)
+{
+  pthread_once(&g_block_pool_once, block_pool_init);
+
+  block_pool_t *p_pool = pthread_getspecific(g_block_pool_key);
+
+  if (p_pool == NULL)
+  {
+    p_pool = calloc(1, sizeof(*p_pool));
+
+    if (p_pool == NULL || pthread_setspecific(g_block_pool_key, p_pool) != 0)
+    {
+      free(p_pool);
+      return NULL;
+    }
+  }
+
+  /* A buffer once mapped for huge pages serves every later call that fits,
+   * so a thread without huge pages does not retry for each call.
+   */
+  const bool want_huge = huge && size >= HUGE_PAGE_SIZE;
+
+  if (p_pool->size < size || (want_huge && !p_pool->mapped))
+  {
+    block_release(p_pool);
+
+    if (want_huge)
+    {
+      p_pool->p_block = huge_block_alloc(size, &p_pool->size, &p_pool->kind);
+      p_pool->mapped  = (p_pool->p_block != NULL);
+    }
+    else
+    {
+      p_pool->p_block = malloc(size);
+      p_pool->size    = (p_pool->p_block != NULL) ? size : 0;
+      p_pool->kind    = QTM_COPY_BUFFER_PAGES;
+    }
+  }
+
+  g_cpr_last_stats.buffer = p_pool->kind;
+
+  return p_pool->p_block;
+}
 
 /*============================================================================*/
 
@@ -83,11 +316,11 @@
  * @return 0 for success, non-zero errno value on failure.
  */
 
-static int clone_file_range_impl (const int    src_fd,
-                                  const int    dst_fd,
-                                  const off_t  src_offset,
-                                  const off_t  dst_offset,
-                                  const size_t length)
+int clone_file_range_impl (const int    src_fd,
+                           const int    dst_fd,
+                           const off_t  src_offset,
+                           const off_t  dst_offset,
+                           const size_t length)
 
 {
   struct file_clone_range clone_range =
@@ -98,7 +331,7 @@ static int clone_file_range_impl (const int    src_fd,
     .dest_offset = dst_offset
   };
 
-  int rc = ioctl(dst_fd, FICLONERANGE, &clone_range);
+  int rc = cpr_sys_ficlonerange(dst_fd, &clone_range);
 
   if (rc < 0)
   {
@@ -123,9 +356,9 @@ static int clone_file_range_impl (const int    src_fd,
  * @return 0 for success, non-zero errno value on failure.
  */
 
-static int clone_file_impl (const int src_fd, const int dst_fd)
+int clone_file_impl (const int src_fd, const int dst_fd)
 {
-  int rc = ioctl(dst_fd, FICLONE, src_fd);
+  int rc = cpr_sys_ficlone(src_fd, dst_fd);
 
   if (rc < 0)
   {
@@ -138,53 +371,26 @@ static int clone_file_impl (const int src_fd, const int dst_fd)
 /*============================================================================*/
 
 /**
- * Seek a file descriptor, @p fd, to a desired @p offset.
- *
- * @param[in] fd     Source file.
- * @param[in] offset Offset from start.
- * @return Zero on success, some errno value on failure.
- */
-
-static int seek_file (const int fd, const off_t offset)
-{
-  int rc = lseek(fd, offset, SEEK_SET);
-
-  if (rc == -1)
-  {
-    rc = errno;
-  }
-  else if (rc > 0)
-  {
-    /* lseek() returns the current offset on success. We want to return zero
-     * on success.
-     */
-    rc = 0;
-  }
-
-  return rc;
-}
-
-/*============================================================================*/
-
-/**
- * Write a block to @p fd, blocking until the whole amount is written or
- * an error prevents writing more.
+ * Write a block to @p fd at @p offset, blocking until the whole amount is
+ * written or an error prevents writing more.
  *
  * @param[in] fd      Destination file.
  * @param[in] p_block Data to write.
  * @param[in] length  Length of data in @p p_block to write.
+ * @param[in] offset  Offset into @p fd to write at.
  * @return Zero on success, some errno value on failure.
  */
 
 static int write_block (const int      fd,
                         const uint8_t *p_block,
-                        size_t         length)
+                        size_t         length,
+                        off_t          offset)
 {
   int rc = 0;
 
   while (length > 0)
   {
-    ssize_t wrote_now = write(fd, p_block, length);
+    ssize_t wrote_now = cpr_sys_pwrite(fd, p_block, length, offset);
 
     if (wrote_now < 0)
     {
@@ -197,8 +403,11 @@ static int write_block (const int      fd,
       break;
     }
 
+    cpr_throttle(0, 1);
+
     p_block += wrote_now;
     length  -= wrote_now;
+    offset  += wrote_now;
   }
 
   return rc;
@@ -215,41 +424,41 @@ static int write_block (const int      fd,
  * @param[in] dst_offset Offset to start copy to.
  * @param[in] length     Length of segment to copy. Zero to copy to source EOF.
  * @param[in] block_size Block size to use when copying.
+ * @param[in] flags      #qtm_clone_flag_t values. Only
+ *                       #QTM_CLONE_FLAG_HUGE_PAGES applies.
  * @return Zero on success, some error value on failure.
  */
 
-static int deep_copy_file_range_impl (const int    src_fd,
-                                      const int    dst_fd,
-                                      const off_t  src_offset,
-                                      const off_t  dst_offset,
-                                      const size_t length,
-                                      const size_t block_size)
+int deep_copy_file_range_impl (const int      src_fd,
+                               const int      dst_fd,
+                               const off_t    src_offset,
+                               const off_t    dst_offset,
+                               const size_t   length,
+                               const size_t   block_size,
+                               const uint32_t flags)
 {
-  int rc = seek_file(src_fd, src_offset);
-
-  if (rc == 0)
-  {
-    rc = seek_file(dst_fd, dst_offset);
-  }
-
-  if (rc != 0)
-  {
-    return rc;
-  }
+  int rc = 0;
 
-  void *p_block = malloc(block_size * sizeof(uint8_t));
+  /* The buffer is reused by this thread's later copies. */
+  uint8_t *p_block = cpr_block_get(block_size,
+                                   (flags & QTM_CLONE_FLAG_HUGE_PAGES) != 0);
 
   if (p_block == NULL)
   {
     return ENOMEM;
   }
 
+  cpr_stats_copied(0);
+
   size_t remain = (length != 0) ? length : block_size;
+  off_t  copied = 0;
 
   while (remain > 0)
   {
-    const size_t  read_max = MIN(block_size, remain);
-    const ssize_t read_now = read(src_fd, p_block, read_max);
+    const size_t read_max = MIN(block_size, remain);
+
+    const ssize_t read_now = cpr_sys_pread(src_fd, p_block, read_max,
+                                           src_offset + copied);
 
     if (read_now < 0)
     {
@@ -261,7 +470,11 @@ static int deep_copy_file_range_impl (const int    src_fd,
       rc = errno;
       break;
     }
-    else if (read_now == 0 && length == 0)
+
+    /* Charged once it worked, so that EINTR retries are not charged too. */
+    cpr_throttle(read_now, 1);
+
+    if (read_now == 0 && length == 0)
     {
       /* EOF was reached and we were copying to EOF. Terminate loop. */
       break;
@@ -273,13 +486,16 @@ static int deep_copy_file_range_impl (const int    src_fd,
       break;
     }
 
-    rc = write_block(dst_fd, p_block, read_now);
+    rc = write_block(dst_fd, p_block, read_now, dst_offset + copied);
 
     if (rc != 0)
     {
       break;
     }
 
+    cpr_stats_copied(read_now);
+    copied += read_now;
+
     /* Only update the remaining length if not copying to EOF. */
     if (length != 0)
     {
@@ -287,34 +503,207 @@ static int deep_copy_file_range_impl (const int    src_fd,
     }
   }
 
-  /* Cleanup. */
-  free(p_block);
-
   return rc;
 }
 
 /*============================================================================*/
 
-int qtm_clone_file (const int    src_fd,
-                    const int    dst_fd,
-                    const bool   fallback_copy,
-                    const size_t fallback_copy_block_size)
+/**
+ * Find how many bytes of @p src_fd follow @p src_offset.
+ *
+ * @return Zero on success. Non-zero if the size is unknown, in which case the
+ *         copy must run to EOF instead.
+ */
+
+static int source_size (const int    src_fd,
+                        const off_t  src_offset,
+                        uint64_t    *p_size)
 {
-  if (src_fd < 0 || dst_fd < 0 ||
-      (fallback_copy && fallback_copy_block_size == 0))
+  struct stat src_stat;
+
+  if (fstat(src_fd, &src_stat) != 0)
   {
-    return EINVAL;
+    return errno;
+  }
+  else if (!S_ISREG(src_stat.st_mode))
+  {
+    return ESPIPE;
   }
 
-  int rc = clone_file_impl(src_fd, dst_fd);
+  *p_size = (src_stat.st_size > src_offset)
+            ? (uint64_t)(src_stat.st_size - src_offset) : 0;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Copy a range of at most #SMALL_COPY_MAX bytes through a buffer on the
+ * stack with positional I/O: one read and one write, no seeks and no heap.
+ *
+ * @param[in] to_eof If set, @p length came from the source's size and a
+ *                   source that has since shrunk is copied up to its new
+ *                   EOF. Otherwise a short source is an error.
+ * @return Zero on success, some errno value on failure. @c ERANGE if the
+ *         source ended early and @p to_eof is clear.
+ */
+
+static int small_copy (const int    src_fd,
+                       const int    dst_fd,
+                       const off_t  src_offset,
+                       const off_t  dst_offset,
+                       const size_t length,
+                       const bool   to_eof)
+{
+  uint8_t block[SMALL_COPY_MAX];
+  size_t  got = 0;
+
+  cpr_stats_copied(0);
+
+  while (got < length)
+  {
+    const ssize_t read_now = cpr_sys_pread(src_fd, block + got, length - got,
+                                           src_offset + got);
+
+    if (read_now < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return errno;
+    }
+
+    cpr_throttle(read_now, 1);
+
+    if (read_now == 0)
+    {
+      if (!to_eof)
+      {
+        return ERANGE;
+      }
+
+      break;
+    }
 
-  if (rc != 0 && fallback_copy)
+    got += read_now;
+  }
+
+  for (size_t wrote = 0; wrote < got;)
   {
-    rc = deep_copy_file_range_impl(src_fd, dst_fd, 0, 0, 0,
-                                   fallback_copy_block_size);
+    const ssize_t wrote_now = cpr_sys_pwrite(dst_fd, block + wrote,
+                                             got - wrote, dst_offset + wrote);
+
+    if (wrote_now < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return errno;
+    }
+
+    cpr_throttle(0, 1);
+
+    wrote += wrote_now;
+    cpr_stats_copied(wrote_now);
   }
 
-  return rc;
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Clone a range, or the whole file if @p whole_file is set, falling back to
+ * a copy if @p p_options allows it. The source size is only looked up when
+ * it can change what is done: to skip the reflink of a source under
+ * @c reflink_threshold, and to copy a source that turns out to be small
+ * with small_copy() rather than the block-by-block copy.
+ */
+
+static int clone_or_copy (const int                  src_fd,
+                          const int                  dst_fd,
+                          const off_t                src_offset,
+                          const off_t                dst_offset,
+                          const size_t               length,
+                          const bool                 whole_file,
+                          const qtm_clone_options_t *p_options)
+{
+  const bool fallback_copy = p_options->fallback_copy;
+  uint64_t   size          = length;
+  bool       sized         = (length != 0);
+  int        rc            = EAGAIN;
+
+  if (fallback_copy && p_options->reflink_threshold != 0 && !sized)
+  {
+    sized = (source_size(src_fd, src_offset, &size) == 0);
+  }
+
+  if (!fallback_copy || !sized || size > p_options->reflink_threshold)
+  {
+    rc = whole_file
+         ? clone_file_impl(src_fd, dst_fd)
+         : clone_file_range_impl(src_fd, dst_fd, src_offset, dst_offset,
+                                 length);
+  }
+
+  if (rc == 0 || !fallback_copy)
+  {
+    return rc;
+  }
+
+  if (!sized)
+  {
+    sized = (source_size(src_fd, src_offset, &size) == 0);
+  }
+
+  if (sized && size <= SMALL_COPY_MAX)
+  {
+    return small_copy(src_fd, dst_fd, src_offset, dst_offset, size,
+                      length == 0);
+  }
+
+  if (p_options->flags & (QTM_CLONE_FLAG_PHYSICAL_ORDER |
+                          QTM_CLONE_FLAG_PRESERVE_SHARING))
+  {
+    rc = extent_copy_file_range(src_fd, dst_fd, src_offset, dst_offset,
+                                length, p_options->fallback_copy_block_size,
+                                p_options->flags);
+
+    if (rc != EOPNOTSUPP)
+    {
+      return rc;
+    }
+  }
+
+  return deep_copy_file_range_impl(src_fd, dst_fd, src_offset, dst_offset,
+                                   length,
+                                   p_options->fallback_copy_block_size,
+                                   p_options->flags);
+}
+
+/*============================================================================*/
+
+int qtm_clone_file (const int    src_fd,
+                    const int    dst_fd,
+                    const bool   fallback_copy,
+                    const size_t fallback_copy_block_size)
+{
+  const qtm_clone_options_t options =
+  {
+    .fallback_copy            = fallback_copy,
+    .fallback_copy_block_size = fallback_copy_block_size,
+    .p_journal_path           = NULL,
+    .checkpoint_interval      = 0,
+    .reflink_threshold        = 0,
+    .flags                    = 0
+  };
+
+  return qtm_clone_file_ex(src_fd, dst_fd, &options);
 }
 
 /*============================================================================*/
@@ -327,23 +716,84 @@ int qtm_clone_file_range (const int    src_fd,
                           const bool   fallback_copy,
                           const size_t fallback_copy_block_size)
 {
-  if (src_fd < 0 || dst_fd < 0 || src_offset < 0 || dst_offset < 0 ||
-      (fallback_copy && fallback_copy_block_size == 0))
+  const qtm_clone_options_t options =
+  {
+    .fallback_copy            = fallback_copy,
+    .fallback_copy_block_size = fallback_copy_block_size,
+    .p_journal_path           = NULL,
+    .checkpoint_interval      = 0,
+    .reflink_threshold        = 0,
+    .flags                    = 0
+  };
+
+  return qtm_clone_file_range_ex(src_fd, dst_fd, src_offset, dst_offset,
+                                 length, &options);
+}
+
+/*============================================================================*/
+
+int qtm_clone_file_ex (const int                  src_fd,
+                       const int                  dst_fd,
+                       const qtm_clone_options_t *p_options)
+{
+  if (p_options == NULL || src_fd < 0 || dst_fd < 0 ||
+      (p_options->fallback_copy && p_options->fallback_copy_block_size == 0))
   {
     return EINVAL;
   }
 
-  int rc =
-    clone_file_range_impl(src_fd, dst_fd, src_offset, dst_offset, length);
+  cpr_stats_begin();
+
+  int rc = (p_options->p_journal_path != NULL && p_options->fallback_copy)
+           ? journal_clone_file_range(src_fd, dst_fd, 0, 0, 0, true, p_options)
+           : clone_or_copy(src_fd, dst_fd, 0, 0, 0, true, p_options);
+
+  cpr_stats_end(rc);
+
+  return rc;
+}
+
+/*============================================================================*/
 
-  if (rc != 0 && fallback_copy)
+int qtm_clone_file_range_ex (const int                  src_fd,
+                             const int                  dst_fd,
+                             const off_t                src_offset,
+                             const off_t                dst_offset,
+                             const size_t               length,
+                             const qtm_clone_options_t *p_options)
+{
+  if (p_options == NULL || src_fd < 0 || dst_fd < 0 || src_offset < 0 ||
+      dst_offset < 0 ||
+      (p_options->fallback_copy && p_options->fallback_copy_block_size == 0))
   {
-    rc = deep_copy_file_range_impl(src_fd, dst_fd, src_offset, dst_offset,
-                                   length, fallback_copy_block_size);
+    return EINVAL;
   }
 
+  cpr_stats_begin();
+
+  int rc = (p_options->p_journal_path != NULL && p_options->fallback_copy)
+           ? journal_clone_file_range(src_fd, dst_fd, src_offset, dst_offset,
+                                      length, false, p_options)
+           : clone_or_copy(src_fd, dst_fd, src_offset, dst_offset, length,
+                           false, p_options);
+
+  cpr_stats_end(rc);
+
   return rc;
 }
 
 /*============================================================================*/
 
+int qtm_clone_last_stats (qtm_clone_stats_t *p_stats)
+{
+  if (p_stats == NULL)
+  {
+    return EINVAL;
+  }
+
+  *p_stats = g_cpr_last_stats;
+
+  return 0;
+}
+
+/*============================================================================*/
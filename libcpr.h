@@ -35,14 +35,36 @@
  * operation to fail. The caller should decide whether they are interested in
  * why reflink failed before blindly requesing the auto-fallback.
  *
+ * Whether a clone really shares storage with its source can be checked
+ * without reading either file using #qtm_clone_verify(), and whether it holds
+ * the same data, reading only what does not share storage, using
+ * #qtm_clone_compare().
+ *
+ * For callers that cannot block a thread on a long fallback copy, a queue of
+ * worker threads is provided by #qtm_clone_queue_create() which reports
+ * completions through an eventfd.
+ *
+ * @section threads Thread safety
+ *
+ * Every function may be called from any number of threads at once, including
+ * on the same descriptors: the fallback copies read and write with pread(2)
+ * and pwrite(2) at explicit offsets, so they neither use nor change the file
+ * position of the caller's descriptors. Concurrent calls that write
+ * overlapping ranges of one destination still race on the file's contents,
+ * and two calls must not use the same journal path at once.
+ *
  * Despite the @c qtm_ prefix on the exported method names, this code is not
  * specific to Quantum file systems and will work on any file system that
  * provides the ability to reflink on Linux. With fallback enabled the copy
- * will work on any two file handles that can be seeked, read and written.
+ * will work on any two file handles that support pread(2) and pwrite(2).
  */
 
+#ifndef LIBCPR_H
+#define LIBCPR_H
+
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,7 +86,10 @@ extern "C" {
  *   If set, fall back to a deep read()/write() copy if the FICLONE call fails.
  * @param[in] fallback_copy_block_size
  *   Block size to use if @p fallback_copy is set. Must be larger than zero.
- *   Ignored if @p fallback_copy is clear.
+ *   Ignored if @p fallback_copy is clear. The copy buffer is not freed on
+ *   return: the calling thread keeps it, at the largest block size it has
+ *   copied with, for its later calls and frees it when it exits. A thread
+ *   that copies once with a large block size holds that memory until then.
  * @return
  *   Zero on success. Some non-zero errno value on failure.
  *
@@ -80,8 +105,8 @@ extern "C" {
  *   - @c ETXTBUSY
  *   - @c EXDEV
  *
- *   If  @p fallback_copy is set then one of the errno values from lseeek(),
- *   read(2) or write(2) may be returned including, but not limited to, the
+ *   If  @p fallback_copy is set then one of the errno values from fstat(2),
+ *   pread(2) or pwrite(2) may be returned including, but not limited to, the
  *   following:
  *
  *   - @c EAGAIN or @c EWOULDBLOCK (for non-blocking file descriptors)
@@ -127,7 +152,8 @@ int qtm_clone_file (const int    src_fd,
  *   If set, fall back to a deep read()/write() copy if the FICLONE call fails.
  * @param[in] fallback_copy_block_size
  *   Block size to use if @p fallback_copy is set. Must be larger than zero.
- *   Ignored if @p fallback_copy is clear.
+ *   Ignored if @p fallback_copy is clear. The calling thread keeps the copy
+ *   buffer until it exits, as for #qtm_clone_file().
  * @return
  *   Zero on success. Some non-zero errno value on failure.
  *
@@ -143,8 +169,8 @@ int qtm_clone_file (const int    src_fd,
  *   - @c ETXTBUSY
  *   - @c EXDEV
  *
- *   If  @p fallback_copy is set then one of the errno values from lseek(),
- *   read(2) or write(2) may be returned including, but not limited to, the
+ *   If  @p fallback_copy is set then one of the errno values from fstat(2),
+ *   pread(2) or pwrite(2) may be returned including, but not limited to, the
  *   following:
  *
  *   - @c EAGAIN or @c EWOULDBLOCK (for non-blocking file descriptors)
@@ -173,7 +199,750 @@ int qtm_clone_file_range (const int    src_fd,
 
 /*============================================================================*/
 
+/**
+ * Clone the entire file @p src_fd into each of the @p num_dsts files in
+ * @p p_dst_fds, overwriting their contents.
+ *
+ * The FICLONE ioctl is attempted for every destination. If @p fallback_copy is
+ * set, the destinations for which it failed are then filled by a single pass
+ * over the source: each block is read once and written to all of them, so the
+ * amount of source I/O does not depend on how many destinations fell back.
+ *
+ * A destination that fails part way through the copy is dropped and the copy
+ * carries on for the others.
+ *
+ * @param[in] src_fd
+ *   Source file.
+ * @param[in] p_dst_fds
+ *   Array of @p num_dsts destination files.
+ * @param[in] num_dsts
+ *   Number of destinations. Must be larger than zero.
+ * @param[in] fallback_copy
+ *   If set, fall back to a deep copy for destinations FICLONE failed on.
+ * @param[in] fallback_copy_block_size
+ *   Block size to use if @p fallback_copy is set. Must be larger than zero.
+ *   Two buffers of this size are used if @p parallel_writes is set. They
+ *   stay with the calling thread until it exits, as for #qtm_clone_file().
+ * @param[in] parallel_writes
+ *   If set, write each block to the fallback destinations from one thread
+ *   per destination while the next block is read. Otherwise write them in
+ *   turn from the calling thread.
+ * @param[out] p_rcs
+ *   Array of @p num_dsts receiving the result for each destination: zero or
+ *   an errno value as described for #qtm_clone_file().
+ * @return
+ *   Zero if every destination succeeded. Otherwise the first non-zero value
+ *   in @p p_rcs, or @c EINVAL for bad parameters, @c ENOMEM if the copy
+ *   buffers could not be allocated, or an errno value from reading
+ *   @p src_fd (in which case every fallback destination gets it too).
+ */
+
+int qtm_clone_file_multi (const int    src_fd,
+                          const int   *p_dst_fds,
+                          const size_t num_dsts,
+                          const bool   fallback_copy,
+                          const size_t fallback_copy_block_size,
+                          const bool   parallel_writes,
+                          int         *p_rcs);
+
+/*============================================================================*/
+
+/** Flags for the @c flags field of #qtm_clone_options_t. */
+
+typedef enum _qtm_clone_flag_t
+{
+  /**
+   * Copy the source's extents in order of their physical address rather
+   * than in file order, writing each to its place in the destination. Turns
+   * the reads of a fragmented source on rotational media into one sweep
+   * across the disk. Falls back to file order if the source's extent map
+   * cannot be read with FS_IOC_FIEMAP. Ranges of the source without an
+   * extent are written as zeros, as in a file-order copy.
+   */
+  QTM_CLONE_FLAG_PHYSICAL_ORDER   = 1 << 0,
+
+  /**
+   * Back the fallback copy's buffer with huge pages, to spare the TLB when
+   * @c fallback_copy_block_size is in the MiB range. Pages come from the
+   * hugetlbfs pool with MAP_HUGETLB if it has enough free, otherwise the
+   * buffer is advised with MADV_HUGEPAGE for transparent huge pages. Either
+   * way it is faulted in up front and kept by the calling thread for later
+   * calls. Blocks smaller than a huge page keep an ordinary buffer. The
+   * statistics report which kind of buffer was used.
+   */
+  QTM_CLONE_FLAG_HUGE_PAGES       = 1 << 1,
+
+  /**
+   * Keep ranges of the source that share storage with each other shared in
+   * the destination, rather than writing each one out in full. Data at each
+   * physical address in the source's extent map is written once, and later
+   * ranges mapped to the same address are recreated by cloning the
+   * destination from itself with FICLONERANGE. Saves the writes and the
+   * space of sources stitched together from reflinks, such as synthetic
+   * full backups. Implies #QTM_CLONE_FLAG_PHYSICAL_ORDER. A repeat that is
+   * not made of whole blocks of the destination is written, as is any left
+   * once the destination's file system has refused a clone. The statistics
+   * report the bytes shared.
+   */
+  QTM_CLONE_FLAG_PRESERVE_SHARING = 1 << 2,
+} qtm_clone_flag_t;
+
+/*============================================================================*/
+
+/**
+ * Extended clone options.
+ *
+ * The @c _ex variants of the clone functions take their fallback settings
+ * from this structure along with settings that only make sense for the
+ * fallback copy. Zero-initialise it and fill in the fields required.
+ */
+
+typedef struct _qtm_clone_options_t
+{
+  /** As for #qtm_clone_file(). */
+  bool        fallback_copy;
+
+  /** As for #qtm_clone_file(). */
+  size_t      fallback_copy_block_size;
+
+  /**
+   * If not NULL, make the fallback copy resumable by keeping a checkpoint
+   * journal at this path. See #qtm_clone_file_range_ex().
+   */
+  const char *p_journal_path;
+
+  /**
+   * Bytes copied between checkpoints. Rounded up to a multiple of
+   * @c fallback_copy_block_size. Zero selects a default of 256 MiB.
+   */
+  uint64_t    checkpoint_interval;
+
+  /**
+   * If @c fallback_copy is set, copy sources of at most this many bytes
+   * without trying to reflink them first. Worth setting where a reflink of
+   * a small file is known to cost more than copying it, or to fail. Zero
+   * always tries the reflink. Not applied to journaled copies.
+   */
+  uint64_t    reflink_threshold;
+
+  /**
+   * Bitwise OR of #qtm_clone_flag_t values. They only affect the fallback
+   * copy and are not applied to journaled copies.
+   */
+  uint32_t    flags;
+} qtm_clone_options_t;
+
+/*============================================================================*/
+
+/**
+ * As #qtm_clone_file() but taking its settings from @p p_options.
+ *
+ * Equivalent to #qtm_clone_file_range_ex() with zero offsets and length
+ * except that the FICLONE ioctl is used rather than FICLONERANGE. The
+ * fallback copy's buffer stays with the calling thread until it exits.
+ */
+
+int qtm_clone_file_ex (const int                  src_fd,
+                       const int                  dst_fd,
+                       const qtm_clone_options_t *p_options);
+
+/*============================================================================*/
+
+/**
+ * As #qtm_clone_file_range() but taking its settings from @p p_options.
+ *
+ * If @c p_journal_path is set and the fallback copy is used, then after every
+ * @c checkpoint_interval bytes the destination is flushed with fdatasync(2)
+ * and the amount copied so far, together with a digest of the last block, is
+ * recorded in the journal. Data is always durable before the journal claims
+ * it.
+ *
+ * If the journal already exists when the call is made and describes the same
+ * request against an unchanged source, the last checkpointed block is re-read
+ * from the source (and from the destination, if @p dst_fd is readable) and
+ * checked against the recorded digest. If it matches, the copy resumes from
+ * the checkpoint without retrying the clone. Otherwise the journal is
+ * discarded and the request starts again from the beginning. A whole-file
+ * request from #qtm_clone_file_ex() that starts afresh first truncates the
+ * destination to the source's length, dropping anything left beyond it.
+ *
+ * The journal is removed once the request completes successfully, whether by
+ * clone or by copy. It is left in place on failure so that a later call can
+ * resume.
+ *
+ * Like #qtm_clone_file_range(), the fallback copy leaves its buffer cached
+ * in the calling thread until the thread exits.
+ *
+ * @return
+ *   As #qtm_clone_file_range(), plus the errno values of open(2),
+ *   fdatasync(2) and unlink(2) on the journal. @c ERANGE if the source is
+ *   shorter than the requested range.
+ */
+
+int qtm_clone_file_range_ex (const int                  src_fd,
+                             const int                  dst_fd,
+                             const off_t                src_offset,
+                             const off_t                dst_offset,
+                             const size_t               length,
+                             const qtm_clone_options_t *p_options);
+
+/*============================================================================*/
+
+/**
+ * How a clone call was carried out.
+ */
+
+typedef enum _qtm_clone_method_t
+{
+  QTM_CLONE_METHOD_NONE,    /**< Failed before either method completed. */
+  QTM_CLONE_METHOD_REFLINK, /**< FICLONE or FICLONERANGE. */
+  QTM_CLONE_METHOD_COPY,    /**< Fallback read/write copy. */
+} qtm_clone_method_t;
+
+/**
+ * Memory behind the fallback copy's block buffer.
+ */
+
+typedef enum _qtm_copy_buffer_t
+{
+  QTM_COPY_BUFFER_NONE,    /**< No block buffer was needed. */
+  QTM_COPY_BUFFER_PAGES,   /**< Ordinary pages. */
+  QTM_COPY_BUFFER_THP,     /**< Advised for transparent huge pages. */
+  QTM_COPY_BUFFER_HUGETLB, /**< Huge pages from the hugetlbfs pool. */
+} qtm_copy_buffer_t;
+
+/** Statistics describing a single clone call. */
+
+typedef struct _qtm_clone_stats_t
+{
+  qtm_clone_method_t method;
+  uint64_t           bytes_copied; /**< Written by the fallback copy. */
+  uint64_t           elapsed_ns;   /**< Wall-clock duration of the call. */
+  qtm_copy_buffer_t  buffer;       /**< Used by the fallback copy. */
+  uint64_t           bytes_shared; /**< Cloned within the destination
+                                        instead of written, with
+                                        #QTM_CLONE_FLAG_PRESERVE_SHARING. */
+} qtm_clone_stats_t;
+
+/**
+ * Fetch the statistics of the last #qtm_clone_file(),
+ * #qtm_clone_file_range(), @c _ex variant or #qtm_clone_file_multi() called
+ * by the calling thread. Statistics are kept per thread, so this is safe to
+ * use from clone queue workers or any other concurrent caller. For
+ * #qtm_clone_file_multi() @c bytes_copied counts each byte of the source
+ * copied once, however many destinations it was written to, and only once
+ * at least one of them has written it.
+ *
+ * @param[out] p_stats Receives the statistics.
+ * @return Zero on success, @c EINVAL if @p p_stats is NULL.
+ */
+
+int qtm_clone_last_stats (qtm_clone_stats_t *p_stats);
+
+/*============================================================================*/
+
+/** How much of a range #qtm_clone_verify() found to be shared. */
+
+typedef struct _qtm_clone_verify_t
+{
+  uint64_t shared_bytes;   /**< On the same physical blocks in both files. */
+  uint64_t unshared_bytes; /**< Different blocks, or data in one file only. */
+  uint64_t hole_bytes;     /**< A hole in both files. */
+} qtm_clone_verify_t;
+
+/**
+ * Check that @p length bytes of @p dst_fd at @p dst_offset share their
+ * storage with @p src_fd at @p src_offset, as they do after a successful
+ * reflink, without reading either file.
+ *
+ * The extent maps of both files are fetched with the FS_IOC_FIEMAP ioctl and
+ * walked side by side. A byte is shared if both files map it to the same
+ * physical address. Extents whose address is not known (delayed allocation,
+ * inline or tail-packed data) or does not locate each byte (encoded, e.g.
+ * compressed, data) count as unshared. Both files are flushed by the ioctl
+ * first so that data still in the page cache has been allocated.
+ *
+ * The three counts in @p p_verify always add up to the length verified, so
+ * a clone is complete if @c unshared_bytes is zero.
+ *
+ * @param[in]  src_fd     Source file.
+ * @param[in]  dst_fd     Destination file.
+ * @param[in]  src_offset Offset into @p src_fd of the range.
+ * @param[in]  dst_offset Offset into @p dst_fd of the range.
+ * @param[in]  length     Bytes to verify. Zero verifies to the end of the
+ *                        source, as for FICLONERANGE.
+ * @param[out] p_verify   Receives the byte counts.
+ * @return Zero on success, otherwise an errno value from fstat(2) or
+ *         ioctl(FS_IOC_FIEMAP). @c EOPNOTSUPP if a file system does not
+ *         support FIEMAP, @c EINVAL if @p p_verify is NULL.
+ */
+
+int qtm_clone_verify (const int           src_fd,
+                      const int           dst_fd,
+                      const off_t         src_offset,
+                      const off_t         dst_offset,
+                      const size_t        length,
+                      qtm_clone_verify_t *p_verify);
+
+/*============================================================================*/
+
+/** What #qtm_clone_compare() found comparing two ranges. */
+
+typedef struct _qtm_clone_compare_t
+{
+  bool     equal;           /**< No difference was found. */
+  uint64_t mismatch_offset; /**< Offset into the range of the first byte
+                                 that differs, unless @c equal. */
+  uint64_t shared_bytes;    /**< On the same physical blocks, not read. */
+  uint64_t hole_bytes;      /**< Reading as zeros in both files, not read. */
+  uint64_t read_bytes;      /**< Read and compared. */
+} qtm_clone_compare_t;
+
+/**
+ * Check that @p length bytes of @p dst_fd at @p dst_offset hold the same data
+ * as @p src_fd at @p src_offset, reading as little of either as it can.
+ *
+ * The extent maps of both files are walked as for #qtm_clone_verify().
+ * Ranges that share storage are equal without being read, ranges that are
+ * holes or unwritten extents in both files read as zeros in both, and a
+ * range that reads as zeros in only one file is compared against zeros
+ * without reading that file. Everything else is read with pread(2) in 1 MiB
+ * pieces, on @p num_threads threads, and compared with the widest vector
+ * instructions the CPU supports. Once a difference is found no piece past it
+ * is read, so the counts in @p p_compare then cover less than the range. A
+ * file system that cannot map extents is read in full.
+ *
+ * A range running past the end of either file differs from where that file
+ * ends, as it would for cmp(1).
+ *
+ * @param[in]  src_fd      Source file.
+ * @param[in]  dst_fd      Destination file.
+ * @param[in]  src_offset  Offset into @p src_fd of the range.
+ * @param[in]  dst_offset  Offset into @p dst_fd of the range.
+ * @param[in]  length      Bytes to compare. Zero compares to the end of the
+ *                         source, as for FICLONERANGE.
+ * @param[in]  num_threads Threads to read with, the calling thread being
+ *                         one of them. Zero is taken as one.
+ * @param[out] p_compare   Receives the result and the byte counts.
+ * @return Zero once the range was compared, whether or not it was equal.
+ *         Otherwise an errno value from fstat(2), pread(2) or
+ *         ioctl(FS_IOC_FIEMAP), @c ENOMEM, or @c EINVAL if @p p_compare is
+ *         NULL.
+ */
+
+int qtm_clone_compare (const int            src_fd,
+                       const int            dst_fd,
+                       const off_t          src_offset,
+                       const off_t          dst_offset,
+                       const size_t         length,
+                       const unsigned       num_threads,
+                       qtm_clone_compare_t *p_compare);
+
+/*============================================================================*/
+
+/** What #qtm_clone_plan() expects a clone of one range to do. */
+
+typedef struct _qtm_clone_plan_t
+{
+  uint64_t src_fs_type; /**< @c f_type from statfs(2) of the source. */
+  uint64_t dst_fs_type; /**< @c f_type from statfs(2) of the destination. */
+  bool     same_fs;     /**< Both have the same @c f_fsid. */
+  int      probe_rc;    /**< Zero if the trial reflink worked or none was
+                             needed, otherwise the errno value it failed
+                             with. */
+  uint64_t data_bytes;  /**< Mapped to extents in the source. */
+  uint64_t hole_bytes;  /**< Holes in the source. */
+  uint64_t clone_bytes; /**< Expected to be reflinked. */
+  uint64_t copy_bytes;  /**< Expected to be written by the fallback copy. */
+  uint64_t fail_bytes;  /**< Expected to fail, having no fallback copy. */
+} qtm_clone_plan_t;
+
+/**
+ * Predict what #qtm_clone_file_range_ex() would do with @p length bytes of
+ * @p src_fd at @p src_offset and a new destination in @p dst_dir_fd, without
+ * writing any data.
+ *
+ * Both file systems are looked up with fstatfs(2). Whether a reflink works
+ * is found by trying one, of the first block of the range, into an unnamed
+ * O_TMPFILE in @p dst_dir_fd that disappears when it is closed. This shares
+ * a block rather than writing one, and catches reasons for failure that the
+ * file system type alone does not tell, such as mount options, cross-mount
+ * clones or files marked No_COW. The extent map of the range is read with
+ * the FS_IOC_FIEMAP ioctl, without flushing the source first, to count its
+ * data and holes. A file system that cannot map extents is counted as all
+ * data.
+ *
+ * The range is then split, as a clone would treat it, between
+ * @c clone_bytes, @c copy_bytes and @c fail_bytes, which add up to the length
+ * planned. Holes count towards the method used as the fallback copy writes
+ * them out in full.
+ *
+ * @param[in]  src_fd     Source file.
+ * @param[in]  dst_dir_fd Directory the destination would be created in.
+ * @param[in]  src_offset Offset into @p src_fd of the range.
+ * @param[in]  length     Bytes to plan. Zero plans to the end of the
+ *                        source, as for FICLONERANGE.
+ * @param[in]  p_options  Options the clone would be run with. The
+ *                        @c fallback_copy and @c reflink_threshold fields
+ *                        are used.
+ * @param[out] p_plan     Receives the prediction.
+ * @return Zero on success. @c EINVAL for bad parameters or a range that ends
+ *         past the end of the source, otherwise an errno value. A failed
+ *         probe is not an error; it is reported in @c probe_rc.
+ */
+
+int qtm_clone_plan (const int                  src_fd,
+                    const int                  dst_dir_fd,
+                    const off_t                src_offset,
+                    const size_t               length,
+                    const qtm_clone_options_t *p_options,
+                    qtm_clone_plan_t          *p_plan);
+
+/*============================================================================*/
+
+/**
+ * Make @p length bytes of each of the @p num_dsts files in @p p_dst_fds share
+ * storage with @p src_fd at @p src_offset, where their contents are the same,
+ * with the FIDEDUPERANGE ioctl. Unlike a clone, the file system compares the
+ * data first and leaves a destination alone if it differs, so this is safe
+ * to use on files that may have changed since they were last read.
+ *
+ * The destinations are passed to the file system in as few calls as it
+ * accepts, and a range the file system only partly deduplicates in one call
+ * is continued from where it stopped.
+ *
+ * @param[in]  src_fd        Source file.
+ * @param[in]  src_offset    Offset into @p src_fd of the range.
+ * @param[in]  length        Bytes to deduplicate. Must be larger than zero.
+ * @param[in]  p_dst_fds     Array of @p num_dsts destination files. Open for
+ *                           writing, or owned by the caller on kernels that
+ *                           allow read-only destinations.
+ * @param[in]  p_dst_offsets Array of @p num_dsts offsets into the
+ *                           destinations.
+ * @param[in]  num_dsts      Number of destinations. Must be larger than zero.
+ * @param[out] p_deduped     Receives the total bytes deduplicated over every
+ *                           destination.
+ * @param[out] p_rcs         Array of @p num_dsts receiving the result for
+ *                           each destination: zero, @c EILSEQ if its data
+ *                           differs from the source, @c ECANCELED if the file
+ *                           system stopped making progress, or an errno value
+ *                           from ioctl-fideduperange(2) (e.g. @c EOPNOTSUPP,
+ *                           @c EINVAL for unaligned ranges, @c EPERM).
+ * @return Zero if every destination was deduplicated. Otherwise the first
+ *         non-zero value in @p p_rcs, @c EINVAL for bad parameters or
+ *         @c ENOMEM.
+ */
+
+int qtm_dedupe_file_range (const int    src_fd,
+                           const off_t  src_offset,
+                           const size_t length,
+                           const int   *p_dst_fds,
+                           const off_t *p_dst_offsets,
+                           const size_t num_dsts,
+                           uint64_t    *p_deduped,
+                           int         *p_rcs);
+
+/*============================================================================*/
+
+/**
+ * Asynchronous clone queue.
+ *
+ * A queue owns a pool of worker threads which execute #qtm_clone_file() or
+ * #qtm_clone_file_range() on behalf of the caller. Jobs are submitted with
+ * #qtm_clone_queue_submit() and their results are collected in batches with
+ * #qtm_clone_queue_reap(). The queue provides an eventfd, returned by
+ * #qtm_clone_queue_event_fd(), which becomes readable whenever there are
+ * completed jobs waiting to be reaped, so the queue can be driven from a
+ * poll()/epoll() based event loop without blocking a thread per job.
+ *
+ * The file descriptors in a job remain owned by the caller and must stay open
+ * until the job's result has been reaped. Jobs may share descriptors, as the
+ * fallback copy does not use their file positions.
+ *
+ * @{
+ */
+
+/** Opaque handle to an asynchronous clone queue. */
+
+typedef struct _qtm_clone_queue_t qtm_clone_queue_t;
+
+/** Select which of the clone functions a queued job will invoke. */
+
+typedef enum _qtm_clone_mode_t
+{
+  QTM_CLONE_MODE_FILE,  /**< #qtm_clone_file(). Offsets and length ignored. */
+  QTM_CLONE_MODE_RANGE, /**< #qtm_clone_file_range(). */
+} qtm_clone_mode_t;
+
+/** Description of a single clone job. */
+
+typedef struct _qtm_clone_job_t
+{
+  qtm_clone_mode_t mode;
+  int              src_fd;
+  int              dst_fd;
+  off_t            src_offset;
+  off_t            dst_offset;
+  size_t           length;
+  bool             fallback_copy;
+  size_t           fallback_copy_block_size;
+  void            *p_user_data; /**< Returned untouched in the result. */
+} qtm_clone_job_t;
+
+/** Result of a completed clone job. */
+
+typedef struct _qtm_clone_result_t
+{
+  void             *p_user_data; /**< As supplied in the job. */
+  int               rc;          /**< Return value of the clone function. */
+  qtm_clone_stats_t stats;       /**< As from #qtm_clone_last_stats(). */
+} qtm_clone_result_t;
+
+/**
+ * Create an asynchronous clone queue.
+ *
+ * @param[in] num_workers
+ *   Number of worker threads to start. Must be larger than zero.
+ * @param[in] max_depth
+ *   Maximum number of jobs that may be outstanding (submitted but not yet
+ *   reaped) at any one time. Must be larger than zero.
+ * @param[out] pp_queue
+ *   Receives the new queue on success.
+ * @return
+ *   Zero on success. @c EINVAL for bad parameters, @c ENOMEM if memory could
+ *   not be allocated or some errno value from eventfd(2) or
+ *   pthread_create(3) on failure.
+ */
+
+int qtm_clone_queue_create (const unsigned      num_workers,
+                            const size_t        max_depth,
+                            qtm_clone_queue_t **pp_queue);
+
+/**
+ * Return the completion eventfd of @p p_queue. The descriptor is readable
+ * while there is at least one result waiting to be reaped. It is owned by the
+ * queue and must not be read or closed by the caller.
+ */
+
+int qtm_clone_queue_event_fd (const qtm_clone_queue_t *p_queue);
+
+/**
+ * Submit a job to @p p_queue. Never blocks.
+ *
+ * @param[in] p_queue Queue to submit to.
+ * @param[in] p_job   Job to run. Copied; need not outlive the call.
+ * @return
+ *   Zero on success. @c EAGAIN if the queue already has @c max_depth
+ *   outstanding jobs. @c EINVAL for bad parameters. @c ESHUTDOWN if the
+ *   queue is being destroyed.
+ */
+
+int qtm_clone_queue_submit (qtm_clone_queue_t     *p_queue,
+                            const qtm_clone_job_t *p_job);
+
+/**
+ * Collect up to @p max_results completed jobs from @p p_queue. Never blocks;
+ * wait for the event fd to become readable to know when to call it.
+ *
+ * @param[in]  p_queue      Queue to reap from.
+ * @param[out] p_results    Array receiving the results.
+ * @param[in]  max_results  Number of elements in @p p_results.
+ * @param[out] p_num_reaped Receives the number of results stored.
+ * @return Zero on success, @c EINVAL for bad parameters.
+ */
+
+int qtm_clone_queue_reap (qtm_clone_queue_t  *p_queue,
+                          qtm_clone_result_t *p_results,
+                          const size_t        max_results,
+                          size_t             *p_num_reaped);
+
+/**
+ * Destroy @p p_queue. Blocks until every job submitted so far has run, then
+ * stops the workers and releases all resources including the event fd.
+ * Results that were not reaped are discarded.
+ *
+ * @return Zero on success, @c EINVAL if @p p_queue is NULL.
+ */
+
+int qtm_clone_queue_destroy (qtm_clone_queue_t *p_queue);
+
+/** @} */
+
+/*============================================================================*/
+
+/**
+ * Limit the rate of fallback copy I/O for the whole process.
+ *
+ * The limit is a pair of token buckets shared by every libcpr call in the
+ * process, including those made by clone queue workers, so concurrent copies
+ * divide the allowance between them. Each pread(2) by a fallback copy
+ * consumes the bytes it read plus one operation, and each pwrite(2) consumes
+ * one operation. They are charged once they succeed, so calls interrupted by
+ * a signal and retried are not charged twice. A call that overdraws a bucket
+ * sleeps until the bucket has refilled. Clone ioctls are never throttled.
+ *
+ * @param[in] bytes_per_sec Sustained byte rate. Zero for no byte limit.
+ * @param[in] ops_per_sec   Sustained operation rate. Zero for no op limit.
+ * @param[in] burst_bytes   Bytes that may be consumed at once after an idle
+ *                          period. Zero for one second's worth.
+ * @param[in] burst_ops     Operations that may be issued at once after an
+ *                          idle period. Zero for one second's worth.
+ * @return Zero on success.
+ */
+
+int qtm_set_throttle (const uint64_t bytes_per_sec,
+                      const uint64_t ops_per_sec,
+                      const uint64_t burst_bytes,
+                      const uint64_t burst_ops);
+
+/*============================================================================*/
+
+/**
+ * Tracing hooks.
+ *
+ * A single process-wide callback may be registered with #qtm_set_trace_hook().
+ * While one is registered, every system call libcpr makes on a caller's file
+ * descriptor while cloning or copying is timed and reported to it once the
+ * call returns. While no hook is registered the only cost is a test of a
+ * pointer before each system call.
+ *
+ * The callback runs synchronously on the thread that made the system call,
+ * which may be a clone queue worker. It must be thread-safe if the library is
+ * used from more than one thread and should return quickly as it sits in the
+ * copy loop.
+ *
+ * @{
+ */
+
+/** System call that a trace event describes. */
+
+typedef enum _qtm_trace_op_t
+{
+  QTM_TRACE_OP_FICLONE,       /**< ioctl(FICLONE). */
+  QTM_TRACE_OP_FICLONERANGE,  /**< ioctl(FICLONERANGE). */
+  QTM_TRACE_OP_READ,          /**< pread(2). */
+  QTM_TRACE_OP_WRITE,         /**< pwrite(2). */
+  QTM_TRACE_OP_FIEMAP,        /**< ioctl(FS_IOC_FIEMAP). */
+  QTM_TRACE_OP_FIDEDUPERANGE, /**< ioctl(FIDEDUPERANGE). */
+} qtm_trace_op_t;
+
+/** A single traced system call. */
+
+typedef struct _qtm_trace_event_t
+{
+  qtm_trace_op_t op;
+  int            fd;       /**< Descriptor operated on (dst for clones). */
+  int            src_fd;   /**< Clone source descriptor, otherwise -1. */
+  off_t          offset;   /**< File offset the call operated at. */
+  size_t         length;   /**< Bytes requested. Zero for FICLONE. */
+  ssize_t        result;   /**< System call return value. */
+  int            error;    /**< errno if @c result was -1, otherwise 0. */
+  uint64_t       start_ns; /**< CLOCK_MONOTONIC time the call was made. */
+  uint64_t       end_ns;   /**< CLOCK_MONOTONIC time the call returned. */
+} qtm_trace_event_t;
+
+/**
+ * Trace callback.
+ *
+ * @param[in] p_event     Event. Only valid for the duration of the call.
+ * @param[in] p_user_data As passed to #qtm_set_trace_hook().
+ */
+
+typedef void (*qtm_trace_fn_t) (const qtm_trace_event_t *p_event,
+                                void                    *p_user_data);
+
+/**
+ * Register @p trace_fn to receive trace events, or pass NULL to disable
+ * tracing.
+ *
+ * @note The hook should only be changed while no other libcpr call is in
+ *       progress, otherwise an in-flight call may deliver an event to the
+ *       previous hook, though always with that hook's own @p p_user_data.
+ *
+ * @param[in] trace_fn    Callback, or NULL.
+ * @param[in] p_user_data Passed to every invocation of @p trace_fn.
+ */
+
+void qtm_set_trace_hook (qtm_trace_fn_t trace_fn, void *p_user_data);
+
+/** @} */
+
+/*============================================================================*/
+
+/**
+ * Clone daemon.
+ *
+ * #qtm_clone_serve() turns the calling process into a long-running clone
+ * server: it listens on a Unix domain socket, receives the source and
+ * destination descriptors of each request with SCM_RIGHTS and runs the clone
+ * on a clone queue whose worker threads, and their copy buffers, stay warm
+ * between requests. Callers use #qtm_clone_connect() once and then
+ * #qtm_clone_remote() per clone, replacing a fork/exec of cpr per file.
+ *
+ * The descriptors are duplicated into the daemon, so the daemon must be able
+ * to use the files with the access the caller opened them with. As for a
+ * local call, the fallback copy leaves their file positions alone.
+ *
+ * @{
+ */
+
+/**
+ * Serve clone requests on @p p_socket_path until @p stop_fd becomes readable.
+ * Requests already received when it does are completed and answered before
+ * returning. The socket is removed on return.
+ *
+ * @param[in] p_socket_path Path to bind. A stale socket left by a daemon that
+ *                          is no longer running is replaced.
+ * @param[in] num_workers   Worker threads. Must be larger than zero.
+ * @param[in] max_depth     Requests being worked on at once. Further requests
+ *                          wait in the clients' sockets. Must be larger than
+ *                          zero.
+ * @param[in] stop_fd       Descriptor to poll for shutdown, e.g. a signalfd.
+ * @return Zero after a clean shutdown, or some errno value if the daemon
+ *         could not start or the event loop failed. @c EADDRINUSE if another
+ *         daemon is listening on @p p_socket_path.
+ */
+
+int qtm_clone_serve (const char    *p_socket_path,
+                     const unsigned num_workers,
+                     const size_t   max_depth,
+                     const int      stop_fd);
+
+/**
+ * Connect to a daemon listening on @p p_socket_path.
+ *
+ * @param[in]  p_socket_path Path the daemon is serving.
+ * @param[out] p_sock_fd     Receives the connection. Close it with close(2).
+ * @return Zero on success, some errno value from socket(2) or connect(2) on
+ *         failure.
+ */
+
+int qtm_clone_connect (const char *p_socket_path, int *p_sock_fd);
+
+/**
+ * Have the daemon on @p sock_fd run @p p_job and wait for the result. Only one
+ * call may be in progress on a connection at a time; open one connection per
+ * thread for concurrency.
+ *
+ * @param[in]  sock_fd  From #qtm_clone_connect().
+ * @param[in]  p_job    Clone to run, as for #qtm_clone_queue_submit().
+ * @param[out] p_result Receives the clone's return value and statistics.
+ * @return Zero if the request was run, in which case the clone's own result
+ *         is in @p p_result. Otherwise an errno value for the transport
+ *         (e.g. @c ECONNRESET if the daemon went away, @c EPROTO for a
+ *         malformed reply).
+ */
+
+int qtm_clone_remote (const int              sock_fd,
+                      const qtm_clone_job_t *p_job,
+                      qtm_clone_result_t    *p_result);
+
+/** @} */
+
+/*============================================================================*/
+
 #ifdef __cplusplus
 }
 #endif
 
+#endif /* LIBCPR_H */
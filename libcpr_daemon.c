@@ -0,0 +1,794 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, clone daemon and client.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The socket is SOCK_SEQPACKET so that every request is one message carrying
+ * exactly its own two descriptors. A request is a daemon_request_t with the
+ * source and destination descriptors attached as SCM_RIGHTS, in that order;
+ * the reply is a daemon_response_t echoing the request's tag.
+ *
+ * The daemon is a single poll(2) loop over the stop descriptor, the listening
+ * socket, the clone queue's eventfd and the clients. Clones run on the queue's
+ * workers. Once @c max_depth requests are outstanding the loop stops reading
+ * from clients, so back-pressure is applied through their socket buffers
+ * rather than by failing requests. Replies are sent without blocking; a
+ * client that does not read its replies is disconnected.
+ *
+ * A client that disconnects with requests outstanding is kept until their
+ * results have been reaped, since the queue still refers to it.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+#define DAEMON_REQUEST_MAGIC  UINT32_C(0x43505271) /* "CPRq" */
+#define DAEMON_RESPONSE_MAGIC UINT32_C(0x43505273) /* "CPRs" */
+
+/** Results reaped from the queue per pass of the event loop. */
+
+#define DAEMON_REAP_BATCH 64
+
+/*============================================================================*/
+
+/** A clone request as sent over the socket. */
+
+typedef struct _daemon_request_t
+{
+  uint32_t magic;
+  uint32_t mode;          /**< qtm_clone_mode_t. */
+  uint64_t tag;           /**< Echoed in the response. */
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  uint64_t block_size;
+  uint32_t fallback_copy;
+  uint32_t reserved;
+} daemon_request_t;
+
+/** The reply to a daemon_request_t. */
+
+typedef struct _daemon_response_t
+{
+  uint32_t magic;
+  int32_t  rc;
+  uint64_t tag;
+  uint32_t method;        /**< qtm_clone_method_t. */
+  uint32_t reserved;
+  uint64_t bytes_copied;
+  uint64_t elapsed_ns;
+} daemon_response_t;
+
+/** A connected client. */
+
+typedef struct _daemon_client_t
+{
+  int    fd;          /**< -1 once disconnected. */
+  size_t outstanding; /**< Requests on the queue. */
+} daemon_client_t;
+
+/** A request on the queue, passed as the job's user data. */
+
+typedef struct _daemon_job_t
+{
+  daemon_client_t *p_client;
+  uint64_t         tag;
+  int              src_fd;
+  int              dst_fd;
+} daemon_job_t;
+
+/** State of the event loop. */
+
+typedef struct _daemon_t
+{
+  qtm_clone_queue_t *p_queue;
+  size_t             max_depth;
+  size_t             outstanding;
+  daemon_client_t  **pp_clients;
+  size_t             num_clients;
+  size_t             max_clients;
+  struct pollfd     *p_pollfds;
+} daemon_t;
+
+/*============================================================================*/
+
+/**
+ * Fill in @p p_addr for @p p_socket_path.
+ *
+ * @return Zero on success, @c ENAMETOOLONG if the path does not fit.
+ */
+
+static int socket_addr (const char *p_socket_path, struct sockaddr_un *p_addr)
+{
+  memset(p_addr, 0, sizeof(*p_addr));
+  p_addr->sun_family = AF_UNIX;
+
+  if (strlen(p_socket_path) >= sizeof(p_addr->sun_path))
+  {
+    return ENAMETOOLONG;
+  }
+
+  strcpy(p_addr->sun_path, p_socket_path);
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Create the listening socket, replacing a stale socket file if no daemon is
+ * listening on it any more.
+ */
+
+static int daemon_listen (const char *p_socket_path, int *p_listen_fd)
+{
+  struct sockaddr_un addr;
+  int                rc = socket_addr(p_socket_path, &addr);
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+
+  if (fd < 0)
+  {
+    return errno;
+  }
+
+  rc = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+
+  if (rc != 0 && errno == EADDRINUSE)
+  {
+    int probe_fd = -1;
+
+    rc = qtm_clone_connect(p_socket_path, &probe_fd);
+
+    if (rc == 0)
+    {
+      close(probe_fd);
+      close(fd);
+      return EADDRINUSE;
+    }
+    else if (rc == ECONNREFUSED)
+    {
+      unlink(p_socket_path);
+      rc = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+  }
+
+  if (rc == 0)
+  {
+    rc = listen(fd, SOMAXCONN);
+  }
+
+  if (rc != 0)
+  {
+    rc = errno;
+    close(fd);
+    return rc;
+  }
+
+  *p_listen_fd = fd;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Send the reply for @p tag. Disconnects the client if it cannot take it.
+ */
+
+static void daemon_reply (daemon_client_t         *p_client,
+                          const uint64_t           tag,
+                          const int                rc,
+                          const qtm_clone_stats_t *p_stats)
+{
+  if (p_client->fd < 0)
+  {
+    return;
+  }
+
+  const daemon_response_t response =
+  {
+    .magic        = DAEMON_RESPONSE_MAGIC,
+    .rc           = rc,
+    .tag          = tag,
+    .method       = (p_stats != NULL) ? p_stats->method
+                                      : QTM_CLONE_METHOD_NONE,
+    .reserved     = 0,
+    .bytes_copied = (p_stats != NULL) ? p_stats->bytes_copied : 0,
+    .elapsed_ns   = (p_stats != NULL) ? p_stats->elapsed_ns : 0
+  };
+
+  if (send(p_client->fd, &response, sizeof(response),
+           MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(response))
+  {
+    close(p_client->fd);
+    p_client->fd = -1;
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Receive and submit one request from @p p_client.
+ *
+ * @return False if there was nothing to read.
+ */
+
+static bool daemon_receive (daemon_t *p_daemon, daemon_client_t *p_client)
+{
+  /* Zeroed so that a short message is refused with tag zero rather than
+   * whatever the stack held. */
+  daemon_request_t request = { 0 };
+  union
+  {
+    struct cmsghdr header;
+    uint8_t        space[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+
+  struct iovec  iov = { .iov_base = &request, .iov_len = sizeof(request) };
+  struct msghdr msg =
+  {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control.space,
+    .msg_controllen = sizeof(control.space)
+  };
+
+  const ssize_t got = recvmsg(p_client->fd, &msg,
+                              MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+  if (got < 0 && (errno == EAGAIN || errno == EINTR))
+  {
+    return false;
+  }
+  else if (got <= 0)
+  {
+    close(p_client->fd);
+    p_client->fd = -1;
+    return false;
+  }
+
+  int              fds[2]  = { -1, -1 };
+  size_t           num_fds = 0;
+  struct cmsghdr  *p_cmsg  = CMSG_FIRSTHDR(&msg);
+
+  for (; p_cmsg != NULL; p_cmsg = CMSG_NXTHDR(&msg, p_cmsg))
+  {
+    if (p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      const size_t n = (p_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (size_t i = 0; i < n; i++)
+      {
+        int fd;
+
+        memcpy(&fd, CMSG_DATA(p_cmsg) + i * sizeof(int), sizeof(int));
+
+        if (num_fds < 2)
+        {
+          fds[num_fds] = fd;
+        }
+        else
+        {
+          close(fd);
+        }
+
+        num_fds++;
+      }
+    }
+  }
+
+  int rc = 0;
+
+  if (got != (ssize_t)sizeof(request))
+  {
+    request.tag = 0;
+    rc          = EINVAL;
+  }
+  else if (request.magic != DAEMON_REQUEST_MAGIC || num_fds != 2 ||
+           (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+  {
+    rc = EINVAL;
+  }
+
+  daemon_job_t *p_job = NULL;
+
+  if (rc == 0)
+  {
+    p_job = malloc(sizeof(*p_job));
+    rc    = (p_job != NULL) ? 0 : ENOMEM;
+  }
+
+  if (rc == 0)
+  {
+    *p_job = (daemon_job_t)
+    {
+      .p_client = p_client,
+      .tag      = request.tag,
+      .src_fd   = fds[0],
+      .dst_fd   = fds[1]
+    };
+
+    const qtm_clone_job_t job =
+    {
+      .mode                     = (qtm_clone_mode_t)request.mode,
+      .src_fd                   = fds[0],
+      .dst_fd                   = fds[1],
+      .src_offset               = (off_t)request.src_offset,
+      .dst_offset               = (off_t)request.dst_offset,
+      .length                   = (size_t)request.length,
+      .fallback_copy            = (request.fallback_copy != 0),
+      .fallback_copy_block_size = (size_t)request.block_size,
+      .p_user_data              = p_job
+    };
+
+    rc = qtm_clone_queue_submit(p_daemon->p_queue, &job);
+  }
+
+  if (rc == 0)
+  {
+    p_client->outstanding++;
+    p_daemon->outstanding++;
+  }
+  else
+  {
+    daemon_reply(p_client, request.tag, rc, NULL);
+
+    for (size_t i = 0; i < 2; i++)
+    {
+      if (fds[i] >= 0)
+      {
+        close(fds[i]);
+      }
+    }
+
+    free(p_job);
+  }
+
+  return true;
+}
+
+/*============================================================================*/
+
+/**
+ * Reply to every completed request.
+ */
+
+static void daemon_reap (daemon_t *p_daemon)
+{
+  qtm_clone_result_t results[DAEMON_REAP_BATCH];
+  size_t             num_reaped = 0;
+
+  do
+  {
+    qtm_clone_queue_reap(p_daemon->p_queue, results, DAEMON_REAP_BATCH,
+                         &num_reaped);
+
+    for (size_t i = 0; i < num_reaped; i++)
+    {
+      daemon_job_t *p_job = results[i].p_user_data;
+
+      close(p_job->src_fd);
+      close(p_job->dst_fd);
+
+      daemon_reply(p_job->p_client, p_job->tag, results[i].rc,
+                   &results[i].stats);
+
+      p_job->p_client->outstanding--;
+      p_daemon->outstanding--;
+      free(p_job);
+    }
+  } while (num_reaped == DAEMON_REAP_BATCH);
+}
+
+/*============================================================================*/
+
+/**
+ * Accept every pending connection on @p listen_fd.
+ */
+
+static void daemon_accept (daemon_t *p_daemon, const int listen_fd)
+{
+  for (;;)
+  {
+    const int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+      /* EAGAIN once drained. Anything else (e.g. EMFILE) is retried on the
+       * next pass, after some requests have completed and freed descriptors.
+       */
+      return;
+    }
+
+    daemon_client_t *p_client = malloc(sizeof(*p_client));
+
+    if (p_daemon->num_clients == p_daemon->max_clients)
+    {
+      const size_t max_clients = (p_daemon->max_clients == 0)
+                                 ? 16 : p_daemon->max_clients * 2;
+      void        *p_clients   = realloc(p_daemon->pp_clients,
+                                         max_clients * sizeof(void *));
+      void        *p_pollfds   = realloc(p_daemon->p_pollfds,
+                                         (max_clients + 3) *
+                                         sizeof(struct pollfd));
+
+      if (p_clients != NULL)
+      {
+        p_daemon->pp_clients = p_clients;
+      }
+
+      if (p_pollfds != NULL)
+      {
+        p_daemon->p_pollfds = p_pollfds;
+      }
+
+      if (p_clients != NULL && p_pollfds != NULL)
+      {
+        p_daemon->max_clients = max_clients;
+      }
+    }
+
+    if (p_client == NULL || p_daemon->num_clients == p_daemon->max_clients)
+    {
+      free(p_client);
+      close(fd);
+      continue;
+    }
+
+    p_client->fd          = fd;
+    p_client->outstanding = 0;
+
+    p_daemon->pp_clients[p_daemon->num_clients++] = p_client;
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Free clients that have disconnected and have nothing outstanding.
+ */
+
+static void daemon_prune (daemon_t *p_daemon)
+{
+  size_t kept = 0;
+
+  for (size_t i = 0; i < p_daemon->num_clients; i++)
+  {
+    daemon_client_t *p_client = p_daemon->pp_clients[i];
+
+    if (p_client->fd < 0 && p_client->outstanding == 0)
+    {
+      free(p_client);
+    }
+    else
+    {
+      p_daemon->pp_clients[kept++] = p_client;
+    }
+  }
+
+  p_daemon->num_clients = kept;
+}
+
+/*============================================================================*/
+
+int qtm_clone_serve (const char    *p_socket_path,
+                     const unsigned num_workers,
+                     const size_t   max_depth,
+                     const int      stop_fd)
+{
+  if (p_socket_path == NULL || num_workers == 0 || max_depth == 0 ||
+      stop_fd < 0)
+  {
+    return EINVAL;
+  }
+
+  daemon_t daemon =
+  {
+    .p_queue     = NULL,
+    .max_depth   = max_depth,
+    .outstanding = 0,
+    .pp_clients  = NULL,
+    .num_clients = 0,
+    .max_clients = 0,
+    .p_pollfds   = malloc(3 * sizeof(struct pollfd))
+  };
+
+  if (daemon.p_pollfds == NULL)
+  {
+    return ENOMEM;
+  }
+
+  int rc = qtm_clone_queue_create(num_workers, max_depth, &daemon.p_queue);
+
+  if (rc != 0)
+  {
+    free(daemon.p_pollfds);
+    return rc;
+  }
+
+  int listen_fd = -1;
+
+  rc = daemon_listen(p_socket_path, &listen_fd);
+
+  if (rc != 0)
+  {
+    qtm_clone_queue_destroy(daemon.p_queue);
+    free(daemon.p_pollfds);
+    return rc;
+  }
+
+  const int event_fd = qtm_clone_queue_event_fd(daemon.p_queue);
+  bool      stopping = false;
+
+  /* Once stopping, no new connections or requests are taken and the loop
+   * runs until the outstanding requests have been answered.
+   */
+  while (!stopping || daemon.outstanding > 0)
+  {
+    const bool     accepting = !stopping &&
+                               daemon.outstanding < daemon.max_depth;
+    struct pollfd *p_fds     = daemon.p_pollfds;
+
+    /* Descriptors that are not to be waited on are set to -1 rather than
+     * given no events, so that a hang-up on them cannot wake the loop.
+     */
+    p_fds[0] = (struct pollfd){ .fd = stopping ? -1 : stop_fd,
+                                .events = POLLIN };
+    p_fds[1] = (struct pollfd){ .fd = event_fd, .events = POLLIN };
+    p_fds[2] = (struct pollfd){ .fd = stopping ? -1 : listen_fd,
+                                .events = POLLIN };
+
+    for (size_t i = 0; i < daemon.num_clients; i++)
+    {
+      p_fds[3 + i] = (struct pollfd)
+      {
+        .fd     = accepting ? daemon.pp_clients[i]->fd : -1,
+        .events = POLLIN
+      };
+    }
+
+    if (poll(p_fds, 3 + daemon.num_clients, -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      rc = errno;
+      break;
+    }
+
+    if (p_fds[0].revents != 0)
+    {
+      stopping = true;
+    }
+
+    if (p_fds[1].revents != 0)
+    {
+      daemon_reap(&daemon);
+    }
+
+    for (size_t i = 0; i < daemon.num_clients; i++)
+    {
+      daemon_client_t *p_client = daemon.pp_clients[i];
+
+      /* Drain each ready client while there is room on the queue. */
+      while (!stopping && p_fds[3 + i].revents != 0 && p_client->fd >= 0 &&
+             daemon.outstanding < daemon.max_depth &&
+             daemon_receive(&daemon, p_client))
+      {
+      }
+    }
+
+    if (p_fds[2].revents != 0)
+    {
+      daemon_accept(&daemon, listen_fd);
+    }
+
+    daemon_prune(&daemon);
+  }
+
+  close(listen_fd);
+  unlink(p_socket_path);
+
+  /* With nothing outstanding this only stops the workers. If the loop failed
+   * it waits for the running clones, whose replies are then lost.
+   */
+  qtm_clone_queue_destroy(daemon.p_queue);
+
+  for (size_t i = 0; i < daemon.num_clients; i++)
+  {
+    if (daemon.pp_clients[i]->fd >= 0)
+    {
+      close(daemon.pp_clients[i]->fd);
+    }
+
+    free(daemon.pp_clients[i]);
+  }
+
+  free(daemon.pp_clients);
+  free(daemon.p_pollfds);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int qtm_clone_connect (const char *p_socket_path, int *p_sock_fd)
+{
+  if (p_socket_path == NULL || p_sock_fd == NULL)
+  {
+    return EINVAL;
+  }
+
+  struct sockaddr_un addr;
+  int                rc = socket_addr(p_socket_path, &addr);
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+  {
+    return errno;
+  }
+
+  if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    rc = errno;
+    close(fd);
+    return rc;
+  }
+
+  *p_sock_fd = fd;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+int qtm_clone_remote (const int              sock_fd,
+                      const qtm_clone_job_t *p_job,
+                      qtm_clone_result_t    *p_result)
+{
+  if (sock_fd < 0 || p_job == NULL || p_result == NULL ||
+      p_job->src_fd < 0 || p_job->dst_fd < 0)
+  {
+    return EINVAL;
+  }
+
+  static atomic_uint_fast64_t next_tag = 1;
+
+  const daemon_request_t request =
+  {
+    .magic         = DAEMON_REQUEST_MAGIC,
+    .mode          = (uint32_t)p_job->mode,
+    .tag           = atomic_fetch_add(&next_tag, 1),
+    .src_offset    = (uint64_t)p_job->src_offset,
+    .dst_offset    = (uint64_t)p_job->dst_offset,
+    .length        = p_job->length,
+    .block_size    = p_job->fallback_copy_block_size,
+    .fallback_copy = p_job->fallback_copy,
+    .reserved      = 0
+  };
+
+  union
+  {
+    struct cmsghdr header;
+    uint8_t        space[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+
+  memset(&control, 0, sizeof(control));
+
+  struct iovec  iov = { .iov_base = (void *)&request,
+                        .iov_len  = sizeof(request) };
+  struct msghdr msg =
+  {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control.space,
+    .msg_controllen = sizeof(control.space)
+  };
+
+  struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&msg);
+  const int       fds[2] = { p_job->src_fd, p_job->dst_fd };
+
+  p_cmsg->cmsg_level = SOL_SOCKET;
+  p_cmsg->cmsg_type  = SCM_RIGHTS;
+  p_cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(p_cmsg), fds, sizeof(fds));
+
+  ssize_t rc = 0;
+
+  do
+  {
+    rc = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc < 0)
+  {
+    return errno;
+  }
+
+  daemon_response_t response;
+
+  do
+  {
+    rc = recv(sock_fd, &response, sizeof(response), 0);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc < 0)
+  {
+    return errno;
+  }
+  else if (rc == 0)
+  {
+    return ECONNRESET;
+  }
+  else if (rc != (ssize_t)sizeof(response) ||
+           response.magic != DAEMON_RESPONSE_MAGIC ||
+           response.tag != request.tag)
+  {
+    return EPROTO;
+  }
+
+  *p_result = (qtm_clone_result_t)
+  {
+    .p_user_data = p_job->p_user_data,
+    .rc          = response.rc,
+    .stats       =
+    {
+      .method       = (qtm_clone_method_t)response.method,
+      .bytes_copied = response.bytes_copied,
+      .elapsed_ns   = response.elapsed_ns
+    }
+  };
+
+  return 0;
+}
+
+/*============================================================================*/
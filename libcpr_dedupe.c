@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, batched deduplication.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The kernel caps the argument of FIDEDUPERANGE at one page, which limits
+ * the destinations per call, and file systems may deduplicate less than was
+ * asked for (BTRFS stops at 16 MiB). Destinations therefore go in groups of
+ * at most DEDUPE_MAX_DSTS, each group walks the range in rounds of
+ * DEDUPE_ROUND bytes, and only the destinations that have kept up take part
+ * in the next round. Any that fell behind are finished one at a time.
+ */
+
+#include "libcpr_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+/*============================================================================*/
+
+/** Destinations per FIDEDUPERANGE call, keeping the argument within a page. */
+
+#define DEDUPE_MAX_DSTS ((4096 - sizeof(struct file_dedupe_range)) / \
+                         sizeof(struct file_dedupe_range_info))
+
+/** Bytes requested per FIDEDUPERANGE call. */
+
+#define DEDUPE_ROUND ((uint64_t)16 << 20)
+
+/*============================================================================*/
+
+/**
+ * Issue one FIDEDUPERANGE for the destinations in @p p_indices and record the
+ * outcome of each in @p p_done and @p p_rcs.
+ */
+
+static void dedupe_round (const int                 src_fd,
+                          const uint64_t            pos,
+                          const uint64_t            length,
+                          const int                *p_dst_fds,
+                          const off_t              *p_dst_offsets,
+                          const size_t             *p_indices,
+                          const size_t              num_indices,
+                          struct file_dedupe_range *p_range,
+                          uint64_t                 *p_done,
+                          uint64_t                 *p_deduped,
+                          int                      *p_rcs)
+{
+  p_range->src_offset = pos;
+  p_range->src_length = length;
+  p_range->dest_count = num_indices;
+  p_range->reserved1  = 0;
+  p_range->reserved2  = 0;
+
+  for (size_t i = 0; i < num_indices; i++)
+  {
+    const size_t d = p_indices[i];
+
+    p_range->info[i] = (struct file_dedupe_range_info)
+    {
+      .dest_fd     = p_dst_fds[d],
+      .dest_offset = p_dst_offsets[d] + p_done[d]
+    };
+  }
+
+  if (cpr_sys_fideduperange(src_fd, p_range) != 0)
+  {
+    const int rc = errno;
+
+    for (size_t i = 0; i < num_indices; i++)
+    {
+      p_rcs[p_indices[i]] = rc;
+    }
+
+    return;
+  }
+
+  for (size_t i = 0; i < num_indices; i++)
+  {
+    const size_t                         d      = p_indices[i];
+    const struct file_dedupe_range_info *p_info = &p_range->info[i];
+
+    if (p_info->status < 0)
+    {
+      p_rcs[d] = -p_info->status;
+    }
+    else if (p_info->status == FILE_DEDUPE_RANGE_DIFFERS)
+    {
+      p_rcs[d] = EILSEQ;
+    }
+    else if (p_info->bytes_deduped == 0)
+    {
+      p_rcs[d] = ECANCELED;
+    }
+    else
+    {
+      p_done[d]  += p_info->bytes_deduped;
+      *p_deduped += p_info->bytes_deduped;
+    }
+  }
+}
+
+/*============================================================================*/
+
+int qtm_dedupe_file_range (const int    src_fd,
+                           const off_t  src_offset,
+                           const size_t length,
+                           const int   *p_dst_fds,
+                           const off_t *p_dst_offsets,
+                           const size_t num_dsts,
+                           uint64_t    *p_deduped,
+                           int         *p_rcs)
+{
+  if (src_fd < 0 || src_offset < 0 || length == 0 || p_dst_fds == NULL ||
+      p_dst_offsets == NULL || num_dsts == 0 || p_deduped == NULL ||
+      p_rcs == NULL)
+  {
+    return EINVAL;
+  }
+
+  *p_deduped = 0;
+
+  for (size_t d = 0; d < num_dsts; d++)
+  {
+    p_rcs[d] = (p_dst_fds[d] < 0 || p_dst_offsets[d] < 0) ? EINVAL : 0;
+  }
+
+  struct file_dedupe_range *p_range =
+    malloc(sizeof(*p_range) +
+           DEDUPE_MAX_DSTS * sizeof(struct file_dedupe_range_info));
+  uint64_t                 *p_done  = calloc(num_dsts, sizeof(*p_done));
+  size_t                   *p_idx   = malloc(DEDUPE_MAX_DSTS * sizeof(*p_idx));
+
+  if (p_range == NULL || p_done == NULL || p_idx == NULL)
+  {
+    free(p_idx);
+    free(p_done);
+    free(p_range);
+    return ENOMEM;
+  }
+
+  for (size_t first = 0; first < num_dsts; first += DEDUPE_MAX_DSTS)
+  {
+    const size_t last = MIN(first + DEDUPE_MAX_DSTS, num_dsts);
+
+    /* Lock-step rounds for the destinations that keep up. */
+    for (uint64_t pos = 0; pos < length; pos += DEDUPE_ROUND)
+    {
+      size_t num_idx = 0;
+
+      for (size_t d = first; d < last; d++)
+      {
+        if (p_rcs[d] == 0 && p_done[d] == pos)
+        {
+          p_idx[num_idx++] = d;
+        }
+      }
+
+      if (num_idx == 0)
+      {
+        break;
+      }
+
+      dedupe_round(src_fd, src_offset + pos, MIN(DEDUPE_ROUND, length - pos),
+                   p_dst_fds, p_dst_offsets, p_idx, num_idx, p_range, p_done,
+                   p_deduped, p_rcs);
+    }
+
+    /* Stragglers carry on from wherever they stopped. */
+    for (size_t d = first; d < last; d++)
+    {
+      while (p_rcs[d] == 0 && p_done[d] < length)
+      {
+        dedupe_round(src_fd, src_offset + p_done[d],
+                     MIN(DEDUPE_ROUND, length - p_done[d]), p_dst_fds,
+                     p_dst_offsets, &d, 1, p_range, p_done, p_deduped, p_rcs);
+      }
+    }
+  }
+
+  free(p_idx);
+  free(p_done);
+  free(p_range);
+
+  for (size_t d = 0; d < num_dsts; d++)
+  {
+    if (p_rcs[d] != 0)
+    {
+      return p_rcs[d];
+    }
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
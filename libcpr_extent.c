@@ -0,0 +1,571 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, physical-order copy.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The whole extent map of the range is read up front, clipped to the range,
+ * and the gaps between extents are zeroed in the destination while the map
+ * is still in file order. The extents are then sorted by physical address
+ * and each one is copied front to back in blocks, so the source is read in a
+ * single sweep however fragmented it is. The destination is written in the
+ * same scattered order, which costs little as its blocks are newly allocated
+ * or already cached.
+ *
+ * To preserve sharing, the sorted extents are swept keeping the one that
+ * reaches furthest so far. Any part of a later extent that falls inside it
+ * repeats data already met, and becomes a clone within the destination from
+ * where that data lands; the rest is data met for the first time and is
+ * copied as before. All the copies go first, then the clones in the order
+ * found, so each clone's own source is complete by the time it is used even
+ * if that was itself cloned.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*============================================================================*/
+
+/** Extents fetched per FIEMAP call. */
+
+#define EXTENT_BATCH 256
+
+/*============================================================================*/
+
+/** One extent of the source, clipped to the range being copied. */
+
+typedef struct _extent_run_t
+{
+  uint64_t logical;  /**< Offset into the source file. */
+  uint64_t physical;
+  uint64_t length;
+} extent_run_t;
+
+/** A range of the source repeating data met earlier at @c from. */
+
+typedef struct _extent_clone_t
+{
+  uint64_t from;   /**< Offset into the source of the first occurrence. */
+  uint64_t to;     /**< Offset into the source of the repeat. */
+  uint64_t length;
+} extent_clone_t;
+
+/*============================================================================*/
+
+/**
+ * qsort() comparison ordering runs by physical address.
+ */
+
+static int compare_physical (const void *p_a, const void *p_b)
+{
+  const extent_run_t *p_run_a = p_a;
+  const extent_run_t *p_run_b = p_b;
+
+  return (p_run_a->physical > p_run_b->physical) -
+         (p_run_a->physical < p_run_b->physical);
+}
+
+/*============================================================================*/
+
+/**
+ * Read the extents of @p src_fd that overlap [@p start, @p end) into a new
+ * array, in file order and clipped to the range.
+ *
+ * @return Zero on success. @c EOPNOTSUPP if any extent has no usable
+ *         physical address, otherwise an errno value.
+ */
+
+static int map_source (const int      src_fd,
+                       const uint64_t start,
+                       const uint64_t end,
+                       extent_run_t **pp_runs,
+                       size_t        *p_num_runs)
+{
+  const size_t   map_size = sizeof(struct fiemap) +
+                            EXTENT_BATCH * sizeof(struct fiemap_extent);
+  struct fiemap *p_map    = calloc(1, map_size);
+  extent_run_t  *p_runs   = NULL;
+  size_t         num_runs = 0;
+  size_t         max_runs = 0;
+  uint64_t       pos      = start;
+  int            rc       = (p_map == NULL) ? ENOMEM : 0;
+
+  while (rc == 0 && pos < end)
+  {
+    p_map->fm_start        = pos;
+    p_map->fm_length       = end - pos;
+    p_map->fm_flags        = FIEMAP_FLAG_SYNC;
+    p_map->fm_extent_count = EXTENT_BATCH;
+
+    if (cpr_sys_fiemap(src_fd, p_map) != 0)
+    {
+      rc = errno;
+      break;
+    }
+
+    const unsigned mapped = p_map->fm_mapped_extents;
+
+    for (unsigned i = 0; rc == 0 && i < mapped; i++)
+    {
+      const struct fiemap_extent *p_extent = &p_map->fm_extents[i];
+
+      if (p_extent->fe_flags & CPR_FIEMAP_NO_ADDRESS)
+      {
+        rc = EOPNOTSUPP;
+        break;
+      }
+
+      const uint64_t run_start = MAX(p_extent->fe_logical, start);
+      const uint64_t run_end   = MIN(p_extent->fe_logical +
+                                     p_extent->fe_length, end);
+
+      if (run_start >= run_end)
+      {
+        continue;
+      }
+
+      if (num_runs == max_runs)
+      {
+        max_runs = MAX(2 * max_runs, EXTENT_BATCH);
+
+        extent_run_t *p_grown = realloc(p_runs, max_runs * sizeof(*p_runs));
+
+        if (p_grown == NULL)
+        {
+          rc = ENOMEM;
+          break;
+        }
+
+        p_runs = p_grown;
+      }
+
+      p_runs[num_runs++] = (extent_run_t)
+      {
+        .logical  = run_start,
+        .physical = p_extent->fe_physical + (run_start - p_extent->fe_logical),
+        .length   = run_end - run_start
+      };
+    }
+
+    if (mapped < EXTENT_BATCH ||
+        (p_map->fm_extents[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST))
+    {
+      break;
+    }
+
+    pos = p_map->fm_extents[mapped - 1].fe_logical +
+          p_map->fm_extents[mapped - 1].fe_length;
+  }
+
+  free(p_map);
+
+  if (rc != 0)
+  {
+    free(p_runs);
+    return rc;
+  }
+
+  *pp_runs    = p_runs;
+  *p_num_runs = num_runs;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Copy @p length bytes from @p src_fd at @p src_pos to @p dst_fd at
+ * @p dst_pos through @p p_block, or write zeros if @p src_fd is negative.
+ */
+
+static int copy_run (const int    src_fd,
+                     const int    dst_fd,
+                     uint64_t     src_pos,
+                     uint64_t     dst_pos,
+                     uint64_t     length,
+                     uint8_t     *p_block,
+                     const size_t block_size)
+{
+  while (length > 0)
+  {
+    size_t got = MIN(block_size, length);
+
+    if (src_fd >= 0)
+    {
+      const ssize_t read_now = cpr_sys_pread(src_fd, p_block, got, src_pos);
+
+      if (read_now < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        return errno;
+      }
+
+      /* Charged once it worked, so that EINTR retries are not charged too. */
+      cpr_throttle(read_now, 1);
+
+      if (read_now == 0)
+      {
+        /* The source shrank since it was mapped. */
+        return ERANGE;
+      }
+
+      got = read_now;
+    }
+
+    for (size_t wrote = 0; wrote < got;)
+    {
+      const ssize_t wrote_now = cpr_sys_pwrite(dst_fd, p_block + wrote,
+                                               got - wrote, dst_pos + wrote);
+
+      if (wrote_now < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        return errno;
+      }
+
+      cpr_throttle(0, 1);
+
+      wrote += wrote_now;
+    }
+
+    cpr_stats_copied(got);
+
+    src_pos += got;
+    dst_pos += got;
+    length  -= got;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Split @p *pp_runs, sorted by physical address, into the parts met for the
+ * first time, which replace @p *pp_runs in the same order, and the parts
+ * repeating them, returned in @p *pp_clones. A repeat that would not clone
+ * whole blocks of @p dst_block_size once placed at @p dst_offset in the
+ * destination is kept in @p *pp_runs to be copied.
+ */
+
+static int split_shared (extent_run_t  **pp_runs,
+                         size_t         *p_num_runs,
+                         const uint64_t  start,
+                         const uint64_t  dst_offset,
+                         const uint64_t  dst_block_size,
+                         extent_clone_t **pp_clones,
+                         size_t         *p_num_clones)
+{
+  const extent_run_t *p_runs   = *pp_runs;
+  const size_t        num_runs = *p_num_runs;
+
+  *pp_clones    = NULL;
+  *p_num_clones = 0;
+
+  if (num_runs == 0)
+  {
+    return 0;
+  }
+
+  /* Each run yields at most one repeat and one part met first. */
+  extent_run_t       *p_firsts   = malloc(2 * num_runs * sizeof(*p_firsts));
+  extent_clone_t     *p_clones   = malloc(num_runs * sizeof(*p_clones));
+  size_t              num_firsts = 0;
+  size_t              num_clones = 0;
+  const extent_run_t *p_cover    = NULL;
+  uint64_t            cover_end  = 0;
+
+  if (p_firsts == NULL || p_clones == NULL)
+  {
+    free(p_clones);
+    free(p_firsts);
+    return ENOMEM;
+  }
+
+  for (size_t i = 0; i < num_runs; i++)
+  {
+    const extent_run_t *p_run   = &p_runs[i];
+    const uint64_t      run_end = p_run->physical + p_run->length;
+    uint64_t            pos     = p_run->physical;
+
+    if (p_cover != NULL && pos < cover_end)
+    {
+      const uint64_t length = MIN(run_end, cover_end) - pos;
+      const uint64_t from   = p_cover->logical + (pos - p_cover->physical);
+      const uint64_t to     = p_run->logical + (pos - p_run->physical);
+
+      if ((dst_offset + (from - start)) % dst_block_size == 0 &&
+          (dst_offset + (to - start)) % dst_block_size == 0 &&
+          length % dst_block_size == 0)
+      {
+        p_clones[num_clones++] = (extent_clone_t)
+        {
+          .from   = from,
+          .to     = to,
+          .length = length
+        };
+      }
+      else
+      {
+        p_firsts[num_firsts++] = (extent_run_t)
+        {
+          .logical  = to,
+          .physical = pos,
+          .length   = length
+        };
+      }
+
+      pos += length;
+    }
+
+    if (pos < run_end)
+    {
+      p_firsts[num_firsts++] = (extent_run_t)
+      {
+        .logical  = p_run->logical + (pos - p_run->physical),
+        .physical = pos,
+        .length   = run_end - pos
+      };
+
+      p_cover   = p_run;
+      cover_end = run_end;
+    }
+  }
+
+  free(*pp_runs);
+
+  *pp_runs      = p_firsts;
+  *p_num_runs   = num_firsts;
+  *pp_clones    = p_clones;
+  *p_num_clones = num_clones;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Return a descriptor that can be read from for the file open as @p dst_fd,
+ * which FICLONERANGE needs for its source. That is @p dst_fd itself if it
+ * was opened for reading, otherwise a new descriptor the caller must close.
+ *
+ * @return The descriptor, or -1 with errno set.
+ */
+
+static int open_readable (const int dst_fd)
+{
+  const int status = fcntl(dst_fd, F_GETFL);
+
+  if (status >= 0 && (status & O_ACCMODE) == O_RDWR)
+  {
+    return dst_fd;
+  }
+
+  char path[32];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", dst_fd);
+
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/*============================================================================*/
+
+/**
+ * Recreate each of @p p_clones by cloning the destination from itself, or
+ * copy it from the source once the destination has refused a clone.
+ */
+
+static int clone_shared (const int             src_fd,
+                         const int             dst_fd,
+                         const uint64_t        start,
+                         const uint64_t        dst_offset,
+                         const extent_clone_t *p_clones,
+                         const size_t          num_clones,
+                         uint8_t              *p_block,
+                         const size_t          block_size)
+{
+  const int read_fd = open_readable(dst_fd);
+  bool      cloning = (read_fd >= 0);
+  int       rc      = 0;
+
+  for (size_t i = 0; rc == 0 && i < num_clones; i++)
+  {
+    const extent_clone_t *p_clone = &p_clones[i];
+    const uint64_t        to      = dst_offset + (p_clone->to - start);
+
+    if (cloning)
+    {
+      const struct file_clone_range range =
+      {
+        .src_fd      = read_fd,
+        .src_offset  = dst_offset + (p_clone->from - start),
+        .src_length  = p_clone->length,
+        .dest_offset = to
+      };
+
+      if (cpr_sys_ficlonerange(dst_fd, &range) == 0)
+      {
+        cpr_stats_shared(p_clone->length);
+        continue;
+      }
+
+      /* A file system that refuses one clone will refuse the rest. */
+      cloning = false;
+    }
+
+    rc = copy_run(src_fd, dst_fd, p_clone->to, to, p_clone->length, p_block,
+                  block_size);
+  }
+
+  if (read_fd >= 0 && read_fd != dst_fd)
+  {
+    close(read_fd);
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int extent_copy_file_range (const int      src_fd,
+                            const int      dst_fd,
+                            const off_t    src_offset,
+                            const off_t    dst_offset,
+                            const size_t   length,
+                            const size_t   block_size,
+                            const uint32_t flags)
+{
+  struct stat src_stat;
+
+  if (fstat(src_fd, &src_stat) != 0)
+  {
+    return errno;
+  }
+
+  /* A range past EOF is left to the file-order copy to report. */
+  const uint64_t start = src_offset;
+  const uint64_t end   = (length != 0) ? start + length
+                                       : (uint64_t)MAX(src_stat.st_size,
+                                                       src_offset);
+
+  if (!S_ISREG(src_stat.st_mode) || end > (uint64_t)src_stat.st_size)
+  {
+    return EOPNOTSUPP;
+  }
+
+  extent_run_t *p_runs   = NULL;
+  size_t        num_runs = 0;
+  int           rc       = map_source(src_fd, start, end, &p_runs, &num_runs);
+
+  if (rc != 0)
+  {
+    /* Any failure to map just means the copy goes in file order. */
+    return EOPNOTSUPP;
+  }
+
+  uint8_t *p_block = cpr_block_get(block_size,
+                                   (flags & QTM_CLONE_FLAG_HUGE_PAGES) != 0);
+
+  if (p_block == NULL)
+  {
+    free(p_runs);
+    return ENOMEM;
+  }
+
+  cpr_stats_copied(0);
+
+  /* Zero the destination wherever the source has no extent. */
+  memset(p_block, 0, block_size);
+
+  uint64_t pos = start;
+
+  for (size_t i = 0; rc == 0 && i <= num_runs; i++)
+  {
+    const uint64_t gap_end = (i < num_runs) ? p_runs[i].logical : end;
+
+    if (gap_end > pos)
+    {
+      rc = copy_run(-1, dst_fd, 0, dst_offset + (pos - start), gap_end - pos,
+                    p_block, block_size);
+    }
+
+    if (i < num_runs)
+    {
+      pos = p_runs[i].logical + p_runs[i].length;
+    }
+  }
+
+  qsort(p_runs, num_runs, sizeof(*p_runs), compare_physical);
+
+  extent_clone_t *p_clones   = NULL;
+  size_t          num_clones = 0;
+  struct statfs   dst_fs;
+
+  if (rc == 0 && (flags & QTM_CLONE_FLAG_PRESERVE_SHARING))
+  {
+    rc = (fstatfs(dst_fd, &dst_fs) == 0) ? 0 : errno;
+
+    if (rc == 0)
+    {
+      rc = split_shared(&p_runs, &num_runs, start, dst_offset,
+                        (dst_fs.f_bsize > 0) ? (uint64_t)dst_fs.f_bsize : 4096,
+                        &p_clones, &num_clones);
+    }
+  }
+
+  for (size_t i = 0; rc == 0 && i < num_runs; i++)
+  {
+    rc = copy_run(src_fd, dst_fd, p_runs[i].logical,
+                  dst_offset + (p_runs[i].logical - start), p_runs[i].length,
+                  p_block, block_size);
+  }
+
+  if (rc == 0 && num_clones > 0)
+  {
+    rc = clone_shared(src_fd, dst_fd, start, dst_offset, p_clones, num_clones,
+                      p_block, block_size);
+  }
+
+  free(p_clones);
+  free(p_runs);
+
+  return rc;
+}
+
+/*============================================================================*/
@@ -0,0 +1,552 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, multi-destination clone.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The parallel copy keeps one writer thread per fallback destination and
+ * steps them in lock-step with the reader using two barriers. Between the
+ * "start" and "finish" barriers the writers write the current buffer while
+ * the reader fills the other one; the barriers also publish the round's
+ * buffer, length and offset to the writers. Each writer only ever touches its
+ * own entry of the result array, and the reader only looks at the results
+ * after "finish", so no further locking is needed.
+ *
+ * The barriers count every writer, so a writer that started while a later
+ * one failed to could never be released through them. Writers therefore
+ * wait on a gate before their first barrier, which the reader only opens
+ * once all of them exist, with @c aborted set if one of them does not.
+ *
+ * All I/O is positional so the file positions of the caller's descriptors
+ * are not used or changed by the copy.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/**
+ * Result qtm_clone_file_multi() gives a destination, between its clones and
+ * its copy, that the clone failed on and that is to be copied to.
+ */
+
+#define FANOUT_PENDING (-1)
+
+/*============================================================================*/
+
+/** State shared by the reader and writers of one parallel fan-out copy. */
+
+typedef struct _fanout_t
+{
+  const int     *p_dst_fds;
+  int           *p_rcs;
+
+  /**
+   * Published by the reader before each "start" barrier.
+   * @{
+   */
+  const uint8_t *p_block;
+  size_t         length;
+  off_t          offset;
+  bool           done;
+  /** @} */
+
+  pthread_barrier_t start;
+  pthread_barrier_t finish;
+
+  /**
+   * Gate the writers wait at before the first "start" barrier.
+   * @{
+   */
+  pthread_mutex_t gate_lock;
+  pthread_cond_t  gate;
+  bool            gate_open;
+  bool            aborted;   /**< Not every writer started; exit at once. */
+  /** @} */
+} fanout_t;
+
+/** A writer thread's arguments. */
+
+typedef struct _fanout_writer_t
+{
+  fanout_t *p_fanout;
+  size_t    dst_index;
+  pthread_t thread;
+} fanout_writer_t;
+
+/*============================================================================*/
+
+/**
+ * Read up to @p block_size bytes from @p fd at @p offset, stopping short only
+ * at EOF.
+ *
+ * @return Bytes read (zero at EOF), or minus an errno value on failure.
+ */
+
+static ssize_t read_block_at (const int    fd,
+                              uint8_t     *p_block,
+                              const size_t block_size,
+                              const off_t  offset)
+{
+  size_t got = 0;
+
+  while (got < block_size)
+  {
+    ssize_t read_now = cpr_sys_pread(fd, p_block + got, block_size - got,
+                                     offset + got);
+
+    if (read_now < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return -errno;
+    }
+
+    cpr_throttle(read_now, 1);
+
+    if (read_now == 0)
+    {
+      break;
+    }
+
+    got += read_now;
+  }
+
+  return got;
+}
+
+/*============================================================================*/
+
+/**
+ * Write all @p length bytes of @p p_block to @p fd at @p offset.
+ *
+ * @return Zero on success, some errno value on failure.
+ */
+
+static int write_block_at (const int      fd,
+                           const uint8_t *p_block,
+                           size_t         length,
+                           off_t          offset)
+{
+  while (length > 0)
+  {
+    ssize_t wrote_now = cpr_sys_pwrite(fd, p_block, length, offset);
+
+    if (wrote_now < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return errno;
+    }
+
+    cpr_throttle(0, 1);
+
+    p_block += wrote_now;
+    length  -= wrote_now;
+    offset  += wrote_now;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Copy @p src_fd to the destinations listed in @p p_fallback from the
+ * calling thread, one after the other.
+ */
+
+static void fanout_serial (const int     src_fd,
+                           const int    *p_dst_fds,
+                           const size_t *p_fallback,
+                           const size_t  num_fallback,
+                           const size_t  block_size,
+                           uint8_t      *p_block,
+                           int          *p_rcs)
+{
+  off_t  offset = 0;
+  size_t live   = num_fallback;
+
+  while (live > 0)
+  {
+    const ssize_t got = read_block_at(src_fd, p_block, block_size, offset);
+
+    if (got <= 0)
+    {
+      for (size_t i = 0; got < 0 && i < num_fallback; i++)
+      {
+        p_rcs[p_fallback[i]] = (p_rcs[p_fallback[i]] == 0)
+                               ? (int)-got : p_rcs[p_fallback[i]];
+      }
+
+      break;
+    }
+
+    for (size_t i = 0; i < num_fallback; i++)
+    {
+      const size_t d = p_fallback[i];
+
+      if (p_rcs[d] == 0)
+      {
+        p_rcs[d] = write_block_at(p_dst_fds[d], p_block, got, offset);
+        live    -= (p_rcs[d] != 0);
+      }
+    }
+
+    /* Only blocks that reached a destination count as copied. */
+    if (live > 0)
+    {
+      cpr_stats_copied(got);
+    }
+
+    offset += got;
+  }
+}
+
+/*============================================================================*/
+
+/**
+ * Writer thread body for fanout_parallel().
+ */
+
+static void *fanout_writer_main (void *p_arg)
+{
+  fanout_writer_t *p_writer = p_arg;
+  fanout_t        *p_fanout = p_writer->p_fanout;
+  const size_t     d        = p_writer->dst_index;
+
+  pthread_mutex_lock(&p_fanout->gate_lock);
+
+  while (!p_fanout->gate_open)
+  {
+    pthread_cond_wait(&p_fanout->gate, &p_fanout->gate_lock);
+  }
+
+  const bool aborted = p_fanout->aborted;
+
+  pthread_mutex_unlock(&p_fanout->gate_lock);
+
+  if (aborted)
+  {
+    return NULL;
+  }
+
+  for (;;)
+  {
+    pthread_barrier_wait(&p_fanout->start);
+
+    if (p_fanout->done)
+    {
+      break;
+    }
+
+    if (p_fanout->p_rcs[d] == 0)
+    {
+      p_fanout->p_rcs[d] = write_block_at(p_fanout->p_dst_fds[d],
+                                          p_fanout->p_block,
+                                          p_fanout->length,
+                                          p_fanout->offset);
+    }
+
+    pthread_barrier_wait(&p_fanout->finish);
+  }
+
+  return NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Reader side of fanout_parallel(), once every writer has started: read the
+ * source a block at a time, handing each block to the writers, until the end
+ * of the source or until every destination has failed.
+ */
+
+static void fanout_copy (fanout_t     *p_fanout,
+                         const int     src_fd,
+                         const size_t *p_fallback,
+                         const size_t  num_fallback,
+                         const size_t  block_size,
+                         uint8_t      *p_bufs[2])
+{
+  unsigned cur    = 0;
+  off_t    offset = 0;
+  ssize_t  got    = read_block_at(src_fd, p_bufs[cur], block_size, offset);
+  size_t   live   = num_fallback;
+
+  while (got > 0 && live > 0)
+  {
+    p_fanout->p_block = p_bufs[cur];
+    p_fanout->length  = got;
+    p_fanout->offset  = offset;
+
+    pthread_barrier_wait(&p_fanout->start);
+
+    const ssize_t next = read_block_at(src_fd, p_bufs[cur ^ 1], block_size,
+                                       offset + got);
+
+    pthread_barrier_wait(&p_fanout->finish);
+
+    live = 0;
+
+    for (size_t i = 0; i < num_fallback; i++)
+    {
+      live += (p_fanout->p_rcs[p_fallback[i]] == 0);
+    }
+
+    if (live > 0)
+    {
+      cpr_stats_copied(got);
+    }
+
+    offset += got;
+    got     = next;
+    cur    ^= 1;
+  }
+
+  for (size_t i = 0; got < 0 && i < num_fallback; i++)
+  {
+    int *p_rc = &p_fanout->p_rcs[p_fallback[i]];
+
+    *p_rc = (*p_rc == 0) ? (int)-got : *p_rc;
+  }
+
+  p_fanout->done = true;
+  pthread_barrier_wait(&p_fanout->start);
+}
+
+
+/*============================================================================*/
+
+/**
+ * Copy @p src_fd to the destinations listed in @p p_fallback with one writer
+ * thread per destination, overlapping each read with the previous block's
+ * writes.
+ *
+ * @return Zero on success, or an errno value if the threads could not be
+ *         started (in which case nothing has been copied).
+ */
+
+static int fanout_parallel (const int     src_fd,
+                            const int    *p_dst_fds,
+                            const size_t *p_fallback,
+                            const size_t  num_fallback,
+                            const size_t  block_size,
+                            uint8_t      *p_bufs[2],
+                            int          *p_rcs)
+{
+  fanout_writer_t *p_writers = calloc(num_fallback, sizeof(*p_writers));
+
+  if (p_writers == NULL)
+  {
+    return ENOMEM;
+  }
+
+  fanout_t fanout =
+  {
+    .p_dst_fds = p_dst_fds,
+    .p_rcs     = p_rcs,
+    .p_block   = NULL,
+    .length    = 0,
+    .offset    = 0,
+    .done      = false,
+    .gate_open = false,
+    .aborted   = false
+  };
+
+  pthread_barrier_init(&fanout.start, NULL, num_fallback + 1);
+  pthread_barrier_init(&fanout.finish, NULL, num_fallback + 1);
+  pthread_mutex_init(&fanout.gate_lock, NULL);
+  pthread_cond_init(&fanout.gate, NULL);
+
+  int    rc      = 0;
+  size_t started = 0;
+
+  for (; started < num_fallback; started++)
+  {
+    p_writers[started].p_fanout  = &fanout;
+    p_writers[started].dst_index = p_fallback[started];
+
+    rc = pthread_create(&p_writers[started].thread, NULL,
+                        fanout_writer_main, &p_writers[started]);
+
+    if (rc != 0)
+    {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&fanout.gate_lock);
+  fanout.gate_open = true;
+  fanout.aborted   = (rc != 0);
+  pthread_cond_broadcast(&fanout.gate);
+  pthread_mutex_unlock(&fanout.gate_lock);
+
+  if (rc == 0)
+  {
+    fanout_copy(&fanout, src_fd, p_fallback, num_fallback, block_size,
+                p_bufs);
+  }
+
+  for (size_t i = 0; i < started; i++)
+  {
+    pthread_join(p_writers[i].thread, NULL);
+  }
+
+  pthread_cond_destroy(&fanout.gate);
+  pthread_mutex_destroy(&fanout.gate_lock);
+  pthread_barrier_destroy(&fanout.finish);
+  pthread_barrier_destroy(&fanout.start);
+  free(p_writers);
+
+  return rc;
+}
+/*============================================================================*/
+
+int qtm_clone_file_multi (const int    src_fd,
+                          const int   *p_dst_fds,
+                          const size_t num_dsts,
+                          const bool   fallback_copy,
+                          const size_t fallback_copy_block_size,
+                          const bool   parallel_writes,
+                          int         *p_rcs)
+{
+  if (src_fd < 0 || p_dst_fds == NULL || num_dsts == 0 || p_rcs == NULL ||
+      (fallback_copy && fallback_copy_block_size == 0))
+  {
+    return EINVAL;
+  }
+
+  for (size_t i = 0; i < num_dsts; i++)
+  {
+    if (p_dst_fds[i] < 0)
+    {
+      return EINVAL;
+    }
+  }
+
+  size_t num_fallback = 0;
+
+  cpr_stats_begin();
+
+  for (size_t i = 0; i < num_dsts; i++)
+  {
+    p_rcs[i] = clone_file_impl(src_fd, p_dst_fds[i]);
+
+    if (p_rcs[i] != 0 && fallback_copy)
+    {
+      p_rcs[i] = FANOUT_PENDING;
+      num_fallback++;
+    }
+  }
+
+  int rc = 0;
+
+  if (num_fallback > 0)
+  {
+    /* The copy buffers and the list of destinations to copy to share one
+     * block from the calling thread's pool, so repeated calls allocate
+     * nothing.
+     */
+    const bool   parallel   = parallel_writes && num_fallback > 1;
+    const size_t block_size = fallback_copy_block_size;
+    const size_t list_at    = ((parallel ? 2 : 1) * block_size +
+                               sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    uint8_t     *p_pool     = (block_size <= SIZE_MAX / 4 &&
+                               num_dsts <= SIZE_MAX / 4 / sizeof(size_t))
+                              ? cpr_block_get(list_at +
+                                              num_fallback * sizeof(size_t),
+                                              false)
+                              : NULL;
+
+    if (p_pool == NULL)
+    {
+      rc = ENOMEM;
+
+      for (size_t i = 0; i < num_dsts; i++)
+      {
+        p_rcs[i] = (p_rcs[i] == FANOUT_PENDING) ? rc : p_rcs[i];
+      }
+    }
+    else
+    {
+      uint8_t *p_bufs[2]  = { p_pool, parallel ? p_pool + block_size : NULL };
+      size_t  *p_fallback = (size_t *)(p_pool + list_at);
+      size_t   listed     = 0;
+
+      for (size_t i = 0; i < num_dsts; i++)
+      {
+        if (p_rcs[i] == FANOUT_PENDING)
+        {
+          p_rcs[i]             = 0;
+          p_fallback[listed++] = i;
+        }
+      }
+
+      /* The copy is counted on this thread, which reads every block. */
+      cpr_stats_copied(0);
+
+      if (parallel)
+      {
+        rc = fanout_parallel(src_fd, p_dst_fds, p_fallback, num_fallback,
+                             block_size, p_bufs, p_rcs);
+      }
+      else
+      {
+        fanout_serial(src_fd, p_dst_fds, p_fallback, num_fallback,
+                      block_size, p_bufs[0], p_rcs);
+      }
+
+      for (size_t i = 0; rc != 0 && i < num_fallback; i++)
+      {
+        p_rcs[p_fallback[i]] = rc;
+      }
+    }
+  }
+
+  for (size_t i = 0; rc == 0 && i < num_dsts; i++)
+  {
+    rc = p_rcs[i];
+  }
+
+  cpr_stats_end(rc);
+
+  return rc;
+}
+
+/*============================================================================*/
@@ -0,0 +1,397 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, internal declarations.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section description Description
+ *
+ * Declarations shared between the translation units of libcpr. Nothing in
+ * here is part of the public interface in libcpr.h.
+ *
+ * The @c cpr_sys_ wrappers are the only place the library issues system calls
+ * on a caller's file descriptors. Each one reports to the trace hook, if one
+ * is registered, and otherwise reduces to the bare system call.
+ */
+
+#ifndef LIBCPR_INTERNAL_H
+#define LIBCPR_INTERNAL_H
+
+#include "libcpr.h"
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/**
+ * Find the smaller of two objects that are the same type.
+ *
+ * @note This has the potential to double-evaluate its input parameters, so do
+ *       not invoke it with parameters that have side-effects.
+ */
+#define MIN(x_, y_) (((x_) <= (y_)) ? (x_) : (y_))
+
+/**
+ * Find the larger of two objects that are the same type. The same caveat as
+ * #MIN applies.
+ */
+#define MAX(x_, y_) (((x_) >= (y_)) ? (x_) : (y_))
+
+/*============================================================================*/
+
+/** Registered trace hook. NULL while tracing is disabled. */
+
+extern _Atomic(qtm_trace_fn_t) g_cpr_trace_fn;
+
+/**
+ * Return true if a trace hook is registered.
+ */
+
+static inline bool cpr_trace_enabled (void)
+{
+  return atomic_load_explicit(&g_cpr_trace_fn, memory_order_relaxed) != NULL;
+}
+
+/**
+ * Return the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+
+uint64_t cpr_trace_clock_ns (void);
+
+/**
+ * Build a trace event from the arguments and pass it to the trace hook.
+ * Preserves errno. @p start_ns is from cpr_trace_clock_ns() taken just
+ * before the system call.
+ */
+
+void cpr_trace_emit (const qtm_trace_op_t op,
+                     const int            fd,
+                     const int            src_fd,
+                     const off_t          offset,
+                     const size_t         length,
+                     const ssize_t        result,
+                     const uint64_t       start_ns);
+
+/*============================================================================*/
+
+/** True while qtm_set_throttle() has a limit in effect. */
+
+extern atomic_bool g_cpr_throttle_enabled;
+
+/**
+ * Charge @p bytes and @p ops to the process-wide throttle, sleeping if the
+ * allowance is overdrawn. Implemented in libcpr_throttle.c.
+ */
+
+void cpr_throttle_wait (const uint64_t bytes, const uint64_t ops);
+
+/**
+ * As cpr_throttle_wait() but a no-op unless throttling is enabled.
+ */
+
+static inline void cpr_throttle (const uint64_t bytes, const uint64_t ops)
+{
+  if (atomic_load_explicit(&g_cpr_throttle_enabled, memory_order_relaxed))
+  {
+    cpr_throttle_wait(bytes, ops);
+  }
+}
+
+/*============================================================================*/
+
+/** Statistics of the calling thread's current or last clone call. */
+
+extern _Thread_local qtm_clone_stats_t g_cpr_last_stats;
+
+/**
+ * Reset the calling thread's statistics at the start of a public clone call.
+ */
+
+void cpr_stats_begin (void);
+
+/**
+ * Finish the calling thread's statistics for a clone call that returned
+ * @p rc.
+ */
+
+void cpr_stats_end (const int rc);
+
+/**
+ * Record that the fallback copy wrote @p bytes more.
+ */
+
+static inline void cpr_stats_copied (const size_t bytes)
+{
+  g_cpr_last_stats.method        = QTM_CLONE_METHOD_COPY;
+  g_cpr_last_stats.bytes_copied += bytes;
+}
+
+/**
+ * Record that the fallback copy cloned @p bytes within the destination
+ * instead of writing them.
+ */
+
+static inline void cpr_stats_shared (const size_t bytes)
+{
+  g_cpr_last_stats.bytes_shared += bytes;
+}
+
+/**
+ * Return a copy buffer of at least @p size bytes owned by the calling thread,
+ * or NULL if out of memory. The buffer is kept for the thread's next call and
+ * freed when the thread exits, so it must not be freed by the caller or held
+ * across a call that may use it too. Records the kind of buffer in the
+ * thread's statistics.
+ *
+ * @param[in] huge Back the buffer with huge pages if @p size is at least
+ *                 one. See #QTM_CLONE_FLAG_HUGE_PAGES.
+ */
+
+uint8_t *cpr_block_get (const size_t size, const bool huge);
+
+/*============================================================================*/
+
+/**
+ * Traced ioctl(FICLONE).
+ */
+
+static inline int cpr_sys_ficlone (const int src_fd, const int dst_fd)
+{
+  if (!cpr_trace_enabled())
+  {
+    return ioctl(dst_fd, FICLONE, src_fd);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const int      rc       = ioctl(dst_fd, FICLONE, src_fd);
+
+  cpr_trace_emit(QTM_TRACE_OP_FICLONE, dst_fd, src_fd, 0, 0, rc, start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Traced ioctl(FICLONERANGE).
+ */
+
+static inline int cpr_sys_ficlonerange (const int                      dst_fd,
+                                        const struct file_clone_range *p_range)
+{
+  if (!cpr_trace_enabled())
+  {
+    return ioctl(dst_fd, FICLONERANGE, p_range);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const int      rc       = ioctl(dst_fd, FICLONERANGE, p_range);
+
+  cpr_trace_emit(QTM_TRACE_OP_FICLONERANGE, dst_fd, (int)p_range->src_fd,
+                 p_range->dest_offset, p_range->src_length, rc, start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Traced pread(2).
+ */
+
+static inline ssize_t cpr_sys_pread (const int    fd,
+                                     void        *p_buf,
+                                     const size_t length,
+                                     const off_t  offset)
+{
+  if (!cpr_trace_enabled())
+  {
+    return pread(fd, p_buf, length, offset);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const ssize_t  rc       = pread(fd, p_buf, length, offset);
+
+  cpr_trace_emit(QTM_TRACE_OP_READ, fd, -1, offset, length, rc, start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Traced pwrite(2).
+ */
+
+static inline ssize_t cpr_sys_pwrite (const int    fd,
+                                      const void  *p_buf,
+                                      const size_t length,
+                                      const off_t  offset)
+{
+  if (!cpr_trace_enabled())
+  {
+    return pwrite(fd, p_buf, length, offset);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const ssize_t  rc       = pwrite(fd, p_buf, length, offset);
+
+  cpr_trace_emit(QTM_TRACE_OP_WRITE, fd, -1, offset, length, rc, start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Traced ioctl(FS_IOC_FIEMAP).
+ */
+
+static inline int cpr_sys_fiemap (const int fd, struct fiemap *p_map)
+{
+  if (!cpr_trace_enabled())
+  {
+    return ioctl(fd, FS_IOC_FIEMAP, p_map);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const int      rc       = ioctl(fd, FS_IOC_FIEMAP, p_map);
+
+  cpr_trace_emit(QTM_TRACE_OP_FIEMAP, fd, -1, p_map->fm_start,
+                 p_map->fm_length, rc, start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Traced ioctl(FIDEDUPERANGE). Reported against the first destination.
+ */
+
+static inline int cpr_sys_fideduperange (const int                 src_fd,
+                                         struct file_dedupe_range *p_range)
+{
+  if (!cpr_trace_enabled())
+  {
+    return ioctl(src_fd, FIDEDUPERANGE, p_range);
+  }
+
+  const uint64_t start_ns = cpr_trace_clock_ns();
+  const int      rc       = ioctl(src_fd, FIDEDUPERANGE, p_range);
+
+  cpr_trace_emit(QTM_TRACE_OP_FIDEDUPERANGE, (int)p_range->info[0].dest_fd,
+                 src_fd, p_range->info[0].dest_offset, p_range->src_length, rc,
+                 start_ns);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Core clone and copy primitives, implemented in libcpr.c. They do not check
+ * their parameters. See libcpr.c for details.
+ *
+ * @{
+ */
+
+int clone_file_impl (const int src_fd, const int dst_fd);
+
+int clone_file_range_impl (const int    src_fd,
+                           const int    dst_fd,
+                           const off_t  src_offset,
+                           const off_t  dst_offset,
+                           const size_t length);
+
+int deep_copy_file_range_impl (const int      src_fd,
+                               const int      dst_fd,
+                               const off_t    src_offset,
+                               const off_t    dst_offset,
+                               const size_t   length,
+                               const size_t   block_size,
+                               const uint32_t flags);
+
+/** @} */
+
+/*============================================================================*/
+
+/**
+ * FIEMAP extent flags under which fe_physical cannot be relied on. An
+ * encoded (e.g. compressed) extent reports where its encoded data starts,
+ * so offsets into it are not byte addresses and ranges of a file that use
+ * different parts of one such extent all report the same address.
+ */
+
+#define CPR_FIEMAP_NO_ADDRESS (FIEMAP_EXTENT_UNKNOWN     | \
+                               FIEMAP_EXTENT_DELALLOC    | \
+                               FIEMAP_EXTENT_ENCODED     | \
+                               FIEMAP_EXTENT_DATA_INLINE | \
+                               FIEMAP_EXTENT_DATA_TAIL   | \
+                               FIEMAP_EXTENT_NOT_ALIGNED)
+
+/**
+ * As deep_copy_file_range_impl() but reading the source's extents in order of
+ * physical address, and with #QTM_CLONE_FLAG_PRESERVE_SHARING in @p flags
+ * writing each physical extent only once. Implemented in libcpr_extent.c.
+ *
+ * @return As deep_copy_file_range_impl(). @c EOPNOTSUPP, before anything has
+ *         been written, if the source cannot be mapped or the range runs past
+ *         its end; copy it in file order instead.
+ */
+
+int extent_copy_file_range (const int      src_fd,
+                            const int      dst_fd,
+                            const off_t    src_offset,
+                            const off_t    dst_offset,
+                            const size_t   length,
+                            const size_t   block_size,
+                            const uint32_t flags);
+
+/*============================================================================*/
+
+/**
+ * Clone, or resumably copy, a range using the checkpoint journal named in
+ * @p p_options. Implemented in libcpr_journal.c.
+ *
+ * @param[in] whole_file If set the clone is attempted with FICLONE and the
+ *                       offsets and length must be zero.
+ */
+
+int journal_clone_file_range (const int                  src_fd,
+                              const int                  dst_fd,
+                              const off_t                src_offset,
+                              const off_t                dst_offset,
+                              const size_t               length,
+                              const bool                 whole_file,
+                              const qtm_clone_options_t *p_options);
+
+/*============================================================================*/
+
+#endif /* LIBCPR_INTERNAL_H */
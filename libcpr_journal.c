@@ -0,0 +1,444 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, resumable copy journal.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The journal is a single fixed-size record which is overwritten in place at
+ * every checkpoint. The record carries a digest of its own contents so a torn
+ * write (e.g. power lost mid-update) is detected and treated the same as no
+ * journal at all: the copy restarts from the beginning. That is always safe,
+ * merely slow.
+ *
+ * The order at each checkpoint is: copy the segment, fdatasync() the
+ * destination, then write and fdatasync() the journal. The journal therefore
+ * never claims more than is durable in the destination.
+ *
+ * The record is written in host byte order. A journal is only ever expected
+ * to be read back on the machine that wrote it.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** "CPRJRNL1" when read as little-endian bytes. */
+
+#define JOURNAL_MAGIC UINT64_C(0x314c4e524a525043)
+
+/** Default number of bytes between checkpoints. */
+
+#define JOURNAL_DEFAULT_INTERVAL (UINT64_C(256) * 1024 * 1024)
+
+/*============================================================================*/
+
+/** On-disk journal record. All fields are 64-bit so there is no padding. */
+
+typedef struct _journal_record_t
+{
+  /**
+   * Identity of the request. A journal is only resumed from if all of these
+   * match the current call.
+   * @{
+   */
+  uint64_t magic;
+  uint64_t src_dev;
+  uint64_t src_ino;
+  uint64_t src_size;
+  uint64_t src_mtime_ns;
+  uint64_t dst_dev;
+  uint64_t dst_ino;
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  /** @} */
+
+  /**
+   * Progress.
+   * @{
+   */
+  uint64_t committed;   /**< Bytes durable in the destination. */
+  uint64_t tail_length; /**< Bytes covered by @c tail_digest. */
+  uint64_t tail_digest; /**< Digest of the last @c tail_length committed. */
+  /** @} */
+
+  uint64_t record_digest; /**< Digest of all preceding fields. */
+} journal_record_t;
+
+/*============================================================================*/
+
+/**
+ * Fold @p length bytes at @p p_data into FNV-1a 64-bit hash @p hash.
+ */
+
+static uint64_t fnv1a64 (uint64_t hash, const void *p_data, size_t length)
+{
+  const uint8_t *p_byte = p_data;
+
+  while (length-- > 0)
+  {
+    hash ^= *p_byte++;
+    hash *= UINT64_C(0x100000001b3);
+  }
+
+  return hash;
+}
+
+/** FNV-1a 64-bit offset basis. */
+
+#define FNV1A64_INIT UINT64_C(0xcbf29ce484222325)
+
+/*============================================================================*/
+
+/**
+ * Return the digest that @p p_record should carry in @c record_digest.
+ */
+
+static uint64_t record_digest (const journal_record_t *p_record)
+{
+  return fnv1a64(FNV1A64_INIT, p_record,
+                 offsetof(journal_record_t, record_digest));
+}
+
+/*============================================================================*/
+
+/**
+ * Read exactly @p length bytes from @p fd at @p offset into @p p_buf.
+ *
+ * @return Zero on success, @c ERANGE if EOF was reached first, otherwise an
+ *         errno value from pread(2).
+ */
+
+static int read_exact (const int    fd,
+                       uint8_t     *p_buf,
+                       size_t       length,
+                       off_t        offset)
+{
+  while (length > 0)
+  {
+    ssize_t read_now = cpr_sys_pread(fd, p_buf, length, offset);
+
+    if (read_now < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return errno;
+    }
+    else if (read_now == 0)
+    {
+      return ERANGE;
+    }
+
+    p_buf  += read_now;
+    length -= read_now;
+    offset += read_now;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Compute the digest of @p length bytes of @p fd at @p offset, using
+ * @p p_buf as scratch space.
+ *
+ * @return Zero on success, some errno value on failure.
+ */
+
+static int digest_range (const int      fd,
+                         uint8_t       *p_buf,
+                         const uint64_t length,
+                         const off_t    offset,
+                         uint64_t      *p_digest)
+{
+  int rc = read_exact(fd, p_buf, length, offset);
+
+  if (rc == 0)
+  {
+    *p_digest = fnv1a64(FNV1A64_INIT, p_buf, length);
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Decide how far a previous attempt got. Reads the record from @p journal_fd
+ * and, if it describes the request in @p p_expect, checks the tail of the
+ * committed data against the recorded digest.
+ *
+ * @return The number of bytes that can be skipped. Zero if the journal is
+ *         empty, torn, stale or its tail does not verify.
+ */
+
+static uint64_t journal_resume_point (const int               journal_fd,
+                                      const journal_record_t *p_expect,
+                                      const int               src_fd,
+                                      const int               dst_fd,
+                                      uint8_t                *p_buf)
+{
+  journal_record_t record;
+
+  if (pread(journal_fd, &record, sizeof(record), 0) != sizeof(record) ||
+      record.record_digest != record_digest(&record))
+  {
+    return 0;
+  }
+
+  if (record.magic        != p_expect->magic        ||
+      record.src_dev      != p_expect->src_dev      ||
+      record.src_ino      != p_expect->src_ino      ||
+      record.src_size     != p_expect->src_size     ||
+      record.src_mtime_ns != p_expect->src_mtime_ns ||
+      record.dst_dev      != p_expect->dst_dev      ||
+      record.dst_ino      != p_expect->dst_ino      ||
+      record.src_offset   != p_expect->src_offset   ||
+      record.dst_offset   != p_expect->dst_offset   ||
+      record.length       != p_expect->length       ||
+      record.committed    >  record.length          ||
+      record.tail_length  >  record.committed       ||
+      record.tail_length  >  p_expect->tail_length)
+  {
+    return 0;
+  }
+
+  const uint64_t tail_start = record.committed - record.tail_length;
+  uint64_t       digest     = 0;
+
+  if (digest_range(src_fd, p_buf, record.tail_length,
+                   record.src_offset + tail_start, &digest) != 0 ||
+      digest != record.tail_digest)
+  {
+    return 0;
+  }
+
+  /* A write-only destination can't be read back. The source check above and
+   * the fdatasync() ordering are all we have to go on in that case.
+   */
+  int rc = digest_range(dst_fd, p_buf, record.tail_length,
+                        record.dst_offset + tail_start, &digest);
+
+  if ((rc == 0 && digest != record.tail_digest) || (rc != 0 && rc != EBADF))
+  {
+    return 0;
+  }
+
+  return record.committed;
+}
+
+/*============================================================================*/
+
+/**
+ * Record that @p p_record->committed bytes are durable.
+ *
+ * @return Zero on success, some errno value on failure.
+ */
+
+static int journal_commit (const int         journal_fd,
+                           journal_record_t *p_record)
+{
+  p_record->record_digest = record_digest(p_record);
+
+  ssize_t wrote = pwrite(journal_fd, p_record, sizeof(*p_record), 0);
+
+  if (wrote < 0)
+  {
+    return errno;
+  }
+  else if (wrote != sizeof(*p_record))
+  {
+    return EIO;
+  }
+
+  return (fdatasync(journal_fd) == 0) ? 0 : errno;
+}
+
+/*============================================================================*/
+
+int journal_clone_file_range (const int                  src_fd,
+                              const int                  dst_fd,
+                              const off_t                src_offset,
+                              const off_t                dst_offset,
+                              const size_t               length,
+                              const bool                 whole_file,
+                              const qtm_clone_options_t *p_options)
+{
+  const size_t block_size = p_options->fallback_copy_block_size;
+
+  if (src_fd < 0 || dst_fd < 0 || src_offset < 0 || dst_offset < 0 ||
+      block_size == 0)
+  {
+    return EINVAL;
+  }
+
+  struct stat src_stat;
+  struct stat dst_stat;
+
+  if (fstat(src_fd, &src_stat) != 0 || fstat(dst_fd, &dst_stat) != 0)
+  {
+    return errno;
+  }
+
+  /* Snapshot the length now so "to EOF" means the same thing on resume. */
+  uint64_t total = length;
+
+  if (total == 0)
+  {
+    total = (src_stat.st_size > src_offset) ? src_stat.st_size - src_offset : 0;
+  }
+
+  uint64_t interval = (p_options->checkpoint_interval != 0)
+                      ? p_options->checkpoint_interval
+                      : JOURNAL_DEFAULT_INTERVAL;
+
+  interval = ((interval + block_size - 1) / block_size) * block_size;
+
+  journal_record_t record =
+  {
+    .magic        = JOURNAL_MAGIC,
+    .src_dev      = src_stat.st_dev,
+    .src_ino      = src_stat.st_ino,
+    .src_size     = src_stat.st_size,
+    .src_mtime_ns = (uint64_t)src_stat.st_mtim.tv_sec * UINT64_C(1000000000) +
+                    (uint64_t)src_stat.st_mtim.tv_nsec,
+    .dst_dev      = dst_stat.st_dev,
+    .dst_ino      = dst_stat.st_ino,
+    .src_offset   = src_offset,
+    .dst_offset   = dst_offset,
+    .length       = total,
+    .committed    = 0,
+    .tail_length  = block_size,
+    .tail_digest  = 0
+  };
+
+  uint8_t *p_buf = malloc(block_size);
+
+  if (p_buf == NULL)
+  {
+    return ENOMEM;
+  }
+
+  int rc         = 0;
+  int journal_fd = open(p_options->p_journal_path,
+                        O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+  if (journal_fd < 0)
+  {
+    rc = errno;
+    free(p_buf);
+    return rc;
+  }
+
+  uint64_t committed =
+    journal_resume_point(journal_fd, &record, src_fd, dst_fd, p_buf);
+
+  /* Only try to clone on a fresh start. If there is progress to resume from,
+   * the clone has already failed once for this request. A fresh start over
+   * a whole file may follow a journal that was rejected, so the destination
+   * can still hold a longer earlier attempt that neither the clone nor the
+   * copy would shorten.
+   */
+  bool done = false;
+
+  if (committed == 0 && whole_file &&
+      ftruncate(dst_fd, dst_offset + (off_t)total) != 0)
+  {
+    rc = errno;
+  }
+  else if (committed == 0)
+  {
+    rc = whole_file
+         ? clone_file_impl(src_fd, dst_fd)
+         : clone_file_range_impl(src_fd, dst_fd, src_offset, dst_offset,
+                                 length);
+    done = (rc == 0);
+    rc   = 0;
+  }
+
+  while (rc == 0 && !done && committed < total)
+  {
+    const uint64_t segment = MIN(interval, total - committed);
+
+    rc = deep_copy_file_range_impl(src_fd, dst_fd,
+                                   src_offset + committed,
+                                   dst_offset + committed,
+                                   segment, block_size, 0);
+
+    if (rc == 0 && fdatasync(dst_fd) != 0)
+    {
+      rc = errno;
+    }
+
+    if (rc != 0)
+    {
+      break;
+    }
+
+    committed += segment;
+
+    record.committed   = committed;
+    record.tail_length = MIN((uint64_t)block_size, committed);
+
+    rc = digest_range(src_fd, p_buf, record.tail_length,
+                      src_offset + committed - record.tail_length,
+                      &record.tail_digest);
+
+    if (rc == 0)
+    {
+      rc = journal_commit(journal_fd, &record);
+    }
+
+    if (rc != 0)
+    {
+      break;
+    }
+  }
+
+  close(journal_fd);
+  free(p_buf);
+
+  if (rc == 0 && unlink(p_options->p_journal_path) != 0 && errno != ENOENT)
+  {
+    rc = errno;
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
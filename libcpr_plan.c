@@ -0,0 +1,256 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, clone planning.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * The trial reflink is the only thing that touches the destination file
+ * system. It goes into an O_TMPFILE, which has no name for anyone else to
+ * see and is freed on close, and it shares one block of the source rather
+ * than writing it. The file system type is reported but never used to guess
+ * the outcome, since the same type can clone on one mount and not another.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*============================================================================*/
+
+/** Extents fetched per FIEMAP call. */
+
+#define PLAN_EXTENTS 256
+
+/*============================================================================*/
+
+/**
+ * Count the bytes of [@p start, @p end) of @p src_fd that are mapped to
+ * extents into @p p_data.
+ */
+
+static int count_data (const int      src_fd,
+                       const uint64_t start,
+                       const uint64_t end,
+                       uint64_t      *p_data)
+{
+  const size_t   map_size = sizeof(struct fiemap) +
+                            PLAN_EXTENTS * sizeof(struct fiemap_extent);
+  struct fiemap *p_map    = calloc(1, map_size);
+  uint64_t       pos      = start;
+  int            rc       = (p_map == NULL) ? ENOMEM : 0;
+
+  *p_data = 0;
+
+  while (rc == 0 && pos < end)
+  {
+    /* No FIEMAP_FLAG_SYNC: a plan must not cause writes, and data not yet
+     * allocated is still listed, as delayed allocation.
+     */
+    p_map->fm_start        = pos;
+    p_map->fm_length       = end - pos;
+    p_map->fm_flags        = 0;
+    p_map->fm_extent_count = PLAN_EXTENTS;
+
+    if (cpr_sys_fiemap(src_fd, p_map) != 0)
+    {
+      rc = errno;
+      break;
+    }
+
+    const unsigned mapped = p_map->fm_mapped_extents;
+
+    for (unsigned i = 0; i < mapped; i++)
+    {
+      const struct fiemap_extent *p_extent = &p_map->fm_extents[i];
+      const uint64_t              run_start = MAX(p_extent->fe_logical, start);
+      const uint64_t              run_end   = MIN(p_extent->fe_logical +
+                                                  p_extent->fe_length, end);
+
+      if (run_start < run_end)
+      {
+        *p_data += run_end - run_start;
+      }
+    }
+
+    if (mapped < PLAN_EXTENTS ||
+        (p_map->fm_extents[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST))
+    {
+      break;
+    }
+
+    pos = p_map->fm_extents[mapped - 1].fe_logical +
+          p_map->fm_extents[mapped - 1].fe_length;
+  }
+
+  free(p_map);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Try to reflink the block of @p src_fd at @p src_offset into a new unnamed
+ * file in @p dst_dir_fd.
+ *
+ * @return Zero if the reflink worked, otherwise the errno value of the step
+ *         that failed.
+ */
+
+static int probe_reflink (const int      src_fd,
+                          const int      dst_dir_fd,
+                          const uint64_t src_offset,
+                          const uint64_t src_size,
+                          const uint64_t block_size)
+{
+  const int tmp_fd = openat(dst_dir_fd, ".", O_TMPFILE | O_WRONLY,
+                            S_IRUSR | S_IWUSR);
+
+  if (tmp_fd < 0)
+  {
+    return errno;
+  }
+
+  /* The last block of the source may be partial, which FICLONERANGE only
+   * takes as a clone to the end of the file.
+   */
+  const struct file_clone_range range =
+  {
+    .src_fd      = src_fd,
+    .src_offset  = src_offset,
+    .src_length  = (src_offset + block_size < src_size) ? block_size : 0,
+    .dest_offset = 0
+  };
+
+  const int rc = (cpr_sys_ficlonerange(tmp_fd, &range) == 0) ? 0 : errno;
+
+  close(tmp_fd);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int qtm_clone_plan (const int                  src_fd,
+                    const int                  dst_dir_fd,
+                    const off_t                src_offset,
+                    const size_t               length,
+                    const qtm_clone_options_t *p_options,
+                    qtm_clone_plan_t          *p_plan)
+{
+  if (src_fd < 0 || dst_dir_fd < 0 || src_offset < 0 || p_options == NULL ||
+      p_plan == NULL)
+  {
+    return EINVAL;
+  }
+
+  *p_plan = (qtm_clone_plan_t) { .probe_rc = 0 };
+
+  struct stat   src_stat;
+  struct statfs src_fs;
+  struct statfs dst_fs;
+
+  if (fstat(src_fd, &src_stat) != 0 || fstatfs(src_fd, &src_fs) != 0 ||
+      fstatfs(dst_dir_fd, &dst_fs) != 0)
+  {
+    return errno;
+  }
+
+  p_plan->src_fs_type = (uint64_t)src_fs.f_type;
+  p_plan->dst_fs_type = (uint64_t)dst_fs.f_type;
+  p_plan->same_fs     = (memcmp(&src_fs.f_fsid, &dst_fs.f_fsid,
+                                sizeof(src_fs.f_fsid)) == 0);
+
+  const uint64_t size  = (uint64_t)src_stat.st_size;
+  const uint64_t start = (uint64_t)src_offset;
+
+  if (!S_ISREG(src_stat.st_mode) || start > size ||
+      (uint64_t)length > size - start)
+  {
+    return EINVAL;
+  }
+
+  const uint64_t total = (length != 0) ? length : size - start;
+  const uint64_t end   = start + total;
+
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  uint64_t data = 0;
+  int      rc   = count_data(src_fd, start, end, &data);
+
+  if (rc == ENOMEM)
+  {
+    return rc;
+  }
+
+  /* Without an extent map, assume there are no holes. */
+  p_plan->data_bytes = (rc == 0) ? data : total;
+  p_plan->hole_bytes = total - p_plan->data_bytes;
+
+  if (p_options->fallback_copy && p_options->reflink_threshold != 0 &&
+      total <= p_options->reflink_threshold)
+  {
+    p_plan->copy_bytes = total;
+    return 0;
+  }
+
+  /* FICLONERANGE only takes whole blocks, bar the last one of the source. */
+  const uint64_t block_size = (src_fs.f_bsize > 0) ? (uint64_t)src_fs.f_bsize
+                                                   : 4096;
+
+  if (start % block_size != 0 || (end % block_size != 0 && end != size))
+  {
+    p_plan->probe_rc = EINVAL;
+  }
+  else
+  {
+    p_plan->probe_rc = probe_reflink(src_fd, dst_dir_fd, start, size,
+                                     block_size);
+  }
+
+  if (p_plan->probe_rc == 0)
+  {
+    p_plan->clone_bytes = total;
+  }
+  else if (p_options->fallback_copy)
+  {
+    p_plan->copy_bytes = total;
+  }
+  else
+  {
+    p_plan->fail_bytes = total;
+  }
+
+  return 0;
+}
+
+/*============================================================================*/
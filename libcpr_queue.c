@@ -0,0 +1,435 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, asynchronous job queue.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * All storage is allocated up front when the queue is created: one slot per
+ * job of @c max_depth. A slot moves from the free list to the pending list on
+ * submit, is taken off the pending list by a worker, placed on the completed
+ * list when the clone returns, and goes back on the free list when reaped. All
+ * three lists are protected by a single mutex; the clone itself runs with the
+ * mutex released.
+ *
+ * The eventfd counter is kept non-zero exactly while the completed list is
+ * non-empty. Both the worker that adds to an empty completed list and the
+ * reaper that empties it touch the eventfd with the mutex held, so the two
+ * can never disagree.
+ */
+
+#include "libcpr.h"
+
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*============================================================================*/
+
+/** A job slot. Lives on exactly one of the queue's lists at any time. */
+
+typedef struct _job_slot_t
+{
+  struct _job_slot_t *p_next;
+  qtm_clone_job_t     job;
+  int                 rc;
+  qtm_clone_stats_t   stats;
+} job_slot_t;
+
+/** Singly-linked FIFO of job slots. */
+
+typedef struct _slot_list_t
+{
+  job_slot_t *p_head;
+  job_slot_t *p_tail;
+} slot_list_t;
+
+/*============================================================================*/
+
+struct _qtm_clone_queue_t
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  work_cond; /**< Signalled when pending gains a job. */
+  pthread_cond_t  idle_cond; /**< Signalled when a job finishes running. */
+  slot_list_t     free_slots;
+  slot_list_t     pending;
+  slot_list_t     completed;
+  size_t          running;
+  bool            shutdown;
+  int             event_fd;
+  unsigned        num_workers;
+  pthread_t      *p_workers;
+  job_slot_t     *p_slots;
+};
+
+/*============================================================================*/
+
+/**
+ * Append @p p_slot to the tail of @p p_list.
+ */
+
+static void slot_list_push (slot_list_t *p_list, job_slot_t *p_slot)
+{
+  p_slot->p_next = NULL;
+
+  if (p_list->p_tail != NULL)
+  {
+    p_list->p_tail->p_next = p_slot;
+  }
+  else
+  {
+    p_list->p_head = p_slot;
+  }
+
+  p_list->p_tail = p_slot;
+}
+
+/*============================================================================*/
+
+/**
+ * Remove and return the head of @p p_list, or NULL if it is empty.
+ */
+
+static job_slot_t *slot_list_pop (slot_list_t *p_list)
+{
+  job_slot_t *p_slot = p_list->p_head;
+
+  if (p_slot != NULL)
+  {
+    p_list->p_head = p_slot->p_next;
+
+    if (p_list->p_head == NULL)
+    {
+      p_list->p_tail = NULL;
+    }
+
+    p_slot->p_next = NULL;
+  }
+
+  return p_slot;
+}
+
+/*============================================================================*/
+
+/**
+ * Run the clone described by @p p_job.
+ *
+ * @return The clone function's return value.
+ */
+
+static int run_job (const qtm_clone_job_t *p_job)
+{
+  int rc = EINVAL;
+
+  switch (p_job->mode)
+  {
+    case QTM_CLONE_MODE_FILE:
+    {
+      rc = qtm_clone_file(p_job->src_fd, p_job->dst_fd,
+                          p_job->fallback_copy,
+                          p_job->fallback_copy_block_size);
+      break;
+    }
+
+    case QTM_CLONE_MODE_RANGE:
+    {
+      rc = qtm_clone_file_range(p_job->src_fd, p_job->dst_fd,
+                                p_job->src_offset, p_job->dst_offset,
+                                p_job->length, p_job->fallback_copy,
+                                p_job->fallback_copy_block_size);
+      break;
+    }
+  }
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Worker thread body. Runs pending jobs until the queue is shut down and
+ * there is nothing left to do.
+ */
+
+static void *worker_main (void *p_arg)
+{
+  qtm_clone_queue_t *p_queue = p_arg;
+
+  pthread_mutex_lock(&p_queue->lock);
+
+  for (;;)
+  {
+    job_slot_t *p_slot = slot_list_pop(&p_queue->pending);
+
+    if (p_slot == NULL)
+    {
+      if (p_queue->shutdown)
+      {
+        break;
+      }
+
+      pthread_cond_wait(&p_queue->work_cond, &p_queue->lock);
+      continue;
+    }
+
+    p_queue->running++;
+    pthread_mutex_unlock(&p_queue->lock);
+
+    p_slot->rc = run_job(&p_slot->job);
+    qtm_clone_last_stats(&p_slot->stats);
+
+    pthread_mutex_lock(&p_queue->lock);
+    p_queue->running--;
+
+    if (p_queue->completed.p_head == NULL)
+    {
+      /* First result on an empty list: make the eventfd readable. The write
+       * cannot fail short of the counter overflowing, which it can't as we
+       * never add more than one before the reaper clears it.
+       */
+      const uint64_t one = 1;
+      (void)!write(p_queue->event_fd, &one, sizeof(one));
+    }
+
+    slot_list_push(&p_queue->completed, p_slot);
+    pthread_cond_broadcast(&p_queue->idle_cond);
+  }
+
+  pthread_mutex_unlock(&p_queue->lock);
+
+  return NULL;
+}
+
+/*============================================================================*/
+
+int qtm_clone_queue_create (const unsigned      num_workers,
+                            const size_t        max_depth,
+                            qtm_clone_queue_t **pp_queue)
+{
+  if (num_workers == 0 || max_depth == 0 || pp_queue == NULL)
+  {
+    return EINVAL;
+  }
+
+  qtm_clone_queue_t *p_queue = calloc(1, sizeof(*p_queue));
+
+  if (p_queue == NULL)
+  {
+    return ENOMEM;
+  }
+
+  p_queue->p_slots   = calloc(max_depth, sizeof(job_slot_t));
+  p_queue->p_workers = calloc(num_workers, sizeof(pthread_t));
+
+  if (p_queue->p_slots == NULL || p_queue->p_workers == NULL)
+  {
+    free(p_queue->p_slots);
+    free(p_queue->p_workers);
+    free(p_queue);
+    return ENOMEM;
+  }
+
+  for (size_t i = 0; i < max_depth; i++)
+  {
+    slot_list_push(&p_queue->free_slots, &p_queue->p_slots[i]);
+  }
+
+  int rc = 0;
+
+  p_queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (p_queue->event_fd < 0)
+  {
+    rc = errno;
+    free(p_queue->p_slots);
+    free(p_queue->p_workers);
+    free(p_queue);
+    return rc;
+  }
+
+  pthread_mutex_init(&p_queue->lock, NULL);
+  pthread_cond_init(&p_queue->work_cond, NULL);
+  pthread_cond_init(&p_queue->idle_cond, NULL);
+
+  for (unsigned i = 0; i < num_workers; i++)
+  {
+    rc = pthread_create(&p_queue->p_workers[i], NULL, worker_main, p_queue);
+
+    if (rc != 0)
+    {
+      break;
+    }
+
+    p_queue->num_workers++;
+  }
+
+  if (rc != 0)
+  {
+    /* Tear down whatever workers did start. There are no jobs yet so this
+     * does not block.
+     */
+    qtm_clone_queue_destroy(p_queue);
+    return rc;
+  }
+
+  *pp_queue = p_queue;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+int qtm_clone_queue_event_fd (const qtm_clone_queue_t *p_queue)
+{
+  return (p_queue != NULL) ? p_queue->event_fd : -1;
+}
+
+/*============================================================================*/
+
+int qtm_clone_queue_submit (qtm_clone_queue_t     *p_queue,
+                            const qtm_clone_job_t *p_job)
+{
+  if (p_queue == NULL || p_job == NULL)
+  {
+    return EINVAL;
+  }
+
+  int rc = 0;
+
+  pthread_mutex_lock(&p_queue->lock);
+
+  job_slot_t *p_slot = NULL;
+
+  if (p_queue->shutdown)
+  {
+    rc = ESHUTDOWN;
+  }
+  else if ((p_slot = slot_list_pop(&p_queue->free_slots)) == NULL)
+  {
+    rc = EAGAIN;
+  }
+  else
+  {
+    p_slot->job = *p_job;
+    p_slot->rc  = 0;
+    slot_list_push(&p_queue->pending, p_slot);
+    pthread_cond_signal(&p_queue->work_cond);
+  }
+
+  pthread_mutex_unlock(&p_queue->lock);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+int qtm_clone_queue_reap (qtm_clone_queue_t  *p_queue,
+                          qtm_clone_result_t *p_results,
+                          const size_t        max_results,
+                          size_t             *p_num_reaped)
+{
+  if (p_queue == NULL || p_num_reaped == NULL ||
+      (p_results == NULL && max_results != 0))
+  {
+    return EINVAL;
+  }
+
+  size_t num_reaped = 0;
+
+  pthread_mutex_lock(&p_queue->lock);
+
+  while (num_reaped < max_results)
+  {
+    job_slot_t *p_slot = slot_list_pop(&p_queue->completed);
+
+    if (p_slot == NULL)
+    {
+      break;
+    }
+
+    p_results[num_reaped].p_user_data = p_slot->job.p_user_data;
+    p_results[num_reaped].rc          = p_slot->rc;
+    p_results[num_reaped].stats       = p_slot->stats;
+    num_reaped++;
+
+    slot_list_push(&p_queue->free_slots, p_slot);
+  }
+
+  if (num_reaped > 0 && p_queue->completed.p_head == NULL)
+  {
+    /* Drained the list, so clear the eventfd. EAGAIN is impossible here as
+     * the counter was set when the list became non-empty.
+     */
+    uint64_t count;
+    (void)!read(p_queue->event_fd, &count, sizeof(count));
+  }
+
+  pthread_mutex_unlock(&p_queue->lock);
+
+  *p_num_reaped = num_reaped;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+int qtm_clone_queue_destroy (qtm_clone_queue_t *p_queue)
+{
+  if (p_queue == NULL)
+  {
+    return EINVAL;
+  }
+
+  pthread_mutex_lock(&p_queue->lock);
+
+  while (p_queue->pending.p_head != NULL || p_queue->running > 0)
+  {
+    pthread_cond_wait(&p_queue->idle_cond, &p_queue->lock);
+  }
+
+  p_queue->shutdown = true;
+  pthread_cond_broadcast(&p_queue->work_cond);
+  pthread_mutex_unlock(&p_queue->lock);
+
+  for (unsigned i = 0; i < p_queue->num_workers; i++)
+  {
+    pthread_join(p_queue->p_workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&p_queue->idle_cond);
+  pthread_cond_destroy(&p_queue->work_cond);
+  pthread_mutex_destroy(&p_queue->lock);
+  close(p_queue->event_fd);
+  free(p_queue->p_workers);
+  free(p_queue->p_slots);
+  free(p_queue);
+
+  return 0;
+}
+
+/*============================================================================*/
@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, I/O throttle.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * Each bucket is allowed to go into debt. A caller takes what it needs
+ * unconditionally, then sleeps for as long as it takes the bucket to climb
+ * back to zero. This keeps the lock hold time to a handful of arithmetic
+ * operations (nobody sleeps with it held) and hands out the allowance in the
+ * order callers arrive, so concurrent copies share it fairly.
+ */
+
+#include "libcpr_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*============================================================================*/
+
+/** One token bucket. A rate of zero means unlimited. */
+
+typedef struct _bucket_t
+{
+  double rate;   /**< Tokens added per second. */
+  double burst;  /**< Most tokens the bucket can hold. */
+  double tokens; /**< Current balance. Negative when in debt. */
+} bucket_t;
+
+/*============================================================================*/
+
+atomic_bool g_cpr_throttle_enabled = false;
+
+static pthread_mutex_t g_throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Time the buckets were last refilled, CLOCK_MONOTONIC nanoseconds. */
+
+static uint64_t g_last_refill_ns;
+
+static bucket_t g_byte_bucket;
+static bucket_t g_op_bucket;
+
+/*============================================================================*/
+
+/**
+ * Configure @p p_bucket for @p rate with @p burst, starting full.
+ */
+
+static void bucket_init (bucket_t *p_bucket, const uint64_t rate,
+                         const uint64_t burst)
+{
+  p_bucket->rate   = (double)rate;
+  p_bucket->burst  = (double)((burst != 0) ? burst : rate);
+  p_bucket->tokens = p_bucket->burst;
+}
+
+/*============================================================================*/
+
+/**
+ * Add @p elapsed_s seconds worth of tokens to @p p_bucket, take @p amount
+ * out and return how many seconds the caller must wait for the balance to
+ * reach zero again.
+ */
+
+static double bucket_take (bucket_t     *p_bucket,
+                           const double  elapsed_s,
+                           const uint64_t amount)
+{
+  if (p_bucket->rate == 0.0)
+  {
+    return 0.0;
+  }
+
+  p_bucket->tokens += elapsed_s * p_bucket->rate;
+
+  if (p_bucket->tokens > p_bucket->burst)
+  {
+    p_bucket->tokens = p_bucket->burst;
+  }
+
+  p_bucket->tokens -= (double)amount;
+
+  return (p_bucket->tokens < 0.0) ? -p_bucket->tokens / p_bucket->rate : 0.0;
+}
+
+/*============================================================================*/
+
+void cpr_throttle_wait (const uint64_t bytes, const uint64_t ops)
+{
+  pthread_mutex_lock(&g_throttle_lock);
+
+  const uint64_t now_ns    = cpr_trace_clock_ns();
+  const double   elapsed_s = (double)(now_ns - g_last_refill_ns) / 1e9;
+
+  g_last_refill_ns = now_ns;
+
+  const double byte_wait_s = bucket_take(&g_byte_bucket, elapsed_s, bytes);
+  const double op_wait_s   = bucket_take(&g_op_bucket,   elapsed_s, ops);
+
+  pthread_mutex_unlock(&g_throttle_lock);
+
+  const double wait_s = MAX(byte_wait_s, op_wait_s);
+
+  if (wait_s > 0.0)
+  {
+    struct timespec ts =
+    {
+      .tv_sec  = (time_t)wait_s,
+      .tv_nsec = (long)((wait_s - (double)(time_t)wait_s) * 1e9)
+    };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+  }
+}
+
+/*============================================================================*/
+
+int qtm_set_throttle (const uint64_t bytes_per_sec,
+                      const uint64_t ops_per_sec,
+                      const uint64_t burst_bytes,
+                      const uint64_t burst_ops)
+{
+  pthread_mutex_lock(&g_throttle_lock);
+
+  bucket_init(&g_byte_bucket, bytes_per_sec, burst_bytes);
+  bucket_init(&g_op_bucket, ops_per_sec, burst_ops);
+  g_last_refill_ns = cpr_trace_clock_ns();
+
+  atomic_store(&g_cpr_throttle_enabled, bytes_per_sec != 0 || ops_per_sec != 0);
+
+  pthread_mutex_unlock(&g_throttle_lock);
+
+  return 0;
+}
+
+/*============================================================================*/
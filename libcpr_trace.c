@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, tracing hooks.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "libcpr_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*============================================================================*/
+
+_Atomic(qtm_trace_fn_t) g_cpr_trace_fn = NULL;
+
+/** User data for #g_cpr_trace_fn. */
+
+static _Atomic(void *) gp_trace_user_data = NULL;
+
+/**
+ * Count of changes to the hook, odd while one is being made. Lets
+ * cpr_trace_emit() read #g_cpr_trace_fn and #gp_trace_user_data as a pair
+ * without a lock, retrying if a change overlapped its reads, so that an event
+ * never reaches one hook with the user data of another.
+ */
+
+static atomic_uint g_trace_seq = 0;
+
+/** Serialises qtm_set_trace_hook(). Never taken by cpr_trace_emit(). */
+
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*============================================================================*/
+
+uint64_t cpr_trace_clock_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)ts.tv_sec * UINT64_C(1000000000)) + (uint64_t)ts.tv_nsec;
+}
+
+/*============================================================================*/
+
+void cpr_trace_emit (const qtm_trace_op_t op,
+                     const int            fd,
+                     const int            src_fd,
+                     const off_t          offset,
+                     const size_t         length,
+                     const ssize_t        result,
+                     const uint64_t       start_ns)
+{
+  const int      saved_errno = errno;
+  const uint64_t end_ns      = cpr_trace_clock_ns();
+  qtm_trace_fn_t trace_fn    = NULL;
+  void          *p_user_data = NULL;
+  unsigned       seq         = 0;
+
+  do
+  {
+    seq         = atomic_load_explicit(&g_trace_seq, memory_order_acquire);
+    trace_fn    = atomic_load_explicit(&g_cpr_trace_fn, memory_order_relaxed);
+    p_user_data = atomic_load_explicit(&gp_trace_user_data,
+                                       memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) != 0 ||
+           seq != atomic_load_explicit(&g_trace_seq, memory_order_relaxed));
+
+  /* The hook may have been removed between the caller's check and here. */
+  if (trace_fn != NULL)
+  {
+    const qtm_trace_event_t event =
+    {
+      .op       = op,
+      .fd       = fd,
+      .src_fd   = src_fd,
+      .offset   = offset,
+      .length   = length,
+      .result   = result,
+      .error    = (result < 0) ? saved_errno : 0,
+      .start_ns = start_ns,
+      .end_ns   = end_ns
+    };
+
+    trace_fn(&event, p_user_data);
+  }
+
+  errno = saved_errno;
+}
+
+/*============================================================================*/
+
+void qtm_set_trace_hook (qtm_trace_fn_t trace_fn, void *p_user_data)
+{
+  pthread_mutex_lock(&g_trace_lock);
+
+  const unsigned seq = atomic_load_explicit(&g_trace_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&g_trace_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  atomic_store_explicit(&gp_trace_user_data, p_user_data, memory_order_relaxed);
+  atomic_store_explicit(&g_cpr_trace_fn, trace_fn, memory_order_relaxed);
+
+  atomic_store_explicit(&g_trace_seq, seq + 2, memory_order_release);
+
+  pthread_mutex_unlock(&g_trace_lock);
+}
+
+/*============================================================================*/
@@ -0,0 +1,810 @@
+/**
+ * Copyright (c) 2018-2019. Quantum Corporation. All Rights Reserved.
+ * DXi, StorNext and Quantum are either a trademarks or registered
+ * trademarks of Quantum Corporation in the US and/or other countries.
+ *
+ * @brief FICLONE/FICLONERANGE test library, clone verification and
+ *        comparison.
+ *
+ * @note This file is standard C11. It does not use any Quantum-specific
+ *       code or libraries so it can be called on BTRFS/ext4/XFS file-systems
+ *       on non-DXi platforms. Compile with @e -D_GNU_SOURCE=1.
+ *
+ * @section license License
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * @section notes Notes
+ *
+ * Each file's extent map is read through a cursor holding a window of up to
+ * VERIFY_EXTENTS extents, refilled from the current position once the walk
+ * passes the end of the window. The walk advances both cursors by the length
+ * of the shorter of the two current segments (extent or hole), so every step
+ * covers a range that is uniformly mapped, or uniformly a hole, in each file.
+ *
+ * A comparison walks the same cursors, under a lock, to hand out the pieces
+ * of the range that have to be read, one thread at a time. The threads read
+ * and compare their pieces outside the lock. Pieces are handed out in order,
+ * so when a thread finds a difference every piece before it has already been
+ * handed out, and no further piece is: the first difference found by the
+ * time the last thread finishes is the first in the range.
+ *
+ * The comparison kernel is chosen when each comparison starts, from what the
+ * CPU running it supports, so the library can be built for any x86-64 and
+ * still use AVX2 where it is there.
+ */
+
+#include "libcpr_internal.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*============================================================================*/
+
+/** Extents fetched per FIEMAP call. */
+
+#define VERIFY_EXTENTS 256
+
+/** Bytes qtm_clone_compare() reads from each file at a time. */
+
+#define COMPARE_PIECE ((size_t)1 << 20)
+
+/*============================================================================*/
+
+/** Position in the extent map of one file. */
+
+typedef struct _extent_cursor_t
+{
+  int            fd;
+  uint64_t       end;   /**< End of the range of interest. */
+  unsigned       index; /**< Current extent in @c p_map. */
+  bool           last;  /**< No extents follow those in @c p_map. */
+  struct fiemap *p_map;
+} extent_cursor_t;
+
+/** Part of a file that is either a single extent or a hole. */
+
+typedef struct _extent_segment_t
+{
+  uint64_t length;    /**< Bytes from the cursor position to the end. */
+  uint64_t physical;  /**< Address of the cursor position if mapped. */
+  bool     mapped;
+  bool     addressed; /**< Mapped and @c physical is meaningful. */
+  bool     zero;      /**< Reads as zeros: a hole or unwritten extent. */
+} extent_segment_t;
+
+/*============================================================================*/
+
+/**
+ * Fetch the extents of @p p_cursor's file from @p pos onwards.
+ */
+
+static int cursor_fill (extent_cursor_t *p_cursor, const uint64_t pos)
+{
+  struct fiemap *p_map = p_cursor->p_map;
+
+  p_map->fm_start        = pos;
+  p_map->fm_length       = p_cursor->end - pos;
+  p_map->fm_flags        = FIEMAP_FLAG_SYNC;
+  p_map->fm_extent_count = VERIFY_EXTENTS;
+
+  if (cpr_sys_fiemap(p_cursor->fd, p_map) != 0)
+  {
+    return errno;
+  }
+
+  const unsigned mapped = p_map->fm_mapped_extents;
+
+  p_cursor->index = 0;
+  p_cursor->last  = mapped < VERIFY_EXTENTS ||
+                    (p_map->fm_extents[mapped - 1].fe_flags &
+                     FIEMAP_EXTENT_LAST) != 0;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Describe the segment of @p p_cursor's file starting at @p pos. Positions
+ * must not go backwards between calls.
+ */
+
+static int cursor_seek (extent_cursor_t  *p_cursor,
+                        const uint64_t    pos,
+                        extent_segment_t *p_segment)
+{
+  for (;;)
+  {
+    const struct fiemap *p_map = p_cursor->p_map;
+
+    while (p_cursor->index < p_map->fm_mapped_extents)
+    {
+      const struct fiemap_extent *p_extent =
+        &p_map->fm_extents[p_cursor->index];
+
+      if (p_extent->fe_logical + p_extent->fe_length <= pos)
+      {
+        p_cursor->index++;
+        continue;
+      }
+
+      if (p_extent->fe_logical > pos)
+      {
+        p_segment->length = p_extent->fe_logical - pos;
+        p_segment->mapped = false;
+        p_segment->zero   = true;
+      }
+      else
+      {
+        p_segment->length    = p_extent->fe_logical + p_extent->fe_length -
+                               pos;
+        p_segment->physical  = p_extent->fe_physical +
+                               (pos - p_extent->fe_logical);
+        p_segment->mapped    = true;
+        p_segment->addressed = (p_extent->fe_flags &
+                                CPR_FIEMAP_NO_ADDRESS) == 0;
+        p_segment->zero      = (p_extent->fe_flags &
+                                FIEMAP_EXTENT_UNWRITTEN) != 0;
+      }
+
+      return 0;
+    }
+
+    if (p_cursor->last)
+    {
+      p_segment->length = p_cursor->end - pos;
+      p_segment->mapped = false;
+      p_segment->zero   = true;
+      return 0;
+    }
+
+    int rc = cursor_fill(p_cursor, pos);
+
+    if (rc != 0)
+    {
+      return rc;
+    }
+  }
+}
+
+/*============================================================================*/
+
+int qtm_clone_verify (const int           src_fd,
+                      const int           dst_fd,
+                      const off_t         src_offset,
+                      const off_t         dst_offset,
+                      const size_t        length,
+                      qtm_clone_verify_t *p_verify)
+{
+  if (p_verify == NULL || src_offset < 0 || dst_offset < 0)
+  {
+    return EINVAL;
+  }
+
+  p_verify->shared_bytes   = 0;
+  p_verify->unshared_bytes = 0;
+  p_verify->hole_bytes     = 0;
+
+  uint64_t total = length;
+
+  if (total == 0)
+  {
+    struct stat src_stat;
+
+    if (fstat(src_fd, &src_stat) != 0)
+    {
+      return errno;
+    }
+
+    total = (src_stat.st_size > src_offset)
+            ? (uint64_t)(src_stat.st_size - src_offset) : 0;
+  }
+
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  const size_t map_size = sizeof(struct fiemap) +
+                          VERIFY_EXTENTS * sizeof(struct fiemap_extent);
+
+  extent_cursor_t src =
+  {
+    .fd    = src_fd,
+    .end   = (uint64_t)src_offset + total,
+    .p_map = calloc(1, map_size)
+  };
+
+  extent_cursor_t dst =
+  {
+    .fd    = dst_fd,
+    .end   = (uint64_t)dst_offset + total,
+    .p_map = calloc(1, map_size)
+  };
+
+  /* The maps start out empty, so the first seek on each fills them. */
+  int rc = (src.p_map == NULL || dst.p_map == NULL) ? ENOMEM : 0;
+
+  for (uint64_t pos = 0; rc == 0 && pos < total;)
+  {
+    extent_segment_t src_segment;
+    extent_segment_t dst_segment;
+
+    rc = cursor_seek(&src, src_offset + pos, &src_segment);
+
+    if (rc == 0)
+    {
+      rc = cursor_seek(&dst, dst_offset + pos, &dst_segment);
+    }
+
+    if (rc != 0)
+    {
+      break;
+    }
+
+    const uint64_t step = MIN(MIN(src_segment.length, dst_segment.length),
+                              total - pos);
+
+    if (!src_segment.mapped && !dst_segment.mapped)
+    {
+      p_verify->hole_bytes += step;
+    }
+    else if (src_segment.mapped && dst_segment.mapped &&
+             src_segment.addressed && dst_segment.addressed &&
+             src_segment.physical == dst_segment.physical)
+    {
+      p_verify->shared_bytes += step;
+    }
+    else
+    {
+      p_verify->unshared_bytes += step;
+    }
+
+    pos += step;
+  }
+
+  free(dst.p_map);
+  free(src.p_map);
+
+  return rc;
+}
+
+/*============================================================================*/
+
+/**
+ * Comparison kernel. Returns the number of leading bytes of @p p_a and
+ * @p p_b that are equal, @p length if all of them are.
+ */
+
+typedef size_t (*compare_fn_t) (const uint8_t *p_a,
+                                const uint8_t *p_b,
+                                const size_t   length);
+
+/** State shared by the threads of one qtm_clone_compare(). */
+
+typedef struct _compare_t
+{
+  /**
+   * Set before the threads start.
+   * @{
+   */
+  int                  src_fd;
+  int                  dst_fd;
+  uint64_t             src_offset;
+  uint64_t             dst_offset;
+  compare_fn_t         compare;
+  const uint8_t       *p_zeros; /**< COMPARE_PIECE bytes of zeros. */
+  bool                 mapped;  /**< Both extent maps can be read. */
+  /** @} */
+
+  /**
+   * Guarded by @c lock.
+   * @{
+   */
+  pthread_mutex_t      lock;
+  extent_cursor_t      src;
+  extent_cursor_t      dst;
+  uint64_t             pos;      /**< Start of the next piece. */
+  uint64_t             mismatch; /**< First difference found, or the end. */
+  int                  rc;
+  qtm_clone_compare_t *p_compare;
+  /** @} */
+} compare_t;
+
+/** Part of the range handed to one thread to read. */
+
+typedef struct _compare_piece_t
+{
+  uint64_t pos;      /**< Offset into the range. */
+  size_t   length;
+  bool     read_src; /**< Otherwise the source reads as zeros here. */
+  bool     read_dst; /**< Otherwise the destination reads as zeros here. */
+} compare_piece_t;
+
+/*============================================================================*/
+
+/**
+ * Portable comparison kernel, a word at a time.
+ */
+
+static size_t compare_words (const uint8_t *p_a,
+                             const uint8_t *p_b,
+                             const size_t   length)
+{
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+  {
+    uint64_t a;
+    uint64_t b;
+
+    memcpy(&a, p_a + i, sizeof(a));
+    memcpy(&b, p_b + i, sizeof(b));
+
+    if (a != b)
+    {
+      break;
+    }
+  }
+
+  while (i < length && p_a[i] == p_b[i])
+  {
+    i++;
+  }
+
+  return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*============================================================================*/
+
+/**
+ * SSE2 comparison kernel, 16 bytes at a time.
+ */
+
+__attribute__((target("sse2")))
+static size_t compare_sse2 (const uint8_t *p_a,
+                            const uint8_t *p_b,
+                            const size_t   length)
+{
+  size_t i = 0;
+
+  for (; i + 16 <= length; i += 16)
+  {
+    const __m128i  a    = _mm_loadu_si128((const __m128i *)(p_a + i));
+    const __m128i  b    = _mm_loadu_si128((const __m128i *)(p_b + i));
+    const unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+    if (same != 0xFFFF)
+    {
+      return i + (size_t)__builtin_ctz(~same);
+    }
+  }
+
+  return i + compare_words(p_a + i, p_b + i, length - i);
+}
+
+/*============================================================================*/
+
+/**
+ * AVX2 comparison kernel, 64 bytes at a time. The two halves are tested
+ * together so that only a difference costs a second test.
+ */
+
+__attribute__((target("avx2")))
+static size_t compare_avx2 (const uint8_t *p_a,
+                            const uint8_t *p_b,
+                            const size_t   length)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= length; i += 64)
+  {
+    const __m256i a_0    = _mm256_loadu_si256((const __m256i *)(p_a + i));
+    const __m256i b_0    = _mm256_loadu_si256((const __m256i *)(p_b + i));
+    const __m256i a_1    = _mm256_loadu_si256((const __m256i *)(p_a + i + 32));
+    const __m256i b_1    = _mm256_loadu_si256((const __m256i *)(p_b + i + 32));
+    const __m256i same_0 = _mm256_cmpeq_epi8(a_0, b_0);
+    const __m256i same_1 = _mm256_cmpeq_epi8(a_1, b_1);
+
+    if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(same_0, same_1)) !=
+        UINT32_MAX)
+    {
+      const uint32_t mask_0 = (uint32_t)_mm256_movemask_epi8(same_0);
+      const uint32_t mask_1 = (uint32_t)_mm256_movemask_epi8(same_1);
+
+      return (mask_0 != UINT32_MAX) ? i + (size_t)__builtin_ctz(~mask_0)
+                                    : i + 32 + (size_t)__builtin_ctz(~mask_1);
+    }
+  }
+
+  return i + compare_sse2(p_a + i, p_b + i, length - i);
+}
+
+#endif
+
+/*============================================================================*/
+
+/**
+ * Return the fastest comparison kernel the running CPU supports.
+ */
+
+static compare_fn_t compare_select (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return compare_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    return compare_sse2;
+  }
+#endif
+
+  return compare_words;
+}
+
+/*============================================================================*/
+
+/**
+ * Hand out the next piece of the range that has to be read, counting what
+ * is skipped on the way. Call with @c lock held.
+ *
+ * @return False once nothing is left to read, a difference having been
+ *         found before it or a thread having failed.
+ */
+
+static bool compare_claim (compare_t *p_cmp, compare_piece_t *p_piece)
+{
+  while (p_cmp->rc == 0 && p_cmp->pos < p_cmp->mismatch)
+  {
+    const uint64_t pos      = p_cmp->pos;
+    uint64_t       step     = MIN(p_cmp->mismatch - pos, COMPARE_PIECE);
+    bool           read_src = true;
+    bool           read_dst = true;
+
+    if (p_cmp->mapped)
+    {
+      extent_segment_t src_segment;
+      extent_segment_t dst_segment;
+
+      int rc = cursor_seek(&p_cmp->src, p_cmp->src_offset + pos,
+                           &src_segment);
+
+      if (rc == 0)
+      {
+        rc = cursor_seek(&p_cmp->dst, p_cmp->dst_offset + pos, &dst_segment);
+      }
+
+      if (rc != 0)
+      {
+        p_cmp->rc = rc;
+        break;
+      }
+
+      step = MIN(step, MIN(src_segment.length, dst_segment.length));
+
+      if (src_segment.zero && dst_segment.zero)
+      {
+        p_cmp->p_compare->hole_bytes += step;
+        p_cmp->pos                   += step;
+        continue;
+      }
+
+      /* Encoded extents are never addressed, since ranges of different
+       * data within one of them report the same address.
+       */
+      if (src_segment.mapped && dst_segment.mapped &&
+          src_segment.addressed && dst_segment.addressed &&
+          src_segment.physical == dst_segment.physical)
+      {
+        p_cmp->p_compare->shared_bytes += step;
+        p_cmp->pos                     += step;
+        continue;
+      }
+
+      read_src = !src_segment.zero;
+      read_dst = !dst_segment.zero;
+    }
+
+    p_piece->pos      = pos;
+    p_piece->length   = (size_t)step;
+    p_piece->read_src = read_src;
+    p_piece->read_dst = read_dst;
+
+    p_cmp->pos += step;
+
+    return true;
+  }
+
+  return false;
+}
+
+/*============================================================================*/
+
+/**
+ * Read up to @p length bytes of @p fd at @p offset into @p p_buf, stopping
+ * early only at the end of the file.
+ */
+
+static int compare_read (const int      fd,
+                         uint8_t       *p_buf,
+                         const size_t   length,
+                         const uint64_t offset,
+                         size_t        *p_got)
+{
+  size_t got = 0;
+
+  while (got < length)
+  {
+    const ssize_t got_now = cpr_sys_pread(fd, p_buf + got, length - got,
+                                          (off_t)(offset + got));
+
+    if (got_now < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (got_now < 0)
+    {
+      return errno;
+    }
+    else if (got_now == 0)
+    {
+      break;
+    }
+
+    got += (size_t)got_now;
+  }
+
+  *p_got = got;
+
+  return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Comparison thread. Reads and compares pieces until none are left.
+ */
+
+static void *compare_worker (void *p_arg)
+{
+  compare_t *p_cmp     = p_arg;
+  uint8_t   *p_src_buf = malloc(COMPARE_PIECE);
+  uint8_t   *p_dst_buf = malloc(COMPARE_PIECE);
+  int        rc        = (p_src_buf == NULL || p_dst_buf == NULL) ? ENOMEM
+                                                                  : 0;
+
+  while (rc == 0)
+  {
+    compare_piece_t piece;
+
+    pthread_mutex_lock(&p_cmp->lock);
+    const bool claimed = compare_claim(p_cmp, &piece);
+    pthread_mutex_unlock(&p_cmp->lock);
+
+    if (!claimed)
+    {
+      break;
+    }
+
+    /* A file that shrank since the range was sized reads short, which
+     * differs from wherever it ends.
+     */
+    const uint8_t *p_src   = p_cmp->p_zeros;
+    const uint8_t *p_dst   = p_cmp->p_zeros;
+    size_t         src_got = piece.length;
+    size_t         dst_got = piece.length;
+
+    if (piece.read_src)
+    {
+      rc    = compare_read(p_cmp->src_fd, p_src_buf, piece.length,
+                           p_cmp->src_offset + piece.pos, &src_got);
+      p_src = p_src_buf;
+    }
+
+    if (rc == 0 && piece.read_dst)
+    {
+      rc    = compare_read(p_cmp->dst_fd, p_dst_buf, piece.length,
+                           p_cmp->dst_offset + piece.pos, &dst_got);
+      p_dst = p_dst_buf;
+    }
+
+    if (rc != 0)
+    {
+      break;
+    }
+
+    const size_t same = p_cmp->compare(p_src, p_dst, MIN(src_got, dst_got));
+
+    pthread_mutex_lock(&p_cmp->lock);
+
+    p_cmp->p_compare->read_bytes += piece.length;
+
+    if (same < piece.length && piece.pos + same < p_cmp->mismatch)
+    {
+      p_cmp->mismatch = piece.pos + same;
+    }
+
+    pthread_mutex_unlock(&p_cmp->lock);
+  }
+
+  if (rc != 0)
+  {
+    pthread_mutex_lock(&p_cmp->lock);
+    p_cmp->rc = (p_cmp->rc == 0) ? rc : p_cmp->rc;
+    pthread_mutex_unlock(&p_cmp->lock);
+  }
+
+  free(p_dst_buf);
+  free(p_src_buf);
+
+  return NULL;
+}
+
+/*============================================================================*/
+
+int qtm_clone_compare (const int            src_fd,
+                       const int            dst_fd,
+                       const off_t          src_offset,
+                       const off_t          dst_offset,
+                       const size_t         length,
+                       const unsigned       num_threads,
+                       qtm_clone_compare_t *p_compare)
+{
+  if (p_compare == NULL || src_offset < 0 || dst_offset < 0)
+  {
+    return EINVAL;
+  }
+
+  *p_compare = (qtm_clone_compare_t) { .equal = true };
+
+  struct stat src_stat;
+  struct stat dst_stat;
+
+  if (fstat(src_fd, &src_stat) != 0 || fstat(dst_fd, &dst_stat) != 0)
+  {
+    return errno;
+  }
+
+  const uint64_t src_left = (src_stat.st_size > src_offset)
+                            ? (uint64_t)(src_stat.st_size - src_offset) : 0;
+  const uint64_t dst_left = (dst_stat.st_size > dst_offset)
+                            ? (uint64_t)(dst_stat.st_size - dst_offset) : 0;
+  const uint64_t total    = (length != 0) ? length : src_left;
+
+  /* Only the part of the range that both files hold is read. */
+  const uint64_t present  = MIN(total, MIN(src_left, dst_left));
+
+  if (present == 0)
+  {
+    p_compare->equal           = (total == 0);
+    p_compare->mismatch_offset = 0;
+    return 0;
+  }
+
+  const size_t map_size = sizeof(struct fiemap) +
+                          VERIFY_EXTENTS * sizeof(struct fiemap_extent);
+
+  compare_t cmp =
+  {
+    .src_fd     = src_fd,
+    .dst_fd     = dst_fd,
+    .src_offset = (uint64_t)src_offset,
+    .dst_offset = (uint64_t)dst_offset,
+    .compare    = compare_select(),
+    .p_zeros    = calloc(1, COMPARE_PIECE),
+    .mapped     = true,
+    .src        =
+    {
+      .fd    = src_fd,
+      .end   = (uint64_t)src_offset + present,
+      .p_map = calloc(1, map_size)
+    },
+    .dst        =
+    {
+      .fd    = dst_fd,
+      .end   = (uint64_t)dst_offset + present,
+      .p_map = calloc(1, map_size)
+    },
+    .pos        = 0,
+    .mismatch   = present,
+    .rc         = 0,
+    .p_compare  = p_compare
+  };
+
+  int rc = (cmp.p_zeros == NULL || cmp.src.p_map == NULL ||
+            cmp.dst.p_map == NULL) ? ENOMEM : 0;
+
+  /* Fill both maps up front, so that a file system without FIEMAP is found
+   * before any thread starts and the whole range is read instead.
+   */
+  if (rc == 0)
+  {
+    rc = cursor_fill(&cmp.src, cmp.src_offset);
+
+    if (rc == 0)
+    {
+      rc = cursor_fill(&cmp.dst, cmp.dst_offset);
+    }
+
+    if (rc == EOPNOTSUPP)
+    {
+      cmp.mapped = false;
+      rc         = 0;
+    }
+  }
+
+  if (rc == 0)
+  {
+    const uint64_t num_pieces = (present + COMPARE_PIECE - 1) / COMPARE_PIECE;
+    const unsigned wanted     = (unsigned)MIN(MAX(num_threads, 1),
+                                              num_pieces);
+    pthread_t     *p_threads  = malloc(wanted * sizeof(*p_threads));
+    unsigned       started    = 0;
+
+    rc = (p_threads == NULL) ? ENOMEM : 0;
+
+    if (rc == 0)
+    {
+      pthread_mutex_init(&cmp.lock, NULL);
+
+      /* Too few threads only makes the comparison slower. */
+      while (started + 1 < wanted &&
+             pthread_create(&p_threads[started], NULL, compare_worker,
+                            &cmp) == 0)
+      {
+        started++;
+      }
+
+      compare_worker(&cmp);
+
+      for (unsigned i = 0; i < started; i++)
+      {
+        pthread_join(p_threads[i], NULL);
+      }
+
+      pthread_mutex_destroy(&cmp.lock);
+
+      rc = cmp.rc;
+    }
+
+    free(p_threads);
+  }
+
+  if (rc == 0 && (cmp.mismatch < present || present < total))
+  {
+    p_compare->equal           = false;
+    p_compare->mismatch_offset = cmp.mismatch;
+  }
+
+  free(cmp.dst.p_map);
+  free(cmp.src.p_map);
+  free((uint8_t *)cmp.p_zeros);
+
+  return rc;
+}
+
+/*============================================================================*/